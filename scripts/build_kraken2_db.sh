@@ -31,10 +31,6 @@ function report_time_elapsed() {
        $1 $curr_time
 }
 
-function list_sequence_files() {
-  find library/ '(' -name '*.fna' -o -name '*.faa' ')' -print0
-}
-
 start_time=$(get_current_time)
 
 DATABASE_DIR="$KRAKEN2_DB_NAME"
@@ -81,7 +77,13 @@ else
   grep "^TAXID" taxonomy/prelim_map.txt | cut -f 2- > $seqid2taxid_map_file.tmp || true
   if grep "^ACCNUM" taxonomy/prelim_map.txt | cut -f 2- > accmap_file.tmp; then
     if compgen -G "taxonomy/*.accession2taxid" > /dev/null; then
-      lookup_accession_numbers accmap_file.tmp taxonomy/*.accession2taxid > seqid2taxid_acc.tmp
+      accmap_files=taxonomy/*.accession2taxid
+      # Use the index unless a map has changed since it was built
+      if [ -e "taxonomy/accession2taxid.k2i" ] && [ -z "$(find taxonomy/ -maxdepth 1 \
+           -name '*.accession2taxid' -newer taxonomy/accession2taxid.k2i)" ]; then
+        accmap_files=taxonomy/accession2taxid.k2i
+      fi
+      lookup_accession_numbers -p $KRAKEN2_THREAD_CT accmap_file.tmp $accmap_files > seqid2taxid_acc.tmp
       cat seqid2taxid_acc.tmp >> $seqid2taxid_map_file.tmp
       rm seqid2taxid_acc.tmp
     else
@@ -95,47 +97,95 @@ else
   echo "Sequence ID to taxonomy ID map complete. [$(report_time_elapsed $step_time)]"
 fi
 
-echo "Estimating required capacity (step 2)..."
-
-step_time=$(get_current_time)
-estimate=$(list_sequence_files | xargs -0 cat | estimate_capacity -k $KRAKEN2_KMER_LEN -l $KRAKEN2_MINIMIZER_LEN -S $KRAKEN2_SEED_TEMPLATE -p $KRAKEN2_THREAD_CT $KRAKEN2XFLAG )
-# Slight upward adjustment of distinct minimizer estimate to protect
-# against crash w/ small reference sets
-estimate=$(( estimate + 8192 ))
-required_capacity=$(perl -le 'print int(shift() / shift())' $estimate $KRAKEN2_LOAD_FACTOR);
-
-echo "Estimated hash table requirement: $(( required_capacity * 4 )) bytes"
-
 max_db_flag=""
-if [ -n "$KRAKEN2_MAX_DB_SIZE" ]
+fast_build_flag=""
+if [ -n "$KRAKEN2_FAST_BUILD" ]
+then
+  fast_build_flag="-F"
+fi
+if [ -n "$KRAKEN2_COUNT_MINIMIZERS" ]
 then
-  if (( KRAKEN2_MAX_DB_SIZE < (required_capacity * 4) ))
+  # build_db counts the distinct minimizers in its sorted runs and sizes
+  # the table from that; it downsamples if the table would exceed -M
+  capacity_flag="-a $KRAKEN2_LOAD_FACTOR"
+  if [ -n "$KRAKEN2_MAX_DB_SIZE" ]
   then
     max_db_flag="-M $(perl -le 'print int(shift() / 4)' $KRAKEN2_MAX_DB_SIZE)"
-    echo "Specifying lower maximum hash table size of $KRAKEN2_MAX_DB_SIZE bytes"
   fi
-fi
+else
+  echo "Estimating required capacity (step 2)..."
 
-echo "Capacity estimation complete. [$(report_time_elapsed $step_time)]"
+  step_time=$(get_current_time)
+  sample_flag=""
+  if [ -n "$KRAKEN2_ESTIMATE_FRACTION" ]
+  then
+    sample_flag="-f $KRAKEN2_ESTIMATE_FRACTION"
+    # Sample whole files if there are enough of them, so that the rest
+    # aren't read; otherwise sample genomes within them
+    file_ct=$(find -L library/ -type f \( -name '*.fna' -o -name '*.faa' \
+      -o -name '*.fna.gz' -o -name '*.faa.gz' \) | wc -l)
+    if perl -e 'exit(shift() * shift() >= 32)' $file_ct $KRAKEN2_ESTIMATE_FRACTION
+    then
+      sample_flag="$sample_flag -g"
+    fi
+  fi
+  estimate=$(estimate_capacity -k $KRAKEN2_KMER_LEN -l $KRAKEN2_MINIMIZER_LEN -S $KRAKEN2_SEED_TEMPLATE -p $KRAKEN2_THREAD_CT $sample_flag $KRAKEN2XFLAG library/)
+  # Slight upward adjustment of distinct minimizer estimate to protect
+  # against crash w/ small reference sets
+  estimate=$(( estimate + 8192 ))
+  required_capacity=$(perl -le 'print int(shift() / shift())' $estimate $KRAKEN2_LOAD_FACTOR);
+  capacity_flag="-c $required_capacity"
 
-echo "Building database files (step 3)..."
+  echo "Estimated hash table requirement: $(( required_capacity * 4 )) bytes"
 
-fast_build_flag=""
-if [ -n "$KRAKEN2_FAST_BUILD" ]
-then
-  fast_build_flag="-F"
+  if [ -n "$KRAKEN2_MAX_DB_SIZE" ]
+  then
+    if (( KRAKEN2_MAX_DB_SIZE < (required_capacity * 4) ))
+    then
+      max_db_flag="-M $(perl -le 'print int(shift() / 4)' $KRAKEN2_MAX_DB_SIZE)"
+      echo "Specifying lower maximum hash table size of $KRAKEN2_MAX_DB_SIZE bytes"
+    fi
+  fi
+
+  echo "Capacity estimation complete. [$(report_time_elapsed $step_time)]"
 fi
 
+echo "Building database files (step 3)..."
+
 if [ -e "hash.k2d" ]
 then
   echo "Hash table already present, skipping database file build."
 else
+  external_build_flags=""
+  if [ -n "$KRAKEN2_MAX_BUILD_MEMORY" ]
+  then
+    external_build_flags="-L $KRAKEN2_MAX_BUILD_MEMORY"
+    echo "Building out of core with a memory limit of $KRAKEN2_MAX_BUILD_MEMORY bytes"
+  fi
+  if [ -n "$KRAKEN2_BUILD_TEMP_DIR" ]
+  then
+    external_build_flags="$external_build_flags -D $KRAKEN2_BUILD_TEMP_DIR"
+  fi
+  checkpoint_flags=""
+  if [ -n "$KRAKEN2_CHECKPOINT_INTERVAL" ]
+  then
+    checkpoint_flags="-C $KRAKEN2_CHECKPOINT_INTERVAL -R"
+    if [ -e "hash.k2d.tmp.checkpoint" ]
+    then
+      echo "Resuming database file build from checkpoint"
+    fi
+  fi
+  cache_flag=""
+  if [ -n "$KRAKEN2_MINIMIZER_CACHE" ]
+  then
+    cache_flag="-Y $KRAKEN2_MINIMIZER_CACHE"
+  fi
   step_time=$(get_current_time)
-  list_sequence_files | xargs -0 cat | \
-    build_db -k $KRAKEN2_KMER_LEN -l $KRAKEN2_MINIMIZER_LEN -S $KRAKEN2_SEED_TEMPLATE $KRAKEN2XFLAG \
-             -H hash.k2d.tmp -t taxo.k2d.tmp -o opts.k2d.tmp -n taxonomy/ -m $seqid2taxid_map_file \
-             -c $required_capacity -p $KRAKEN2_THREAD_CT $max_db_flag -B $KRAKEN2_BLOCK_SIZE -b $KRAKEN2_SUBBLOCK_SIZE \
-             -r $KRAKEN2_MIN_TAXID_BITS $fast_build_flag
+  build_db -k $KRAKEN2_KMER_LEN -l $KRAKEN2_MINIMIZER_LEN -S $KRAKEN2_SEED_TEMPLATE $KRAKEN2XFLAG \
+           -H hash.k2d.tmp -t taxo.k2d.tmp -o opts.k2d.tmp -n taxonomy/ -m $seqid2taxid_map_file \
+           $capacity_flag -p $KRAKEN2_THREAD_CT $max_db_flag -B $KRAKEN2_BLOCK_SIZE -b $KRAKEN2_SUBBLOCK_SIZE \
+           -r $KRAKEN2_MIN_TAXID_BITS $fast_build_flag $external_build_flags $checkpoint_flags $cache_flag \
+           library/
   finalize_file taxo.k2d
   finalize_file opts.k2d
   finalize_file hash.k2d
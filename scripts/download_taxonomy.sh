@@ -59,6 +59,26 @@ if ls | grep -q 'accession2taxid\.gz$'
 then
   1>&2 echo -n "Uncompressing taxonomy data..."
   gunzip *accession2taxid.gz
+  rm -f accession2taxid.k2i
+  1>&2 echo " done."
+fi
+
+if [ -n "$KRAKEN2_ACCESSION_INDEX" ] && ls | grep -q 'accession2taxid$' \
+  && [ ! -e "accession2taxid.k2i" ]
+then
+  # Sort within the build memory limit, or else half the memory available
+  memory_limit="$KRAKEN2_MAX_BUILD_MEMORY"
+  if [ -z "$memory_limit" ] && [ -r /proc/meminfo ]
+  then
+    memory_limit=$(perl -ne 'print int($1 * 512) if /^MemAvailable:\s+(\d+)/' /proc/meminfo)
+  fi
+  memory_flag=""
+  if [ -n "$memory_limit" ]
+  then
+    memory_flag="-M $memory_limit"
+  fi
+  1>&2 echo -n "Indexing accession to taxon maps..."
+  build_accession_index -p $KRAKEN2_THREAD_CT $memory_flag accession2taxid.k2i *.accession2taxid
   1>&2 echo " done."
 fi
 
@@ -66,6 +86,15 @@ if [ ! -e "taxdump.untarflag" ]
 then
   1>&2 echo -n "Untarring taxonomy tree data..."
   tar zxf taxdump.tar.gz
+  rm -f taxdump.k2s
   touch taxdump.untarflag
   1>&2 echo " done."
 fi
+
+if [ ! -e "taxdump.k2s" ] || [ "nodes.dmp" -nt "taxdump.k2s" ] \
+  || [ "names.dmp" -nt "taxdump.k2s" ]
+then
+  1>&2 echo -n "Saving taxonomy snapshot..."
+  build_taxonomy_snapshot -p $KRAKEN2_THREAD_CT .
+  1>&2 echo " done."
+fi
@@ -4,8 +4,9 @@
 #
 # This file is part of the Kraken 2 taxonomic sequence classification system.
 
-# Masks low complexity sequences in the database using the dustmasker (nucl.)
-# or segmasker (prot.) programs from NCBI.
+# Masks low-complexity sequences in the database using DUST (nucl.) or
+# SEG (prot.), with the same default parameters as NCBI's dustmasker and
+# segmasker programs.
 
 set -u  # Protect against uninitialized vars.
 set -e  # Stop on error
@@ -13,31 +14,31 @@ set -o pipefail  # Stop on failures in non-final pipeline commands
 
 target="$1"
 
-MASKER="dustmasker"
+MASKER_FLAGS="-p ${KRAKEN2_THREAD_CT:-1}"
 if [ -n "$KRAKEN2_PROTEIN_DB" ]; then
-  MASKER="segmasker"
-fi
-
-if ! which $MASKER > /dev/null; then
-  echo "Unable to find $MASKER in path, can't mask low-complexity sequences"
-  exit 1
+  MASKER_FLAGS="$MASKER_FLAGS -X"
 fi
 
 if [ -d $target ]; then
+  files=()
   for file in $(find $target '(' -name '*.fna' -o -name '*.faa' ')'); do
     if [ ! -e "$file.masked" ]; then
-      $MASKER -in $file -outfmt fasta | sed -e '/^>/!s/[a-z]/x/g' > "$file.tmp"
-      mv "$file.tmp" $file
-      touch "$file.masked"
+      files+=("$file")
     fi
   done
 elif [ -f $target ]; then
+  files=()
   if [ ! -e "$target.masked" ]; then
-    $MASKER -in $target -outfmt fasta | sed -e '/^>/!s/[a-z]/x/g' > "$target.tmp"
-    mv "$target.tmp" $target
-    touch "$target.masked"
+    files=("$target")
   fi
 else
   echo "Target $target must be directory or regular file, aborting masking"
   exit 1
 fi
+
+if [ ${#files[@]} -gt 0 ]; then
+  mask_low_complexity $MASKER_FLAGS "${files[@]}"
+  for file in "${files[@]}"; do
+    touch "$file.masked"
+  done
+fi
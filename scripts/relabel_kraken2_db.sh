@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+#
+# This file is part of the Kraken 2 taxonomic sequence classification system.
+
+# Relabels a built Kraken 2 database for the NCBI taxonomy in its taxonomy/
+# directory, without rescanning the library.
+# Designed to be called by kraken2-build
+
+set -u  # Protect against uninitialized vars.
+set -e  # Stop on error
+
+cd "$KRAKEN2_DB_NAME"
+for file in hash.k2d taxo.k2d taxonomy/nodes.dmp taxonomy/names.dmp
+do
+  if [ ! -e "$file" ]
+  then
+    1>&2 echo "Can't find $file in $KRAKEN2_DB_NAME"
+    exit 1
+  fi
+done
+
+trap 'rm -f hash.k2d.tmp taxo.k2d.tmp' EXIT
+relabel_db -p $KRAKEN2_THREAD_CT -n taxonomy/ hash.k2d taxo.k2d \
+  hash.k2d.tmp taxo.k2d.tmp
+
+# Replace both files together, putting the old pair back if any move fails
+mv hash.k2d hash.k2d.old
+if ! mv taxo.k2d taxo.k2d.old
+then
+  mv hash.k2d.old hash.k2d
+  exit 1
+fi
+if mv hash.k2d.tmp hash.k2d && mv taxo.k2d.tmp taxo.k2d
+then
+  rm -f hash.k2d.old taxo.k2d.old
+else
+  1>&2 echo "Unable to replace the database files; restoring the old ones"
+  mv -f hash.k2d.old hash.k2d
+  mv -f taxo.k2d.old taxo.k2d
+  exit 1
+fi
+1>&2 echo "Database relabeled for the new taxonomy"
@@ -0,0 +1,118 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#include "accession_index.h"
+
+using std::string;
+using std::vector;
+
+namespace kraken2 {
+
+vector<AccessionMapChunk> SplitAccessionMap(const char *data, size_t size,
+    size_t chunk_size)
+{
+  vector<AccessionMapChunk> chunks;
+  const char *begin = data, *end = data + size;
+  auto lf_ptr = (const char *) memchr(begin, '\n', end - begin);
+  if (lf_ptr != nullptr)
+    begin = lf_ptr + 1;
+  while (begin < end) {
+    const char *chunk_end = end;
+    if ((size_t) (end - begin) > chunk_size) {
+      lf_ptr = (const char *) memchr(begin + chunk_size, '\n',
+                                     end - begin - chunk_size);
+      if (lf_ptr != nullptr)
+        chunk_end = lf_ptr + 1;
+    }
+    chunks.push_back(AccessionMapChunk{begin, chunk_end});
+    begin = chunk_end;
+  }
+  return chunks;
+}
+
+constexpr const char *AccessionIndex::FILE_MAGIC;
+
+AccessionIndex::AccessionIndex()
+    : record_ct_(0), key_width_(0), partition_bits_(0),
+      partition_starts_(nullptr), records_(nullptr)
+{ }
+
+bool AccessionIndex::IsIndexFile(const string &filename) {
+  std::ifstream ifs(filename);
+  char magic[8] = { 0 };
+  ifs.read(magic, sizeof(magic));
+  return ifs && memcmp(magic, FILE_MAGIC, sizeof(magic)) == 0;
+}
+
+void AccessionIndex::OpenFile(const string &filename) {
+  index_file_.OpenFile(filename);
+  const char *ptr = index_file_.fptr();
+  size_t header_size = strlen(FILE_MAGIC) + 3 * sizeof(uint64_t);
+  if (index_file_.filesize() < header_size ||
+      strncmp(FILE_MAGIC, ptr, strlen(FILE_MAGIC)) != 0)
+    errx(EX_DATAERR, "malformed accession index file %s", filename.c_str());
+  ptr += strlen(FILE_MAGIC);
+  memcpy((char *) &record_ct_, ptr, sizeof(record_ct_));
+  ptr += sizeof(record_ct_);
+  memcpy((char *) &key_width_, ptr, sizeof(key_width_));
+  ptr += sizeof(key_width_);
+  memcpy((char *) &partition_bits_, ptr, sizeof(partition_bits_));
+  ptr += sizeof(partition_bits_);
+  size_t partition_ct = (size_t) 1 << partition_bits_;
+  if (partition_bits_ > 32 || index_file_.filesize() != header_size
+      + (partition_ct + 1) * sizeof(uint64_t)
+      + record_ct_ * (key_width_ + TAXID_SIZE))
+    errx(EX_DATAERR, "malformed accession index file %s", filename.c_str());
+  partition_starts_ = (const uint64_t *) ptr;
+  ptr += (partition_ct + 1) * sizeof(uint64_t);
+  records_ = ptr;
+}
+
+// FNV-1a; the partition is taken from the top bits
+uint64_t AccessionIndex::PartitionHash(const char *accession, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) accession[i];
+    hash *= 0x100000001b3ull;
+  }
+  hash ^= hash >> 29;
+  hash *= 0xbf58476d1ce4e5b9ull;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+const char *AccessionIndex::Find(const char *accession, size_t len) const {
+  if (record_ct_ == 0 || len > key_width_ || len == 0)
+    return nullptr;
+  size_t record_size = key_width_ + TAXID_SIZE;
+  uint64_t partition = partition_bits_ == 0 ? 0
+    : PartitionHash(accession, len) >> (64 - partition_bits_);
+  uint64_t lo = partition_starts_[partition];
+  uint64_t hi = partition_starts_[partition + 1];
+  // Binary search comparing the accession to each NUL-padded key
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    const char *key = records_ + mid * record_size;
+    int cmp = memcmp(key, accession, len);
+    if (cmp == 0 && len < key_width_ && key[len] != '\0')
+      cmp = 1;
+    if (cmp == 0)
+      return key;
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return nullptr;
+}
+
+taxid_t AccessionIndex::RecordTaxid(const char *record) const {
+  uint32_t taxid;
+  memcpy((char *) &taxid, record + key_width_, sizeof(taxid));
+  return taxid;
+}
+
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#ifndef KRAKEN2_ACCESSION_INDEX_H_
+#define KRAKEN2_ACCESSION_INDEX_H_
+
+#include "kraken2_headers.h"
+#include "kraken2_data.h"
+#include "mmap_file.h"
+
+namespace kraken2 {
+
+// Line-aligned part of an NCBI accession2taxid file, whose lines are
+// "accession<TAB>accession.version<TAB>taxid<TAB>gi"
+struct AccessionMapChunk {
+  const char *begin, *end;
+};
+
+// Splits a mapped accession2taxid file into chunks of about chunk_size
+// bytes, skipping its header line
+std::vector<AccessionMapChunk> SplitAccessionMap(const char *data,
+    size_t size, size_t chunk_size);
+
+/**
+ Binary index of accession2taxid files, mapping accession numbers (without
+ version) to taxids, built by build_accession_index.  Memory mapped, and
+ safe to query from several threads.
+
+ File layout: the magic string, then as uint64_t the record count, key
+ width and partition bits, then the first record index of each partition
+ and the record count (2^partition_bits + 1 values).  The records follow,
+ each a key (the accession, NUL-padded to the key width) and a uint32_t
+ taxid.  Records are grouped by partition (top bits of the accession's
+ hash) and sorted by key within a partition.
+ **/
+
+class AccessionIndex {
+  public:
+  AccessionIndex();
+  AccessionIndex(const AccessionIndex &rhs) = delete;
+  AccessionIndex& operator=(const AccessionIndex &rhs) = delete;
+
+  static bool IsIndexFile(const std::string &filename);
+  void OpenFile(const std::string &filename);
+
+  // Returns the matching record, or nullptr if the accession isn't indexed
+  const char *Find(const char *accession, size_t len) const;
+  taxid_t RecordTaxid(const char *record) const;
+  size_t size() const { return record_ct_; }
+
+  static uint64_t PartitionHash(const char *accession, size_t len);
+
+  static constexpr const char *FILE_MAGIC = "K2ACCIDX";
+  static const size_t TAXID_SIZE = sizeof(uint32_t);
+
+  private:
+  MMapFile index_file_;
+  uint64_t record_ct_;
+  uint64_t key_width_;
+  uint64_t partition_bits_;
+  const uint64_t *partition_starts_;
+  const char *records_;
+};
+
+}
+
+#endif
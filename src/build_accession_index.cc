@@ -0,0 +1,292 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#include "kraken2_headers.h"
+#include "mmap_file.h"
+#include "accession_index.h"
+
+using namespace kraken2;
+using std::string;
+using std::vector;
+
+#define CHUNK_SIZE (64 * 1024 * 1024)
+#define PARTITION_BITS 16
+#define MAX_KEY_WIDTH 255
+
+struct Options {
+  int threads;
+  size_t max_memory;
+  string index_filename;
+  vector<string> accmap_filenames;
+};
+
+// Chunk of an accession map, numbered in file order
+struct Chunk {
+  size_t file_index;
+  AccessionMapChunk data;
+};
+
+// An accession map line; order is the chunk number and offset within the
+// chunk, so the first line to list an accession can be kept
+struct MapRecord {
+  uint64_t order;
+  const char *key;
+  uint32_t key_len;
+  uint32_t taxid;
+};
+
+void ParseCommandLine(int argc, char **argv, Options &opts);
+void usage(int exit_code = EX_USAGE);
+void BuildIndex(Options &opts);
+const char *ParseMapLine(const char *ptr, const char *end,
+    const char *filename, const char **key, size_t *key_len,
+    uint32_t *taxid);
+size_t PackPartition(MapRecord *records, size_t record_ct, size_t key_width,
+    string &out);
+
+int main(int argc, char **argv) {
+  Options opts;
+  opts.threads = 1;
+  opts.max_memory = 0;
+  ParseCommandLine(argc, argv, opts);
+  omp_set_num_threads(opts.threads);
+  BuildIndex(opts);
+  return 0;
+}
+
+// Parses the line at ptr, returning the start of the next line
+const char *ParseMapLine(const char *ptr, const char *end,
+    const char *filename, const char **key, size_t *key_len, uint32_t *taxid)
+{
+  auto lf_ptr = (const char *) memchr(ptr, '\n', end - ptr);
+  if (lf_ptr == nullptr)
+    lf_ptr = end;
+  auto tab_ptr = (const char *) memchr(ptr, '\t', lf_ptr - ptr);
+  const char *taxid_ptr = nullptr;
+  if (tab_ptr != nullptr) {
+    taxid_ptr = (const char *) memchr(tab_ptr + 1, '\t', lf_ptr - tab_ptr - 1);
+    if (taxid_ptr != nullptr)
+      taxid_ptr++;
+  }
+  if (taxid_ptr == nullptr)
+    errx(EX_DATAERR, "expected TAB not found in %s", filename);
+  *key = ptr;
+  *key_len = tab_ptr - ptr;
+  uint64_t value = 0;
+  while (taxid_ptr < lf_ptr && *taxid_ptr >= '0' && *taxid_ptr <= '9')
+    value = value * 10 + (*taxid_ptr++ - '0');
+  if (value > UINT32_MAX)
+    errx(EX_DATAERR, "taxid too large in %s", filename);
+  *taxid = value;
+  return lf_ptr < end ? lf_ptr + 1 : end;
+}
+
+// Sorts a partition's records and appends the first record for each
+// accession to out, returning the number appended
+size_t PackPartition(MapRecord *records, size_t record_ct, size_t key_width,
+    string &out)
+{
+  std::sort(records, records + record_ct,
+    [](const MapRecord &a, const MapRecord &b) {
+      int cmp = memcmp(a.key, b.key, std::min(a.key_len, b.key_len));
+      if (cmp != 0)
+        return cmp < 0;
+      if (a.key_len != b.key_len)
+        return a.key_len < b.key_len;
+      return a.order < b.order;
+    });
+  size_t packed_ct = 0;
+  for (size_t i = 0; i < record_ct; i++) {
+    auto &record = records[i];
+    if (i > 0 && record.key_len == records[i - 1].key_len
+        && memcmp(record.key, records[i - 1].key, record.key_len) == 0)
+      continue;
+    out.append(record.key, record.key_len);
+    out.append(key_width - record.key_len, '\0');
+    out.append((const char *) &record.taxid, sizeof(record.taxid));
+    packed_ct++;
+  }
+  return packed_ct;
+}
+
+// Counts the lines in each partition, then reads the maps once for each
+// group of partitions that fits in the memory limit, sorting and writing
+// out the group's partitions.
+void BuildIndex(Options &opts) {
+  vector<MMapFile> accmap_files(opts.accmap_filenames.size());
+  vector<Chunk> chunks;
+  for (size_t i = 0; i < accmap_files.size(); i++) {
+    accmap_files[i].OpenFile(opts.accmap_filenames[i]);
+    for (auto &data : SplitAccessionMap(accmap_files[i].fptr(),
+                        accmap_files[i].filesize(), CHUNK_SIZE))
+      chunks.push_back(Chunk{i, data});
+  }
+
+  size_t partition_ct = (size_t) 1 << PARTITION_BITS;
+  vector<uint64_t> partition_counts(partition_ct, 0);
+  size_t key_width = 1;
+  #pragma omp parallel
+  {
+    vector<uint64_t> thread_counts(partition_ct, 0);
+    size_t thread_key_width = 1;
+    #pragma omp for schedule(dynamic)
+    for (size_t i = 0; i < chunks.size(); i++) {
+      auto &filename = opts.accmap_filenames[chunks[i].file_index];
+      const char *ptr = chunks[i].data.begin, *key;
+      size_t key_len;
+      uint32_t taxid;
+      while (ptr < chunks[i].data.end) {
+        ptr = ParseMapLine(ptr, chunks[i].data.end, filename.c_str(),
+                           &key, &key_len, &taxid);
+        if (key_len > MAX_KEY_WIDTH)
+          errx(EX_DATAERR, "accession longer than %d characters in %s",
+               MAX_KEY_WIDTH, filename.c_str());
+        thread_key_width = std::max(thread_key_width, key_len);
+        thread_counts[AccessionIndex::PartitionHash(key, key_len)
+                      >> (64 - PARTITION_BITS)]++;
+      }
+    }
+    #pragma omp critical(partition_counts)
+    {
+      for (size_t i = 0; i < partition_ct; i++)
+        partition_counts[i] += thread_counts[i];
+      key_width = std::max(key_width, thread_key_width);
+    }
+  }
+
+  auto temp_filename = opts.index_filename + ".tmp";
+  FILE *fp = fopen(temp_filename.c_str(), "wb");
+  if (fp == nullptr)
+    err(EX_CANTCREAT, "unable to create %s", temp_filename.c_str());
+  // Header is rewritten with the final counts once the records are out
+  vector<uint64_t> partition_starts(partition_ct + 1, 0);
+  uint64_t record_ct = 0;
+  uint64_t partition_bits = PARTITION_BITS;
+  auto write_header = [&]() {
+    if (fwrite(AccessionIndex::FILE_MAGIC, 1,
+               strlen(AccessionIndex::FILE_MAGIC), fp)
+          != strlen(AccessionIndex::FILE_MAGIC)
+        || fwrite(&record_ct, sizeof(record_ct), 1, fp) != 1
+        || fwrite(&key_width, sizeof(key_width), 1, fp) != 1
+        || fwrite(&partition_bits, sizeof(partition_bits), 1, fp) != 1
+        || fwrite(partition_starts.data(), sizeof(uint64_t),
+                  partition_starts.size(), fp) != partition_starts.size())
+      err(EX_IOERR, "unable to write %s", temp_filename.c_str());
+  };
+  write_header();
+
+  size_t group_start = 0;
+  while (group_start < partition_ct) {
+    size_t group_end = group_start;
+    uint64_t group_size = 0;
+    do {
+      group_size += partition_counts[group_end++];
+    } while (group_end < partition_ct && (opts.max_memory == 0 ||
+             (group_size + partition_counts[group_end]) * sizeof(MapRecord)
+               <= opts.max_memory));
+
+    vector<MapRecord> records(group_size);
+    vector<uint64_t> cursors(group_end - group_start + 1, 0);
+    for (size_t i = group_start; i < group_end; i++)
+      cursors[i - group_start + 1] = cursors[i - group_start]
+                                     + partition_counts[i];
+    vector<uint64_t> group_starts(cursors);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < chunks.size(); i++) {
+      auto &filename = opts.accmap_filenames[chunks[i].file_index];
+      const char *ptr = chunks[i].data.begin, *key;
+      size_t key_len;
+      uint32_t taxid;
+      while (ptr < chunks[i].data.end) {
+        const char *line = ptr;
+        ptr = ParseMapLine(ptr, chunks[i].data.end, filename.c_str(),
+                           &key, &key_len, &taxid);
+        size_t partition = AccessionIndex::PartitionHash(key, key_len)
+                           >> (64 - PARTITION_BITS);
+        if (partition < group_start || partition >= group_end)
+          continue;
+        uint64_t pos;
+        #pragma omp atomic capture
+        pos = cursors[partition - group_start]++;
+        records[pos] = MapRecord{ ((uint64_t) i << 32)
+                                  | (line - chunks[i].data.begin),
+                                  key, (uint32_t) key_len, taxid };
+      }
+    }
+
+    vector<string> packed(group_end - group_start);
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = group_start; i < group_end; i++) {
+      auto begin = group_starts[i - group_start];
+      auto count = group_starts[i - group_start + 1] - begin;
+      partition_starts[i + 1] = PackPartition(records.data() + begin, count,
+                                              key_width,
+                                              packed[i - group_start]);
+    }
+    for (size_t i = group_start; i < group_end; i++) {
+      auto &data = packed[i - group_start];
+      if (fwrite(data.data(), 1, data.size(), fp) != data.size())
+        err(EX_IOERR, "unable to write %s", temp_filename.c_str());
+      partition_starts[i + 1] += partition_starts[i];
+    }
+    group_start = group_end;
+  }
+
+  record_ct = partition_starts[partition_ct];
+  if (fseek(fp, 0, SEEK_SET) < 0)
+    err(EX_IOERR, "unable to write %s", temp_filename.c_str());
+  write_header();
+  if (fclose(fp) != 0)
+    err(EX_IOERR, "unable to write %s", temp_filename.c_str());
+  if (rename(temp_filename.c_str(), opts.index_filename.c_str()) < 0)
+    err(EX_CANTCREAT, "unable to create %s", opts.index_filename.c_str());
+  std::cerr << "Indexed " << record_ct << " accession numbers" << std::endl;
+}
+
+void ParseCommandLine(int argc, char **argv, Options &opts) {
+  int opt;
+  long long sig;
+
+  while ((opt = getopt(argc, argv, "?hp:M:")) != -1) {
+    switch (opt) {
+      case 'h' : case '?' :
+        usage(0);
+        break;
+      case 'p' :
+        sig = atoll(optarg);
+        if (sig < 1)
+          errx(EX_USAGE, "must have at least 1 thread");
+        opts.threads = sig;
+        break;
+      case 'M' :
+        sig = atoll(optarg);
+        if (sig < 1)
+          errx(EX_USAGE, "memory limit must be positive");
+        opts.max_memory = sig;
+        break;
+    }
+  }
+  if (argc - optind < 2)
+    usage();
+  opts.index_filename = argv[optind];
+  opts.accmap_filenames.assign(argv + optind + 1, argv + argc);
+}
+
+void usage(int exit_code) {
+  std::cerr << "Usage: build_accession_index [-p threads] [-M bytes] <index file> <accmaps>" << std::endl
+            << std::endl
+            << "Builds a binary index of accession to taxid map files that" << std::endl
+            << "lookup_accession_numbers can use in their place.  Where several" << std::endl
+            << "lines list an accession, the first one is indexed." << std::endl
+            << std::endl
+            << "Options:" << std::endl
+            << "  -p INT        Number of threads" << std::endl
+            << "  -M INT        Approximate memory limit for sorting, in bytes;" << std::endl
+            << "                the maps are read once per group of partitions" << std::endl
+            << "                that fits" << std::endl;
+  exit(exit_code);
+}
@@ -12,6 +12,9 @@
 #include "kv_store.h"
 #include "kraken2_data.h"
 #include "utilities.h"
+#include "library_reader.h"
+#include "seqid_map.h"
+#include "minimizer_cache.h"
 
 using std::string;
 using std::map;
@@ -29,6 +32,17 @@ using namespace kraken2;
 // just keeping sane defaults in case they aren't
 #define DEFAULT_BLOCK_SIZE (10 * 1024 * 1024)  // 10 MB
 #define DEFAULT_SUBBLOCK_SIZE (1024)
+// Memory for sorting minimizer runs when sizing the table without an
+// out-of-core memory limit
+#define DEFAULT_SORT_MEMORY (2048ull * 1024 * 1024)  // 2 GB
+#define MAX_MERGE_FAN_IN (256)
+#define MAX_TABLE_PARTITIONS (1024)
+// Sorted runs on disk hold each minimizer and its taxon (an internal ID,
+// which fits in 32 bits)
+#define RUN_RECORD_SIZE (sizeof(uint64_t) + sizeof(uint32_t))
+// Least memory left for the run buffers once the ID map and taxonomy are
+// accounted for
+#define MIN_SORT_MEMORY (16ull * 1024 * 1024)  // 16 MB
 
 struct Options {
   string ID_to_taxon_map_filename;
@@ -48,26 +62,110 @@ struct Options {
   uint64_t toggle_mask;
   uint64_t min_clear_hash_value;
   bool deterministic_build;
+  size_t memory_limit;
+  string spill_directory;
+  double load_factor;
+  vector<string> library_filenames;
+  int checkpoint_interval;
+  bool resume;
+  string minimizer_cache_directory;
+  // Cache file of each library file, empty without a cache directory
+  vector<string> minimizer_cache_filenames;
+  vector<MinimizerCacheKey> minimizer_cache_keys;
 };
 
 void ParseCommandLine(int argc, char **argv, Options &opts);
 void usage(int exit_code = EX_USAGE);
-vector<string> ExtractNCBISequenceIDs(const string &header);
+template <typename F>
+void ForEachNCBISequenceID(const string &header, F fn);
+taxid_t SequenceTaxon(const string &header,
+    const SequenceIDMap &ID_to_taxon_map, const Taxonomy &taxonomy);
 void ProcessSequenceFast(const string &seq, taxid_t taxid,
-    CompactHashTable &hash, const Taxonomy &tax, MinimizerScanner &scanner,
+    CompactHashTable &hash, LCACache &lca_cache, MinimizerScanner &scanner,
     uint64_t min_clear_hash_value);
-void ProcessSequence(const Options &opts, const string &seq, taxid_t taxid,
-    CompactHashTable &hash, const Taxonomy &tax);
 void ProcessSequencesFast(const Options &opts,
-    const map<string, taxid_t> &ID_to_taxon_map,
+    const SequenceIDMap &ID_to_taxon_map,
     CompactHashTable &kraken_index, const Taxonomy &taxonomy);
-void ProcessSequences(const Options &opts,
-    const map<string, taxid_t> &ID_to_taxon_map,
+void ProcessCachedSequencesFast(const Options &opts,
+    const SequenceIDMap &ID_to_taxon_map,
     CompactHashTable &kraken_index, const Taxonomy &taxonomy);
+
+// Progress of a deterministic build, saved periodically so that an
+// interrupted build can be resumed.  The in-memory build saves its
+// partially filled table; the out-of-core build saves the list of sorted
+// runs written so far.
+struct BuildCheckpoint {
+  uint64_t fingerprint;      // of the build options and library
+  LibraryPosition position;  // where reading the library resumes
+  size_t processed_seq_ct;
+  size_t processed_ch_ct;
+  size_t generation;
+  string table_filename;
+  vector<string> run_filenames;
+};
+
+void ProcessSequences(const Options &opts,
+    const SequenceIDMap &ID_to_taxon_map,
+    CompactHashTable &kraken_index, const Taxonomy &taxonomy,
+    BuildCheckpoint &checkpoint);
+void ProcessSequencesExternal(Options &opts,
+    const SequenceIDMap &ID_to_taxon_map, const Taxonomy &taxonomy,
+    size_t capacity, size_t bits_for_taxid, BuildCheckpoint &checkpoint);
+uint64_t BuildFingerprint(const Options &opts);
+bool ReadCheckpoint(const Options &opts, BuildCheckpoint &checkpoint);
+void WriteCheckpoint(const Options &opts, const BuildCheckpoint &checkpoint);
+void RemoveCheckpoint(const Options &opts, const BuildCheckpoint &checkpoint);
 void SetMinimizerLCA(CompactHashTable &hash, uint64_t minimizer, taxid_t taxid,
-    const Taxonomy &tax);
-void ReadIDToTaxonMap(map<string, taxid_t> &id_map, string &filename);
-void GenerateTaxonomy(Options &opts, map<string, taxid_t> &id_map);
+    LCACache &lca_cache);
+void ReportLCACacheUse(const vector<LCACache> &lca_caches);
+size_t RaiseOpenFileLimit();
+
+// A minimizer, the taxon of a sequence it occurs in, and the position of its
+// first occurrence within a batch of sequences (sequence index in the upper
+// 32 bits, sequence block index in the lower 32 bits)
+struct MinimizerOccurrence {
+  uint64_t minimizer;
+  uint64_t position;
+  taxid_t taxid;
+};
+
+// Sequences with a taxon from one block of a library file
+struct ParsedBlock {
+  vector<string> seqs;
+  vector<taxid_t> taxa;
+  size_t size;  // bytes of input, including sequences without a taxon
+  LibraryPosition end;
+};
+
+bool LoadSequenceBatch(const Options &opts, OrderedLibraryReader &reader,
+    std::deque<ParsedBlock> &pending, LibraryPosition &position,
+    size_t batch_size,
+    const SequenceIDMap &ID_to_taxon_map, const Taxonomy &taxonomy,
+    vector<string> &seqs, vector<taxid_t> &taxa,
+    size_t &processed_seq_ct, size_t &processed_ch_ct);
+void GatherMinimizerOccurrences(const Options &opts, const vector<string> &seqs,
+    const vector<taxid_t> &taxa, vector<MinimizerOccurrence> &occurrences);
+void PrepareMinimizerCache(Options &opts);
+void FillMinimizerCache(const Options &opts, const vector<size_t> &missing);
+bool LoadCachedBatch(const Options &opts, MinimizerCacheReader &reader,
+    LibraryPosition &position, size_t batch_size,
+    const SequenceIDMap &ID_to_taxon_map, const Taxonomy &taxonomy,
+    vector<MinimizerOccurrence> &occurrences,
+    size_t &processed_seq_ct, size_t &processed_ch_ct);
+template <typename T, typename F>
+void RadixSort(vector<T> &items, vector<T> &scratch, F key_fn,
+    int key_bits = 64);
+void ReduceMinimizerOccurrences(vector<MinimizerOccurrence> &occurrences,
+    vector<LCACache> &lca_caches);
+void InsertMinimizerOccurrences(const vector<MinimizerOccurrence> &occurrences,
+    CompactHashTable &hash, vector<LCACache> &lca_caches);
+void WriteRunRecord(ofstream &run_file, uint64_t minimizer, taxid_t taxid);
+void WriteMinimizerRun(const string &filename,
+    const vector<MinimizerOccurrence> &occurrences);
+void MergeMinimizerRuns(const vector<string> &run_filenames,
+    size_t memory_limit, const Taxonomy &tax,
+    std::function<void(uint64_t, taxid_t)> sink);
+void GenerateTaxonomy(Options &opts, const SequenceIDMap &id_map);
 
 struct TaxonSeqPair {
   taxid_t taxon;
@@ -86,13 +184,19 @@ int main(int argc, char **argv) {
   opts.min_clear_hash_value = 0;
   opts.maximum_capacity = 0;
   opts.deterministic_build = true;
+  opts.memory_limit = 0;
+  opts.spill_directory = ".";
+  opts.load_factor = 0;
+  opts.capacity = 0;
+  opts.checkpoint_interval = 0;
+  opts.resume = false;
   ParseCommandLine(argc, argv, opts);
 
   omp_set_num_threads( opts.num_threads );
 
-  map<string, taxid_t> ID_to_taxon_map;
+  SequenceIDMap ID_to_taxon_map;
 
-  ReadIDToTaxonMap(ID_to_taxon_map, opts.ID_to_taxon_map_filename);
+  ID_to_taxon_map.ReadFile(opts.ID_to_taxon_map_filename);
   GenerateTaxonomy(opts, ID_to_taxon_map);
 
   std::cerr << "Taxonomy parsed and converted." << std::endl;
@@ -111,7 +215,7 @@ int main(int argc, char **argv) {
     bits_for_taxid = opts.requested_bits_for_taxid;
 
   auto actual_capacity = opts.capacity;
-  if (opts.maximum_capacity) {
+  if (opts.maximum_capacity && ! opts.load_factor) {
     double frac = opts.maximum_capacity * 1.0 / opts.capacity;
     if (frac > 1)
       errx(EX_DATAERR, "maximum capacity larger than requested capacity");
@@ -119,17 +223,47 @@ int main(int argc, char **argv) {
     actual_capacity = opts.maximum_capacity;
   }
 
-  CompactHashTable kraken_index(actual_capacity, 32 - bits_for_taxid,
-      bits_for_taxid);
-  std::cerr << "CHT created with " << bits_for_taxid << " bits reserved for taxid." << std::endl;
+  if (! opts.minimizer_cache_directory.empty())
+    PrepareMinimizerCache(opts);
 
-  if (opts.deterministic_build)
-    ProcessSequences(opts, ID_to_taxon_map, kraken_index, taxonomy);
-  else
-    ProcessSequencesFast(opts, ID_to_taxon_map, kraken_index, taxonomy);
+  BuildCheckpoint checkpoint;
+  checkpoint.fingerprint = BuildFingerprint(opts);
+  checkpoint.position = LibraryPosition{0, 0};
+  checkpoint.processed_seq_ct = checkpoint.processed_ch_ct = 0;
+  checkpoint.generation = 0;
+  if (opts.resume && ReadCheckpoint(opts, checkpoint))
+    std::cerr << "Resuming from checkpoint after " << checkpoint.processed_seq_ct
+              << " sequences" << std::endl;
+
+  if (opts.memory_limit || opts.load_factor) {
+    ProcessSequencesExternal(opts, ID_to_taxon_map, taxonomy,
+        actual_capacity, bits_for_taxid, checkpoint);
+    std::cerr << "Writing data to disk... " << std::flush;
+  }
+  else {
+    CompactHashTable *kraken_index;
+    if (! checkpoint.table_filename.empty())
+      kraken_index = new CompactHashTable(checkpoint.table_filename);
+    else
+      kraken_index = new CompactHashTable(actual_capacity,
+          32 - bits_for_taxid, bits_for_taxid);
+    std::cerr << "CHT created with " << bits_for_taxid << " bits reserved for taxid." << std::endl;
 
-  std::cerr << "Writing data to disk... " << std::flush;
-  kraken_index.WriteTable(opts.hashtable_filename.c_str());
+    if (opts.deterministic_build)
+      ProcessSequences(opts, ID_to_taxon_map, *kraken_index, taxonomy,
+          checkpoint);
+    else if (! opts.minimizer_cache_filenames.empty())
+      ProcessCachedSequencesFast(opts, ID_to_taxon_map, *kraken_index,
+          taxonomy);
+    else
+      ProcessSequencesFast(opts, ID_to_taxon_map, *kraken_index, taxonomy);
+
+    std::cerr << "Writing data to disk... " << std::flush;
+    kraken_index->WriteTable(opts.hashtable_filename.c_str());
+    delete kraken_index;
+  }
+  if (opts.checkpoint_interval)
+    RemoveCheckpoint(opts, checkpoint);
 
   IndexOptions index_opts;
   index_opts.k = opts.k;
@@ -154,41 +288,32 @@ int main(int argc, char **argv) {
 
 // A quick but nondeterministic build
 void ProcessSequencesFast(const Options &opts,
-    const map<string, taxid_t> &ID_to_taxon_map,
+    const SequenceIDMap &ID_to_taxon_map,
     CompactHashTable &kraken_index, const Taxonomy &taxonomy)
 {
   size_t processed_seq_ct = 0;
   size_t processed_ch_ct = 0;
+  LibraryReader library(opts.library_filenames, opts.num_threads);
+  vector<LCACache> lca_caches(omp_get_max_threads(), LCACache(taxonomy));
 
   #pragma omp parallel
   {
     Sequence sequence;
+    auto &lca_cache = lca_caches[omp_get_thread_num()];
     MinimizerScanner scanner(opts.k, opts.l, opts.spaced_seed_mask,
                              ! opts.input_is_protein, opts.toggle_mask);
 
     BatchSequenceReader reader;
 
-    while (true) {
-      // Declaration of "ok" and break need to be done outside of critical
-      // section to conform with OpenMP spec.
-      bool ok;
-      #pragma omp critical(reader)
-      ok = reader.LoadBlock(std::cin, opts.block_size);
-      if (! ok)
-        break;
+    while (library.LoadBlock(reader, opts.block_size)) {
       while (reader.NextSequence(sequence)) {
-        auto all_sequence_ids = ExtractNCBISequenceIDs(sequence.header);
-        taxid_t taxid = 0;
-        for (auto &seqid : all_sequence_ids) {
-          if (ID_to_taxon_map.count(seqid) == 0) continue;
-          auto ext_taxid = ID_to_taxon_map.at(seqid);
-          taxid = taxonomy.LowestCommonAncestor(taxid, taxonomy.GetInternalID(ext_taxid));
-        }
+        taxid_t taxid = SequenceTaxon(sequence.header, ID_to_taxon_map,
+                                      taxonomy);
         if (taxid) {
           // Add terminator for protein sequences if not already there
           if (opts.input_is_protein && sequence.seq.back() != '*')
             sequence.seq.push_back('*');
-          ProcessSequenceFast(sequence.seq, taxid, kraken_index, taxonomy, scanner,
+          ProcessSequenceFast(sequence.seq, taxid, kraken_index, lca_cache, scanner,
             opts.min_clear_hash_value);
           #pragma omp atomic
           processed_seq_ct++;
@@ -205,37 +330,136 @@ void ProcessSequencesFast(const Options &opts,
   if (isatty(fileno(stderr)))
     std::cerr << "\r";
   std::cerr << "Completed processing of " << processed_seq_ct << " sequences, " << processed_ch_ct << " " << (opts.input_is_protein ? "aa" : "bp") << std::endl;
+  ReportLCACacheUse(lca_caches);
 }
 
-// Slightly slower but deterministic when multithreaded
-void ProcessSequences(const Options &opts,
-    const map<string, taxid_t> &ID_to_taxon_map,
+// The fast build from the minimizer cache.  Blocks are read in turn and
+// their sequences' minimizers set in parallel.
+void ProcessCachedSequencesFast(const Options &opts,
+    const SequenceIDMap &ID_to_taxon_map,
     CompactHashTable &kraken_index, const Taxonomy &taxonomy)
 {
   size_t processed_seq_ct = 0;
   size_t processed_ch_ct = 0;
+  MinimizerCacheReader reader(opts.minimizer_cache_filenames,
+                              opts.minimizer_cache_keys);
+  vector<LCACache> lca_caches(omp_get_max_threads(), LCACache(taxonomy));
 
-  Sequence sequence;
-  BatchSequenceReader reader;
-
-  while (reader.LoadBlock(std::cin, DEFAULT_BLOCK_SIZE)) {
-    while (reader.NextSequence(sequence)) {
-      auto all_sequence_ids = ExtractNCBISequenceIDs(sequence.header);
-      taxid_t taxid = 0;
-      for (auto &seqid : all_sequence_ids) {
-        if (ID_to_taxon_map.count(seqid) == 0) continue;
-        auto ext_taxid = ID_to_taxon_map.at(seqid);
-        taxid = taxonomy.LowestCommonAncestor(taxid, taxonomy.GetInternalID(ext_taxid));
-      }
-      if (taxid) {
-        // Add terminator for protein sequences if not already there
-        if (opts.input_is_protein && sequence.seq.back() != '*')
-          sequence.seq.push_back('*');
-        ProcessSequence(opts, sequence.seq, taxid, kraken_index, taxonomy);
+  #pragma omp parallel
+  {
+    CachedBlock block;
+    CachedSequence sequence;
+    auto &lca_cache = lca_caches[omp_get_thread_num()];
+
+    while (true) {
+      bool loaded;
+      #pragma omp critical(cache_read)
+      loaded = reader.NextBlock(block);
+      if (! loaded)
+        break;
+      const char *ptr = block.data.data();
+      for (uint64_t i = 0; i < block.seq_ct; i++) {
+        ptr = DecodeCachedSequence(ptr, sequence);
+        taxid_t taxid = SequenceTaxon(sequence.header, ID_to_taxon_map,
+                                      taxonomy);
+        if (! taxid)
+          continue;
+        ForEachCachedMinimizer(sequence, [&](uint64_t minimizer, uint32_t) {
+          if (opts.min_clear_hash_value &&
+              MurmurHash3(minimizer) < opts.min_clear_hash_value)
+            return;
+          SetMinimizerLCA(kraken_index, minimizer, taxid, lca_cache);
+        });
+        #pragma omp atomic
         processed_seq_ct++;
-        processed_ch_ct += sequence.seq.size();
+        #pragma omp atomic
+        processed_ch_ct += sequence.char_ct;
+      }
+      if (isatty(fileno(stderr))) {
+        #pragma omp critical(status_update)
+        std::cerr << "\rProcessed " << processed_seq_ct << " sequences (" << processed_ch_ct << " " << (opts.input_is_protein ? "aa" : "bp") << ")...";
       }
     }
+  }
+  if (isatty(fileno(stderr)))
+    std::cerr << "\r";
+  std::cerr << "Completed processing of " << processed_seq_ct << " sequences, " << processed_ch_ct << " " << (opts.input_is_protein ? "aa" : "bp") << std::endl;
+  ReportLCACacheUse(lca_caches);
+}
+
+// Slightly slower but deterministic when multithreaded.  Each batch of
+// sequences is scanned in parallel into (minimizer, taxon) pairs, which are
+// sorted and reduced to one LCA per minimizer and then inserted in order of
+// first occurrence, giving the same table regardless of thread count.
+void ProcessSequences(const Options &opts,
+    const SequenceIDMap &ID_to_taxon_map,
+    CompactHashTable &kraken_index, const Taxonomy &taxonomy,
+    BuildCheckpoint &checkpoint)
+{
+  size_t processed_seq_ct = checkpoint.processed_seq_ct;
+  size_t processed_ch_ct = checkpoint.processed_ch_ct;
+
+  LibraryPosition position = checkpoint.position;
+  OrderedLibraryReader reader(opts.library_filenames, opts.num_threads,
+                              position);
+  MinimizerCacheReader cache_reader(opts.minimizer_cache_filenames,
+                                    opts.minimizer_cache_keys, position);
+  std::deque<ParsedBlock> pending;
+  vector<string> seqs;
+  vector<taxid_t> taxa;
+  vector<MinimizerOccurrence> occurrences, scratch;
+  vector<LCACache> lca_caches(omp_get_max_threads(), LCACache(taxonomy));
+  auto last_checkpoint = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::duration checkpoint_wait =
+      std::chrono::seconds(opts.checkpoint_interval);
+  auto load_batch = [&]() {
+    if (! opts.minimizer_cache_filenames.empty())
+      return LoadCachedBatch(opts, cache_reader, position, DEFAULT_BLOCK_SIZE,
+                             ID_to_taxon_map, taxonomy, occurrences,
+                             processed_seq_ct, processed_ch_ct);
+    if (! LoadSequenceBatch(opts, reader, pending, position,
+                            DEFAULT_BLOCK_SIZE, ID_to_taxon_map, taxonomy,
+                            seqs, taxa, processed_seq_ct, processed_ch_ct))
+      return false;
+    GatherMinimizerOccurrences(opts, seqs, taxa, occurrences);
+    return true;
+  };
+
+  while (load_batch()) {
+    RadixSort(occurrences, scratch,
+        [](const MinimizerOccurrence &o) { return o.minimizer; });
+    ReduceMinimizerOccurrences(occurrences, lca_caches);
+    // Both sorts are stable, so minimizers first seen in the same block are
+    // ordered by hash zone and then by value, matching the insertion order
+    // of the earlier per-sequence build (which gathered them into 256
+    // hash-partitioned sorted sets)
+    RadixSort(occurrences, scratch,
+        [](const MinimizerOccurrence &o) { return MurmurHash3(o.minimizer) % 256; },
+        8);
+    RadixSort(occurrences, scratch,
+        [](const MinimizerOccurrence &o) { return o.position; });
+    InsertMinimizerOccurrences(occurrences, kraken_index, lca_caches);
+
+    auto now = std::chrono::steady_clock::now();
+    if (opts.checkpoint_interval && now - last_checkpoint >= checkpoint_wait) {
+      // Each table is kept until a newer checkpoint refers to another
+      string old_table_filename = checkpoint.table_filename;
+      checkpoint.generation++;
+      checkpoint.table_filename = opts.hashtable_filename + ".checkpoint.table"
+                                  + std::to_string(checkpoint.generation);
+      kraken_index.WriteTable(checkpoint.table_filename.c_str());
+      checkpoint.position = position;
+      checkpoint.processed_seq_ct = processed_seq_ct;
+      checkpoint.processed_ch_ct = processed_ch_ct;
+      WriteCheckpoint(opts, checkpoint);
+      if (! old_table_filename.empty())
+        unlink(old_table_filename.c_str());
+      // Each checkpoint rewrites the whole table, so they're spaced out
+      // enough to keep that to about 5% of the build time
+      last_checkpoint = std::chrono::steady_clock::now();
+      checkpoint_wait = std::max(checkpoint_wait, 20 * (last_checkpoint - now));
+    }
+
     if (isatty(fileno(stderr))) {
       std::cerr << "\rProcessed " << processed_seq_ct << " sequences (" << processed_ch_ct << " " << (opts.input_is_protein ? "aa" : "bp") << ")...";
     }
@@ -243,215 +467,1082 @@ void ProcessSequences(const Options &opts,
   if (isatty(fileno(stderr)))
     std::cerr << "\r";
   std::cerr << "Completed processing of " << processed_seq_ct << " sequences, " << processed_ch_ct << " " << (opts.input_is_protein ? "aa" : "bp") << std::endl;
+  ReportLCACacheUse(lca_caches);
 }
 
-// This function exists to deal with NCBI's use of \x01 characters to denote
-// the start of a new FASTA header in the same line (for non-redundant DBs).
-// We return all sequence IDs in a header line, not just the first.
-vector<string> ExtractNCBISequenceIDs(const string &header) {
-  vector<string> list;
-  string current_str;
+// Builds the table from minimizers gathered into LCA-reduced runs sorted
+// by minimizer and written to disk.  The runs are merged, and the merged
+// pairs placed into the table file one partition at a time.  With a memory
+// limit, memory use stays within it (apart from the largest single
+// reference sequence), giving an out-of-core build.  With a load factor
+// instead of a capacity, the distinct minimizers are counted while merging
+// and the table sized from that, so the library is only read once.
+void ProcessSequencesExternal(Options &opts,
+    const SequenceIDMap &ID_to_taxon_map, const Taxonomy &taxonomy,
+    size_t capacity, size_t bits_for_taxid, BuildCheckpoint &checkpoint)
+{
+  size_t processed_seq_ct = checkpoint.processed_seq_ct;
+  size_t processed_ch_ct = checkpoint.processed_ch_ct;
 
-  bool in_id = true;
-  // start loop at first char after '>'
-  for (size_t i = 1; i < header.size(); ++i) {
-    if (header[i] == 0x01) {
-      // 0x01 starts new ID at next char
-      if (! current_str.empty())
-        list.push_back(current_str);
-      current_str.clear();
-      in_id = true;
+  string temp_prefix = opts.spill_directory + "/build_db."
+                       + std::to_string(getpid());
+  size_t memory_limit = DEFAULT_SORT_MEMORY;
+  if (opts.memory_limit) {
+    // The ID map and taxonomy stay loaded for the whole build
+    size_t fixed_memory = ID_to_taxon_map.memory_usage()
+                          + taxonomy.memory_usage();
+    if (opts.memory_limit < fixed_memory + MIN_SORT_MEMORY)
+      errx(EX_USAGE, "memory limit of %zu MB is too small, the sequence ID "
+           "map and taxonomy use %zu MB and at least %zu MB more is needed",
+           opts.memory_limit >> 20, fixed_memory >> 20,
+           (size_t) (MIN_SORT_MEMORY >> 20));
+    memory_limit = opts.memory_limit - fixed_memory;
+  }
+  // A quarter of the budget for the run buffer and another quarter for
+  // its sort space; the rest is for the sequence batch being scanned and
+  // the blocks read ahead, one per thread
+  size_t run_max = memory_limit / 4 / sizeof(MinimizerOccurrence);
+  size_t batch_size = std::min<size_t>(DEFAULT_BLOCK_SIZE,
+                                       memory_limit / 256 / opts.num_threads);
+  if (batch_size < 64 * 1024)
+    batch_size = 64 * 1024;
+
+  LibraryPosition position = checkpoint.position;
+  OrderedLibraryReader reader(opts.library_filenames, opts.num_threads,
+                              position);
+  MinimizerCacheReader cache_reader(opts.minimizer_cache_filenames,
+                                    opts.minimizer_cache_keys, position);
+  std::deque<ParsedBlock> pending;
+  vector<string> seqs;
+  vector<taxid_t> taxa;
+  vector<MinimizerOccurrence> run, batch, scratch;
+  run.reserve(run_max);
+  vector<LCACache> lca_caches(omp_get_max_threads(), LCACache(taxonomy));
+  vector<string> run_filenames = checkpoint.run_filenames;
+  // Continuing the numbering keeps names distinct from earlier runs even
+  // if the resumed process has the same PID
+  size_t new_run_ct = run_filenames.size();
+
+  // Where the library had been read to when the last batch was added to
+  // the run; position itself is already past a batch loaded but not added
+  LibraryPosition run_position = position;
+  size_t run_seq_ct = processed_seq_ct, run_ch_ct = processed_ch_ct;
+
+  // Runs are complete once written, so a checkpoint after each one saves
+  // all the work done so far
+  auto save_checkpoint = [&]() {
+    if (! opts.checkpoint_interval)
+      return;
+    checkpoint.position = run_position;
+    checkpoint.processed_seq_ct = run_seq_ct;
+    checkpoint.processed_ch_ct = run_ch_ct;
+    checkpoint.run_filenames = run_filenames;
+    WriteCheckpoint(opts, checkpoint);
+  };
+  auto flush_run = [&]() {
+    RadixSort(run, scratch,
+        [](const MinimizerOccurrence &o) { return o.minimizer; });
+    ReduceMinimizerOccurrences(run, lca_caches);
+    run_filenames.push_back(temp_prefix + ".run"
+                            + std::to_string(new_run_ct++));
+    WriteMinimizerRun(run_filenames.back(), run);
+    run.clear();
+    save_checkpoint();
+  };
+
+  // Cached blocks are read whole, so batches may exceed batch_size
+  auto load_batch = [&]() {
+    if (! opts.minimizer_cache_filenames.empty())
+      return LoadCachedBatch(opts, cache_reader, position, batch_size,
+                             ID_to_taxon_map, taxonomy, batch,
+                             processed_seq_ct, processed_ch_ct);
+    if (! LoadSequenceBatch(opts, reader, pending, position, batch_size,
+                            ID_to_taxon_map, taxonomy, seqs, taxa,
+                            processed_seq_ct, processed_ch_ct))
+      return false;
+    GatherMinimizerOccurrences(opts, seqs, taxa, batch);
+    return true;
+  };
+
+  // Flushing before a batch that wouldn't fit keeps the run in its
+  // reserved space; only a single oversized batch can exceed it
+  while (load_batch()) {
+    if (! run.empty() && run.size() + batch.size() > run_max)
+      flush_run();
+    run.insert(run.end(), batch.begin(), batch.end());
+    run_position = position;
+    run_seq_ct = processed_seq_ct;
+    run_ch_ct = processed_ch_ct;
+    if (isatty(fileno(stderr))) {
+      std::cerr << "\rProcessed " << processed_seq_ct << " sequences (" << processed_ch_ct << " " << (opts.input_is_protein ? "aa" : "bp") << ")...";
     }
-    else if (in_id && isspace(header[i])) {
-      // spaces end ID
-      if (! current_str.empty())
-        list.push_back(current_str);
-      current_str.clear();
-      in_id = false;
+  }
+  if (! run.empty())
+    flush_run();
+  else
+    save_checkpoint();
+  vector<MinimizerOccurrence>().swap(run);
+  vector<MinimizerOccurrence>().swap(batch);
+  vector<MinimizerOccurrence>().swap(scratch);
+  if (isatty(fileno(stderr)))
+    std::cerr << "\r";
+  std::cerr << "Completed processing of " << processed_seq_ct << " sequences, " << processed_ch_ct << " " << (opts.input_is_protein ? "aa" : "bp") << std::endl;
+  ReportLCACacheUse(lca_caches);
+
+  // The last merge has a file open per run and the table writer one per
+  // partition, so both are kept within the open file limit, with a margin
+  // for everything else
+  size_t fd_limit = RaiseOpenFileLimit();
+  if (fd_limit < 64)
+    errx(EX_OSERR, "open file limit of %zu is too low", fd_limit);
+  size_t merge_fan_in = std::min<size_t>(MAX_MERGE_FAN_IN, (fd_limit - 32) / 4);
+  size_t max_partitions = std::min<size_t>(MAX_TABLE_PARTITIONS,
+                                           fd_limit - 32 - merge_fan_in);
+
+  // Too many runs to merge at once are merged in groups first
+  while (run_filenames.size() > merge_fan_in) {
+    vector<string> merged_filenames;
+    for (size_t i = 0; i < run_filenames.size(); i += merge_fan_in) {
+      auto group_end = std::min(run_filenames.size(), i + merge_fan_in);
+      vector<string> group(run_filenames.begin() + i,
+                           run_filenames.begin() + group_end);
+      merged_filenames.push_back(group[0] + "m");
+      ofstream merged_file(merged_filenames.back(), ofstream::binary);
+      if (! merged_file)
+        err(EX_CANTCREAT, "unable to create %s", merged_filenames.back().c_str());
+      MergeMinimizerRuns(group, memory_limit / 2, taxonomy,
+          [&merged_file](uint64_t minimizer, taxid_t taxid) {
+            WriteRunRecord(merged_file, minimizer, taxid);
+          });
+      merged_file.close();
+      if (! merged_file)
+        errx(EX_IOERR, "error writing %s", merged_filenames.back().c_str());
+      if (opts.checkpoint_interval) {
+        checkpoint.run_filenames = merged_filenames;
+        checkpoint.run_filenames.insert(checkpoint.run_filenames.end(),
+            run_filenames.begin() + group_end, run_filenames.end());
+        WriteCheckpoint(opts, checkpoint);
+      }
+      for (auto &filename : group)
+        unlink(filename.c_str());
     }
-    else if (in_id) {
-      // Build ID string char by char
-      current_str.push_back(header[i]);
+    run_filenames.swap(merged_filenames);
+  }
+
+  if (opts.load_factor) {
+    size_t minimizer_ct = 0;
+    MergeMinimizerRuns(run_filenames, memory_limit / 2, taxonomy,
+        [&minimizer_ct](uint64_t, taxid_t) { minimizer_ct++; });
+    capacity = (size_t) (minimizer_ct / opts.load_factor) + 1;
+    std::cerr << "Found " << minimizer_ct << " distinct minimizers, "
+              << "hash table capacity set to " << capacity << std::endl;
+    if (opts.maximum_capacity && opts.maximum_capacity < capacity) {
+      double frac = opts.maximum_capacity * 1.0 / capacity;
+      opts.min_clear_hash_value = (uint64_t) ((1 - frac) * UINT64_MAX);
+      capacity = opts.maximum_capacity;
+      std::cerr << "Subsampling minimizers to fit maximum capacity of "
+                << capacity << std::endl;
     }
   }
-  if (! current_str.empty())
-    list.push_back(current_str);
-  return list;
+
+  // Keep to max_partitions partitions (and spill files) even if that
+  // means partitions larger than the budget
+  size_t partition_cells = capacity;
+  if (opts.memory_limit) {
+    partition_cells = memory_limit / 2 / sizeof(CompactHashCell);
+    if (partition_cells < (capacity + max_partitions - 1) / max_partitions)
+      partition_cells = (capacity + max_partitions - 1) / max_partitions;
+  }
+  // With checkpoints, a resumed build reuses (and so cleans up) the names
+  // of the table's temp. files
+  string table_prefix = temp_prefix + ".table";
+  if (opts.checkpoint_interval) {
+    std::ostringstream oss;
+    oss << opts.spill_directory << "/build_db." << std::hex
+        << checkpoint.fingerprint << ".table";
+    table_prefix = oss.str();
+  }
+  PartitionedTableWriter writer(capacity, 32 - bits_for_taxid, bits_for_taxid,
+      partition_cells, table_prefix);
+  std::cerr << "Merging " << run_filenames.size() << " sorted runs..." << std::endl;
+  std::cerr << "Placing minimizers in " << ((capacity + partition_cells - 1) / partition_cells)
+            << " table partitions..." << std::endl;
+  auto min_clear_hash_value = opts.min_clear_hash_value;
+  MergeMinimizerRuns(run_filenames, memory_limit / 2, taxonomy,
+      [&writer, min_clear_hash_value](uint64_t minimizer, taxid_t taxid) {
+        // Subsampling that couldn't be done when the capacity was unknown
+        if (min_clear_hash_value && MurmurHash3(minimizer) < min_clear_hash_value)
+          return;
+        writer.Add(minimizer, taxid);
+      });
+  // A checkpoint needs the runs until the table is complete
+  if (! opts.checkpoint_interval)
+    for (auto &filename : run_filenames)
+      unlink(filename.c_str());
+  writer.Finish(opts.hashtable_filename.c_str(),
+      [&taxonomy](hvalue_t a, hvalue_t b) { return (hvalue_t) taxonomy.LowestCommonAncestor(a, b); });
+  checkpoint.run_filenames = run_filenames;
 }
 
-void SetMinimizerLCA(CompactHashTable &hash, uint64_t minimizer, taxid_t taxid,
-    const Taxonomy &tax)
+void WriteRunRecord(ofstream &run_file, uint64_t minimizer, taxid_t taxid) {
+  char record[RUN_RECORD_SIZE];
+  uint32_t taxid32 = (uint32_t) taxid;
+  memcpy(record, &minimizer, sizeof(minimizer));
+  memcpy(record + sizeof(minimizer), &taxid32, sizeof(taxid32));
+  run_file.write(record, RUN_RECORD_SIZE);
+}
+
+void WriteMinimizerRun(const string &filename,
+    const vector<MinimizerOccurrence> &occurrences)
 {
-  hvalue_t old_value = 0;
-  hvalue_t new_value = taxid;
-  while (! hash.CompareAndSet(minimizer, new_value, &old_value))
-    new_value = tax.LowestCommonAncestor(old_value, taxid);
+  ofstream run_file(filename, ofstream::binary);
+  if (! run_file)
+    err(EX_CANTCREAT, "unable to create %s", filename.c_str());
+  for (auto &occ : occurrences)
+    WriteRunRecord(run_file, occ.minimizer, occ.taxid);
+  run_file.close();
+  if (! run_file)
+    errx(EX_IOERR, "error writing %s", filename.c_str());
 }
 
-void ProcessSequenceFast(const string &seq, taxid_t taxid,
-    CompactHashTable &hash, const Taxonomy &tax, MinimizerScanner &scanner,
-    uint64_t min_clear_hash_value)
+// K-way merge of sorted runs, passing each minimizer with the LCA of all
+// its taxa to the sink in minimizer order
+void MergeMinimizerRuns(const vector<string> &run_filenames,
+    size_t memory_limit, const Taxonomy &tax,
+    std::function<void(uint64_t, taxid_t)> sink)
 {
-  scanner.LoadSequence(seq);
-  uint64_t *minimizer_ptr;
-  while ((minimizer_ptr = scanner.NextMinimizer())) {
-    if (scanner.is_ambiguous())
-      continue;
-    if (min_clear_hash_value && MurmurHash3(*minimizer_ptr) < min_clear_hash_value)
-      continue;
-    hvalue_t existing_taxid = 0;
-    hvalue_t new_taxid = taxid;
-    while (! hash.CompareAndSet(*minimizer_ptr, new_taxid, &existing_taxid)) {
-      new_taxid = tax.LowestCommonAncestor(new_taxid, existing_taxid);
+  struct RunInput {
+    std::ifstream file;
+    vector<char> buffer;
+    size_t pos;    // current record
+    size_t count;  // records in buffer
+
+    uint64_t minimizer() const {
+      uint64_t minimizer;
+      memcpy(&minimizer, &buffer[pos * RUN_RECORD_SIZE], sizeof(minimizer));
+      return minimizer;
+    }
+    taxid_t taxid() const {
+      uint32_t taxid;
+      memcpy(&taxid, &buffer[pos * RUN_RECORD_SIZE + sizeof(uint64_t)],
+             sizeof(taxid));
+      return taxid;
+    }
+  };
+  size_t run_ct = run_filenames.size();
+  if (run_ct == 0)
+    return;
+  // Reads larger than a few MB don't go any faster
+  size_t buffer_ct = memory_limit / run_ct / RUN_RECORD_SIZE;
+  if (buffer_ct > 1024 * 1024)
+    buffer_ct = 1024 * 1024;
+  if (buffer_ct < 4096)
+    buffer_ct = 4096;
+
+  vector<RunInput> runs(run_ct);
+  // Refills a run's buffer, returns false when the run is exhausted
+  auto refill = [&](RunInput &run) {
+    run.buffer.resize(buffer_ct * RUN_RECORD_SIZE);
+    run.file.read(run.buffer.data(), run.buffer.size());
+    run.count = run.file.gcount() / RUN_RECORD_SIZE;
+    run.pos = 0;
+    return run.count > 0;
+  };
+
+  typedef std::pair<uint64_t, size_t> queue_entry_t;  // minimizer, run
+  std::priority_queue<queue_entry_t, vector<queue_entry_t>,
+                      std::greater<queue_entry_t>> merge_queue;
+  for (size_t i = 0; i < run_ct; i++) {
+    runs[i].file.open(run_filenames[i], std::ifstream::binary);
+    if (! runs[i].file)
+      err(EX_NOINPUT, "unable to read %s", run_filenames[i].c_str());
+    if (refill(runs[i]))
+      merge_queue.emplace(runs[i].minimizer(), i);
+  }
+
+  LCACache lca_cache(tax);
+  bool have_current = false;
+  uint64_t current_minimizer = 0;
+  taxid_t current_taxid = 0;
+  while (! merge_queue.empty()) {
+    auto minimizer = merge_queue.top().first;
+    auto i = merge_queue.top().second;
+    merge_queue.pop();
+    auto &run = runs[i];
+    if (have_current && minimizer == current_minimizer) {
+      current_taxid = lca_cache.LowestCommonAncestor(current_taxid,
+                                                     run.taxid());
+    }
+    else {
+      if (have_current)
+        sink(current_minimizer, current_taxid);
+      current_minimizer = minimizer;
+      current_taxid = run.taxid();
+      have_current = true;
+    }
+    if (++run.pos < run.count || refill(run))
+      merge_queue.emplace(run.minimizer(), i);
+  }
+  if (have_current)
+    sink(current_minimizer, current_taxid);
+}
+
+// Identifies the options and library files a checkpoint is valid for
+uint64_t BuildFingerprint(const Options &opts) {
+  std::ostringstream oss;
+  oss << opts.k << " " << opts.l << " " << opts.spaced_seed_mask << " "
+      << opts.toggle_mask << " " << opts.input_is_protein << " "
+      << opts.capacity << " " << opts.maximum_capacity << " "
+      << opts.load_factor << " " << (opts.memory_limit > 0) << " "
+      << opts.block_size << " " << opts.subblock_size << " "
+      << opts.requested_bits_for_taxid << " " << opts.min_clear_hash_value
+      << " " << ! opts.minimizer_cache_directory.empty();
+  auto add_file = [&oss](const string &filename) {
+    struct stat sb;
+    oss << "\n" << filename;
+    if (stat(filename.c_str(), &sb) == 0)
+      oss << " " << sb.st_size << " " << sb.st_mtime;
+  };
+  add_file(opts.ID_to_taxon_map_filename);
+  for (auto &filename : { "nodes.dmp", "names.dmp", "taxdump.k2s" })
+    add_file(opts.ncbi_taxonomy_directory + "/" + filename);
+  for (auto &filename : opts.library_filenames)
+    add_file(filename);
+
+  string str = oss.str();
+  uint64_t hash = 0xcbf29ce484222325ull;  // FNV-1a
+  for (char c : str) {
+    hash ^= (unsigned char) c;
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Returns false if there's no checkpoint to resume from
+bool ReadCheckpoint(const Options &opts, BuildCheckpoint &checkpoint) {
+  string filename = opts.hashtable_filename + ".checkpoint";
+  ifstream ifs(filename);
+  if (! ifs)
+    return false;
+  string line, magic;
+  uint64_t fingerprint = 0;
+  getline(ifs, magic);
+  if (magic != "K2CHECKPOINT 1")
+    errx(EX_DATAERR, "%s is not a build checkpoint", filename.c_str());
+  while (getline(ifs, line)) {
+    auto space_pos = line.find(' ');
+    string key = line.substr(0, space_pos);
+    string value = space_pos == string::npos ? "" : line.substr(space_pos + 1);
+    istringstream iss(value);
+    if (key == "fingerprint")
+      iss >> std::hex >> fingerprint;
+    else if (key == "position")
+      iss >> checkpoint.position.file_index >> checkpoint.position.offset;
+    else if (key == "processed")
+      iss >> checkpoint.processed_seq_ct >> checkpoint.processed_ch_ct;
+    else if (key == "generation")
+      iss >> checkpoint.generation;
+    else if (key == "table")
+      checkpoint.table_filename = value;
+    else if (key == "run")
+      checkpoint.run_filenames.push_back(value);
+  }
+  if (fingerprint != checkpoint.fingerprint)
+    errx(EX_DATAERR, "%s was made with different options or library files",
+         filename.c_str());
+  if (checkpoint.position.file_index > opts.library_filenames.size())
+    errx(EX_DATAERR, "%s is corrupt", filename.c_str());
+  return true;
+}
+
+// Replaces the checkpoint file atomically
+void WriteCheckpoint(const Options &opts, const BuildCheckpoint &checkpoint) {
+  string filename = opts.hashtable_filename + ".checkpoint";
+  string temp_filename = filename + ".tmp";
+  ofstream ofs(temp_filename);
+  ofs << "K2CHECKPOINT 1\n"
+      << "fingerprint " << std::hex << checkpoint.fingerprint << std::dec << "\n"
+      << "position " << checkpoint.position.file_index << " "
+      << checkpoint.position.offset << "\n"
+      << "processed " << checkpoint.processed_seq_ct << " "
+      << checkpoint.processed_ch_ct << "\n"
+      << "generation " << checkpoint.generation << "\n";
+  if (! checkpoint.table_filename.empty())
+    ofs << "table " << checkpoint.table_filename << "\n";
+  for (auto &run_filename : checkpoint.run_filenames)
+    ofs << "run " << run_filename << "\n";
+  ofs.close();
+  if (! ofs)
+    errx(EX_IOERR, "error writing %s", temp_filename.c_str());
+  if (rename(temp_filename.c_str(), filename.c_str()) < 0)
+    err(EX_IOERR, "unable to rename %s", temp_filename.c_str());
+}
+
+void RemoveCheckpoint(const Options &opts, const BuildCheckpoint &checkpoint) {
+  unlink((opts.hashtable_filename + ".checkpoint").c_str());
+  if (! checkpoint.table_filename.empty())
+    unlink(checkpoint.table_filename.c_str());
+  for (auto &run_filename : checkpoint.run_filenames)
+    unlink(run_filename.c_str());
+}
+
+// Reads the next batch of sequences that have a taxon, returns false at
+// end of input.  Blocks of the library files are read and parsed in
+// parallel, then taken in file order until the batch holds at least
+// batch_size bytes of input; the rest are kept in pending for the next
+// batch.  Batches are therefore the same regardless of thread count.
+// position is set to where the input following the batch starts.
+bool LoadSequenceBatch(const Options &opts, OrderedLibraryReader &reader,
+    std::deque<ParsedBlock> &pending, LibraryPosition &position,
+    size_t batch_size,
+    const SequenceIDMap &ID_to_taxon_map, const Taxonomy &taxonomy,
+    vector<string> &seqs, vector<taxid_t> &taxa,
+    size_t &processed_seq_ct, size_t &processed_ch_ct)
+{
+  vector<LibraryBlock> blocks;
+  size_t loaded_size = 0;
+  seqs.clear();
+  taxa.clear();
+  while (loaded_size < batch_size) {
+    if (pending.empty()) {
+      if (! reader.LoadBlocks(batch_size, blocks))
+        break;
+      pending.resize(blocks.size());
+      #pragma omp parallel for schedule(dynamic)
+      for (size_t i = 0; i < blocks.size(); i++) {
+        Sequence sequence;
+        auto &block = pending[i];
+        block.size = 0;
+        block.end = blocks[i].end;
+        while (blocks[i].reader->NextSequence(sequence)) {
+          block.size += sequence.raw_size;
+          taxid_t taxid = SequenceTaxon(sequence.header, ID_to_taxon_map,
+                                        taxonomy);
+          if (taxid) {
+            // Add terminator for protein sequences if not already there
+            if (opts.input_is_protein && sequence.seq.back() != '*')
+              sequence.seq.push_back('*');
+            block.seqs.emplace_back();
+            block.seqs.back().swap(sequence.seq);
+            block.taxa.push_back(taxid);
+          }
+        }
+      }
     }
+    auto &block = pending.front();
+    for (size_t i = 0; i < block.seqs.size(); i++) {
+      processed_seq_ct++;
+      processed_ch_ct += block.seqs[i].size();
+      seqs.emplace_back();
+      seqs.back().swap(block.seqs[i]);
+      taxa.push_back(block.taxa[i]);
+    }
+    loaded_size += block.size;
+    position = block.end;
+    pending.pop_front();
   }
+  return loaded_size > 0;
 }
 
-void ProcessSequence(const Options &opts, const string &seq, taxid_t taxid,
-    CompactHashTable &hash, const Taxonomy &tax)
+// Scans all subblocks of all sequences in parallel.  Blocks and subblocks
+// are laid out as in the original per-sequence build: blocks are handled
+// in order, and consecutive blocks and subblocks overlap by k-1 characters.
+void GatherMinimizerOccurrences(const Options &opts, const vector<string> &seqs,
+    const vector<taxid_t> &taxa, vector<MinimizerOccurrence> &occurrences)
 {
-  const int set_ct = 256;
-  omp_lock_t locks[set_ct];
-  for (int i = 0; i < set_ct; i++)
-    omp_init_lock(&locks[i]);
-  // for each block in the sequence
-  for (size_t j = 0; j < seq.size(); j += opts.block_size) {
-    // block: fixed length subsequence of DNA/protein, handled in series,
-    //   consecutive blocks overlap by k-1 characters
-    size_t block_start = j;
-    size_t block_finish = j + opts.block_size + opts.k - 1;
-    if (block_finish > seq.size())
-      block_finish = seq.size();
-    std::set<uint64_t> minimizer_sets[set_ct];
-
-    // for each subblock in the block, gather minimizers in parallel
-    #pragma omp parallel for schedule(dynamic)
-    for (size_t i = block_start; i < block_finish; i += opts.subblock_size) {
-      // subblock: fixed length subsequence of block, handled in parallel,
-      //   consecutive subblocks overlap by k-1 characters
-      MinimizerScanner scanner(opts.k, opts.l, opts.spaced_seed_mask,
-                               ! opts.input_is_protein, opts.toggle_mask);
-      size_t subblock_finish = i + opts.subblock_size + opts.k - 1;
-      if (subblock_finish > block_finish)
-        subblock_finish = block_finish;
-      scanner.LoadSequence(seq, i, subblock_finish);
+  struct Subblock {
+    uint32_t seq_idx;
+    uint32_t block_idx;
+    size_t start, finish;
+  };
+  vector<Subblock> subblocks;
+  for (size_t s = 0; s < seqs.size(); s++) {
+    auto &seq = seqs[s];
+    for (size_t j = 0; j < seq.size(); j += opts.block_size) {
+      size_t block_finish = j + opts.block_size + opts.k - 1;
+      if (block_finish > seq.size())
+        block_finish = seq.size();
+      for (size_t i = j; i < block_finish; i += opts.subblock_size) {
+        size_t subblock_finish = i + opts.subblock_size + opts.k - 1;
+        if (subblock_finish > block_finish)
+          subblock_finish = block_finish;
+        subblocks.push_back({ (uint32_t) s, (uint32_t) (j / opts.block_size),
+                              i, subblock_finish });
+      }
+    }
+  }
+
+  int thread_ct = omp_get_max_threads();
+  vector<vector<MinimizerOccurrence>> thread_occurrences(thread_ct);
+  #pragma omp parallel
+  {
+    auto &local = thread_occurrences[omp_get_thread_num()];
+    local.clear();
+    MinimizerScanner scanner(opts.k, opts.l, opts.spaced_seed_mask,
+                             ! opts.input_is_protein, opts.toggle_mask);
+    #pragma omp for schedule(dynamic)
+    for (size_t b = 0; b < subblocks.size(); b++) {
+      auto &subblock = subblocks[b];
+      uint64_t position = ((uint64_t) subblock.seq_idx << 32) | subblock.block_idx;
+      taxid_t taxid = taxa[subblock.seq_idx];
+      scanner.LoadSequence(seqs[subblock.seq_idx], subblock.start, subblock.finish);
       uint64_t *minimizer_ptr;
+      // Consecutive k-mers mostly share their minimizer, and repeats within
+      // a subblock (same position and taxon) would only be reduced away
+      // later, so they're dropped here, cutting the occurrences to sort
+      bool have_last = false;
+      uint64_t last_minimizer = 0;
       while ((minimizer_ptr = scanner.NextMinimizer())) {
         if (scanner.is_ambiguous())
           continue;
-        auto hc = MurmurHash3(*minimizer_ptr);
+        if (have_last && *minimizer_ptr == last_minimizer)
+          continue;
+        have_last = true;
+        last_minimizer = *minimizer_ptr;
         // Hash-based subsampling
-        if (opts.min_clear_hash_value && hc < opts.min_clear_hash_value)
+        if (opts.min_clear_hash_value &&
+            MurmurHash3(*minimizer_ptr) < opts.min_clear_hash_value)
           continue;
-        auto zone = hc % set_ct;
-        omp_set_lock(&locks[zone]);
-        minimizer_sets[zone].insert(*minimizer_ptr);
-        omp_unset_lock(&locks[zone]);
+        local.push_back({ *minimizer_ptr, position, taxid });
       }
-    }  // end subblock for loop
+    }
+  }
 
-    // combine sets into sorted list
-    std::vector<uint64_t> minimizer_lists[set_ct];
-    size_t minimizer_list_prefix_sizes[set_ct+1] = {0};
-    #pragma omp parallel for
-    for (int i = 0; i < set_ct; i++) {
-      minimizer_lists[i].reserve(minimizer_sets[i].size());
-      for (auto &m : minimizer_sets[i])
-        minimizer_lists[i].push_back(m);
-      sort(minimizer_lists[i].begin(), minimizer_lists[i].end());
-      minimizer_list_prefix_sizes[i+1] = minimizer_lists[i].size();
-    }
-    for (int i = 2; i <= set_ct; i++)
-      minimizer_list_prefix_sizes[i] += minimizer_list_prefix_sizes[i-1];
-    std::vector<uint64_t> minimizer_list(minimizer_list_prefix_sizes[set_ct]);
-    #pragma omp parallel for
-    for (int i = 0; i < set_ct; i++) {
-      std::copy(minimizer_lists[i].begin(), minimizer_lists[i].end(),
-          minimizer_list.begin() + minimizer_list_prefix_sizes[i]);
-    }
-
-    size_t mm_ct = minimizer_list.size();
-    std::vector<size_t> index_list(mm_ct);
-    std::vector<bool> insertion_list(mm_ct);
-    for (size_t i = 0; i < mm_ct; i++)
-      insertion_list[i] = true;
-    // Loop to enforce deterministic order
-    while (! minimizer_list.empty()) {
-      // Gather insertion point information for all remaining minimizers
-      #pragma omp parallel for
-      for (size_t i = 0; i < mm_ct; i++) {
-        // once we've determined that a minimizer won't be an insertion,
-        // don't bother calling FindIndex() again
-        if (insertion_list[i]) {
-          size_t idx;
-          insertion_list[i] = ! hash.FindIndex(minimizer_list[i], &idx);
-          index_list[i] = idx;
-        }
+  size_t total = 0;
+  for (auto &local : thread_occurrences)
+    total += local.size();
+  occurrences.resize(total);
+  auto out = occurrences.begin();
+  for (auto &local : thread_occurrences)
+    out = std::copy(local.begin(), local.end(), out);
+}
+
+// Finds each library file's cache file, scanning the files that don't have
+// one yet and writing theirs
+void PrepareMinimizerCache(Options &opts) {
+  if (mkdir(opts.minimizer_cache_directory.c_str(), 0777) < 0
+      && errno != EEXIST)
+    err(EX_CANTCREAT, "unable to create %s",
+        opts.minimizer_cache_directory.c_str());
+  MinimizerCacheKey key;
+  memset(&key, 0, sizeof(key));
+  key.k = opts.k;
+  key.l = opts.l;
+  key.spaced_seed_mask = opts.spaced_seed_mask;
+  key.toggle_mask = opts.toggle_mask;
+  key.dna_db = ! opts.input_is_protein;
+  key.block_size = opts.block_size;
+  key.read_block_size = DEFAULT_BLOCK_SIZE;
+
+  vector<size_t> missing;
+  for (size_t i = 0; i < opts.library_filenames.size(); i++) {
+    if (opts.library_filenames[i] == "-")
+      errx(EX_USAGE, "can't cache minimizers of standard input");
+    opts.minimizer_cache_filenames.push_back(MinimizerCacheFilename(
+        opts.minimizer_cache_directory, opts.library_filenames[i], key));
+    opts.minimizer_cache_keys.push_back(key);
+    if (! IsMinimizerCacheFile(opts.minimizer_cache_filenames.back(), key))
+      missing.push_back(i);
+  }
+  std::cerr << "Found cached minimizers for "
+            << opts.library_filenames.size() - missing.size() << " of "
+            << opts.library_filenames.size() << " library files" << std::endl;
+  if (! missing.empty())
+    FillMinimizerCache(opts, missing);
+}
+
+// Reads and scans the given library files, writing their cache files.
+// Files are read in the blocks LoadSequenceBatch() reads, so the cache
+// gives the same batches.  Every sequence is cached, as another taxonomy
+// or map may give a taxon to one without one now, and minimizers aren't
+// subsampled.
+void FillMinimizerCache(const Options &opts, const vector<size_t> &missing) {
+  vector<string> filenames;
+  for (auto i : missing)
+    filenames.push_back(opts.library_filenames[i]);
+  OrderedLibraryReader reader(filenames, opts.num_threads);
+  Options scan_opts = opts;
+  scan_opts.min_clear_hash_value = 0;
+  vector<MinimizerCacheWriter *> writers(filenames.size(), nullptr);
+  vector<bool> finished(filenames.size(), false);
+  vector<LibraryBlock> blocks;
+  vector<string> seqs;
+  vector<taxid_t> taxa;
+  vector<MinimizerOccurrence> occurrences, scratch;
+  size_t scanned_seq_ct = 0, scanned_ch_ct = 0;
+
+  while (reader.LoadBlocks(DEFAULT_BLOCK_SIZE, blocks)) {
+    vector<ParsedBlock> parsed(blocks.size());
+    vector<vector<string>> headers(blocks.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < blocks.size(); i++) {
+      Sequence sequence;
+      parsed[i].size = 0;
+      while (blocks[i].reader->NextSequence(sequence)) {
+        parsed[i].size += sequence.raw_size;
+        if (opts.input_is_protein &&
+            (sequence.seq.empty() || sequence.seq.back() != '*'))
+          sequence.seq.push_back('*');
+        headers[i].push_back(sequence.header);
+        parsed[i].seqs.emplace_back();
+        parsed[i].seqs.back().swap(sequence.seq);
       }
+    }
+    vector<size_t> block_starts(blocks.size() + 1, 0);
+    seqs.clear();
+    for (size_t i = 0; i < blocks.size(); i++) {
+      for (auto &seq : parsed[i].seqs) {
+        scanned_ch_ct += seq.size();
+        seqs.emplace_back();
+        seqs.back().swap(seq);
+      }
+      block_starts[i + 1] = seqs.size();
+    }
+    scanned_seq_ct += seqs.size();
+    taxa.assign(seqs.size(), 1);
 
-      // Determine safe prefix of sorted set to insert in parallel
-      std::set<uint64_t> novel_insertion_points;
-      size_t safe_ct = 0;
-      for (safe_ct = 0; safe_ct < mm_ct; safe_ct++) {
-        if (insertion_list[safe_ct]) {
-          if (novel_insertion_points.count(index_list[safe_ct]) > 0)
-            break;
-          novel_insertion_points.insert(index_list[safe_ct]);
+    // Group each sequence's occurrences, sorted by minimizer
+    GatherMinimizerOccurrences(scan_opts, seqs, taxa, occurrences);
+    RadixSort(occurrences, scratch,
+        [](const MinimizerOccurrence &o) { return o.minimizer; });
+    RadixSort(occurrences, scratch,
+        [](const MinimizerOccurrence &o) { return o.position >> 32; }, 32);
+    vector<size_t> seq_starts(seqs.size() + 1, 0);
+    for (auto &occ : occurrences)
+      seq_starts[(occ.position >> 32) + 1]++;
+    for (size_t s = 0; s < seqs.size(); s++)
+      seq_starts[s + 1] += seq_starts[s];
+
+    vector<string> block_data(blocks.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < blocks.size(); i++) {
+      vector<uint64_t> minimizers;
+      vector<uint32_t> block_indexes;
+      for (size_t s = block_starts[i]; s < block_starts[i + 1]; s++) {
+        minimizers.clear();
+        block_indexes.clear();
+        bool has_block_indexes = false;
+        for (size_t j = seq_starts[s]; j < seq_starts[s + 1]; j++) {
+          auto &occ = occurrences[j];
+          uint32_t block_index = (uint32_t) occ.position;
+          if (! minimizers.empty() && minimizers.back() == occ.minimizer) {
+            if (block_index < block_indexes.back())
+              block_indexes.back() = block_index;
+          }
+          else {
+            minimizers.push_back(occ.minimizer);
+            block_indexes.push_back(block_index);
+          }
+          if (block_index)
+            has_block_indexes = true;
         }
+        EncodeCachedSequence(block_data[i],
+            headers[i][s - block_starts[i]], seqs[s].size(),
+            minimizers.data(),
+            has_block_indexes ? block_indexes.data() : nullptr,
+            minimizers.size());
       }
+    }
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+      auto file_index = blocks[i].file_index;
+      auto cache_index = missing[file_index];
+      if (writers[file_index] == nullptr)
+        writers[file_index] = new MinimizerCacheWriter(
+            opts.minimizer_cache_filenames[cache_index],
+            opts.minimizer_cache_keys[cache_index]);
+      bool last = blocks[i].end.file_index != file_index;
+      writers[file_index]->AddBlock(parsed[i].size,
+          last ? 0 : blocks[i].end.offset,
+          block_starts[i + 1] - block_starts[i], block_data[i]);
+      if (last) {
+        writers[file_index]->Finish();
+        delete writers[file_index];
+        writers[file_index] = nullptr;
+        finished[file_index] = true;
+      }
+    }
+    if (isatty(fileno(stderr))) {
+      std::cerr << "\rScanned " << scanned_seq_ct << " sequences (" << scanned_ch_ct << " " << (opts.input_is_protein ? "aa" : "bp") << ")...";
+    }
+  }
+  // Files without sequences have caches without blocks
+  for (size_t i = 0; i < filenames.size(); i++) {
+    if (finished[i])
+      continue;
+    MinimizerCacheWriter writer(opts.minimizer_cache_filenames[missing[i]],
+                                opts.minimizer_cache_keys[missing[i]]);
+    writer.Finish();
+  }
+  if (isatty(fileno(stderr)))
+    std::cerr << "\r";
+  std::cerr << "Cached minimizers of " << scanned_seq_ct << " sequences, " << scanned_ch_ct << " " << (opts.input_is_protein ? "aa" : "bp") << std::endl;
+}
 
-      // Adjust CHT values for all keys in the safe zone in parallel
-      #pragma omp parallel for
-      for (size_t i = 0; i < safe_ct; i++) {
-        SetMinimizerLCA(hash, minimizer_list[i], taxid, tax);
+// Reads the next batch from the minimizer cache, returns false at end of
+// input.  Batches are made of the same blocks as LoadSequenceBatch()
+// makes them of, and the occurrences of the minimizers of their sequences
+// with a taxon are as GatherMinimizerOccurrences() would give, apart from
+// order and repeats.
+bool LoadCachedBatch(const Options &opts, MinimizerCacheReader &reader,
+    LibraryPosition &position, size_t batch_size,
+    const SequenceIDMap &ID_to_taxon_map, const Taxonomy &taxonomy,
+    vector<MinimizerOccurrence> &occurrences,
+    size_t &processed_seq_ct, size_t &processed_ch_ct)
+{
+  vector<CachedBlock> blocks;
+  size_t loaded_size = 0;
+  while (loaded_size < batch_size) {
+    blocks.emplace_back();
+    if (! reader.NextBlock(blocks.back())) {
+      blocks.pop_back();
+      break;
+    }
+    loaded_size += blocks.back().size;
+    position = blocks.back().end;
+  }
+
+  vector<vector<CachedSequence>> block_seqs(blocks.size());
+  vector<vector<taxid_t>> block_taxa(blocks.size());
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < blocks.size(); i++) {
+    CachedSequence sequence;
+    const char *ptr = blocks[i].data.data();
+    for (uint64_t j = 0; j < blocks[i].seq_ct; j++) {
+      ptr = DecodeCachedSequence(ptr, sequence);
+      taxid_t taxid = SequenceTaxon(sequence.header, ID_to_taxon_map,
+                                    taxonomy);
+      if (taxid) {
+        block_seqs[i].push_back(sequence);
+        block_taxa[i].push_back(taxid);
       }
+    }
+  }
+  vector<CachedSequence> seqs;
+  vector<taxid_t> taxa;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    for (size_t j = 0; j < block_seqs[i].size(); j++) {
+      processed_seq_ct++;
+      processed_ch_ct += block_seqs[i][j].char_ct;
+      seqs.push_back(block_seqs[i][j]);
+      taxa.push_back(block_taxa[i][j]);
+    }
+  }
 
-      // Remove safe prefix and re-iterate to process remainder
-      minimizer_list.erase(minimizer_list.begin(), minimizer_list.begin() + safe_ct);
-      index_list.erase(index_list.begin(), index_list.begin() + safe_ct);
-      insertion_list.erase(insertion_list.begin(), insertion_list.begin() + safe_ct);
-      mm_ct -= safe_ct;
-    }  // end deterministic order while loop
-  }  // end block for loop
+  int thread_ct = omp_get_max_threads();
+  vector<vector<MinimizerOccurrence>> thread_occurrences(thread_ct);
+  #pragma omp parallel
+  {
+    auto &local = thread_occurrences[omp_get_thread_num()];
+    #pragma omp for schedule(dynamic)
+    for (size_t s = 0; s < seqs.size(); s++) {
+      ForEachCachedMinimizer(seqs[s],
+        [&](uint64_t minimizer, uint32_t block_index) {
+          if (opts.min_clear_hash_value &&
+              MurmurHash3(minimizer) < opts.min_clear_hash_value)
+            return;
+          local.push_back({ minimizer, ((uint64_t) s << 32) | block_index,
+                            taxa[s] });
+        });
+    }
+  }
 
-  for (int i = 0; i < set_ct; i++)
-    omp_destroy_lock(&locks[i]);
+  size_t total = 0;
+  for (auto &local : thread_occurrences)
+    total += local.size();
+  occurrences.resize(total);
+  auto out = occurrences.begin();
+  for (auto &local : thread_occurrences)
+    out = std::copy(local.begin(), local.end(), out);
+  return loaded_size > 0;
 }
 
-void ReadIDToTaxonMap(map<string, taxid_t> &id_map, string &filename) {
-  ifstream map_file(filename.c_str());
-  if (! map_file.good())
-    err(EX_NOINPUT, "unable to read from '%s'", filename.c_str());
-  string line;
+// Stable parallel LSD radix sort on the low key_bits bits of the key
+// returned by key_fn, one byte per pass.  Passes where every key has the
+// same byte are skipped.
+template <typename T, typename F>
+void RadixSort(vector<T> &items, vector<T> &scratch, F key_fn, int key_bits) {
+  const int bucket_ct = 256;
+  size_t n = items.size();
+  int thread_ct = omp_get_max_threads();
+  size_t chunk_size = (n + thread_ct - 1) / thread_ct;
+  vector<size_t> offsets(thread_ct * bucket_ct);
+  scratch.resize(n);
+
+  for (int shift = 0; shift < key_bits; shift += 8) {
+    std::fill(offsets.begin(), offsets.end(), 0);
+    #pragma omp parallel for schedule(static, 1)
+    for (int t = 0; t < thread_ct; t++) {
+      size_t *counts = &offsets[t * bucket_ct];
+      size_t finish = std::min(n, (t + 1) * chunk_size);
+      for (size_t i = t * chunk_size; i < finish; i++)
+        counts[(key_fn(items[i]) >> shift) & 0xff]++;
+    }
+
+    // Turn counts into scatter offsets, ordered by bucket, then by thread
+    bool single_bucket = false;
+    size_t total = 0;
+    for (int b = 0; b < bucket_ct; b++) {
+      size_t bucket_total = 0;
+      for (int t = 0; t < thread_ct; t++) {
+        auto count = offsets[t * bucket_ct + b];
+        offsets[t * bucket_ct + b] = total + bucket_total;
+        bucket_total += count;
+      }
+      if (bucket_total == n)
+        single_bucket = true;
+      total += bucket_total;
+    }
+    if (single_bucket)
+      continue;
+
+    #pragma omp parallel for schedule(static, 1)
+    for (int t = 0; t < thread_ct; t++) {
+      size_t *next = &offsets[t * bucket_ct];
+      size_t finish = std::min(n, (t + 1) * chunk_size);
+      for (size_t i = t * chunk_size; i < finish; i++)
+        scratch[ next[(key_fn(items[i]) >> shift) & 0xff]++ ] = items[i];
+    }
+    items.swap(scratch);
+  }
+}
+
+// Collapses runs of equal minimizers (sorted by minimizer) into one entry
+// holding the LCA of the run's taxa and its earliest position
+void ReduceMinimizerOccurrences(vector<MinimizerOccurrence> &occurrences,
+    vector<LCACache> &lca_caches)
+{
+  size_t n = occurrences.size();
+  if (n == 0)
+    return;
+  int thread_ct = omp_get_max_threads();
+  // Chunk boundaries are moved forward to the start of a run
+  vector<size_t> chunk_starts(thread_ct + 1, n);
+  for (int t = 0; t < thread_ct; t++) {
+    size_t start = n * t / thread_ct;
+    while (start > 0 && start < n &&
+           occurrences[start].minimizer == occurrences[start - 1].minimizer)
+      start++;
+    chunk_starts[t] = start;
+  }
+  for (int t = thread_ct - 1; t > 0; t--)
+    if (chunk_starts[t] > chunk_starts[t + 1])
+      chunk_starts[t] = chunk_starts[t + 1];
+  vector<size_t> chunk_sizes(thread_ct, 0);
+
+  #pragma omp parallel for schedule(static, 1)
+  for (int t = 0; t < thread_ct; t++) {
+    auto &lca_cache = lca_caches[omp_get_thread_num()];
+    size_t out = chunk_starts[t];
+    for (size_t i = chunk_starts[t]; i < chunk_starts[t + 1]; i++) {
+      auto &occ = occurrences[i];
+      if (out > chunk_starts[t] && occurrences[out - 1].minimizer == occ.minimizer) {
+        auto &reduced = occurrences[out - 1];
+        if (occ.taxid != reduced.taxid)
+          reduced.taxid = lca_cache.LowestCommonAncestor(reduced.taxid, occ.taxid);
+        if (occ.position < reduced.position)
+          reduced.position = occ.position;
+      }
+      else {
+        occurrences[out++] = occ;
+      }
+    }
+    chunk_sizes[t] = out - chunk_starts[t];
+  }
 
-  while (getline(map_file, line)) {
-    string seq_id;
-    taxid_t taxid;
-    istringstream iss(line);
-    iss >> seq_id;
-    iss >> taxid;
-    id_map[seq_id] = taxid;
+  size_t out = 0;
+  for (int t = 0; t < thread_ct; t++) {
+    std::copy(occurrences.begin() + chunk_starts[t],
+              occurrences.begin() + chunk_starts[t] + chunk_sizes[t],
+              occurrences.begin() + out);
+    out += chunk_sizes[t];
   }
+  occurrences.resize(out);
 }
 
-void GenerateTaxonomy(Options &opts, map<string, taxid_t> &id_map) {
-  NCBITaxonomy ncbi_taxonomy(
-    opts.ncbi_taxonomy_directory + "/nodes.dmp",
-    opts.ncbi_taxonomy_directory + "/names.dmp"
-  );
-  for (auto &kv_pair : id_map) {
-    if (kv_pair.second != 0) {
-      ncbi_taxonomy.MarkNode(kv_pair.second);
+// Inserts in list order, with the same result as inserting serially.  A
+// window of pending minimizers has its insertion points found in parallel,
+// and the longest prefix of the window with no two new keys sharing an
+// insertion point is then set in parallel.
+void InsertMinimizerOccurrences(const vector<MinimizerOccurrence> &occurrences,
+    CompactHashTable &hash, vector<LCACache> &lca_caches)
+{
+  const size_t min_window = 1024;
+  const size_t max_window = 1024 * 1024;
+  size_t window = min_window;
+  vector<size_t> index_list;
+  vector<char> insertion_list;
+  // Open-addressed set of the window's novel insertion points; a slot is
+  // only in use if it has the current window's stamp, so the set needn't
+  // be cleared between windows
+  vector<size_t> point_slots;
+  vector<uint32_t> point_stamps;
+  uint32_t stamp = 0;
+
+  size_t start = 0;
+  while (start < occurrences.size()) {
+    size_t mm_ct = std::min(window, occurrences.size() - start);
+    index_list.resize(mm_ct);
+    insertion_list.resize(mm_ct);
+    #pragma omp parallel for
+    for (size_t i = 0; i < mm_ct; i++) {
+      size_t idx;
+      insertion_list[i] = ! hash.FindIndex(occurrences[start + i].minimizer, &idx);
+      index_list[i] = idx;
     }
+
+    // Determine safe prefix of window to insert in parallel
+    size_t slot_ct = 1;
+    while (slot_ct < 2 * mm_ct)
+      slot_ct <<= 1;
+    if (point_slots.size() < slot_ct || ++stamp == 0) {
+      point_slots.assign(std::max(slot_ct, point_slots.size()), 0);
+      point_stamps.assign(point_slots.size(), 0);
+      stamp = 1;
+    }
+    size_t safe_ct;
+    for (safe_ct = 0; safe_ct < mm_ct; safe_ct++) {
+      if (insertion_list[safe_ct]) {
+        auto point = index_list[safe_ct];
+        auto slot = MurmurHash3(point) & (slot_ct - 1);
+        while (point_stamps[slot] == stamp && point_slots[slot] != point)
+          slot = (slot + 1) & (slot_ct - 1);
+        if (point_stamps[slot] == stamp)
+          break;
+        point_stamps[slot] = stamp;
+        point_slots[slot] = point;
+      }
+    }
+
+    #pragma omp parallel for
+    for (size_t i = start; i < start + safe_ct; i++)
+      SetMinimizerLCA(hash, occurrences[i].minimizer, occurrences[i].taxid,
+                      lca_caches[omp_get_thread_num()]);
+
+    start += safe_ct;
+    window = std::max(min_window, std::min(max_window, 2 * safe_ct));
   }
-  ncbi_taxonomy.ConvertToKrakenTaxonomy(opts.taxonomy_filename.c_str());
+}
+
+// Calls fn(id, id_len) for each sequence ID in a header: the first word,
+// and the first word after each 0x01 separator (NCBI's mark for another
+// header on the same line, in non-redundant DBs).  IDs point into header.
+template <typename F>
+void ForEachNCBISequenceID(const string &header, F fn) {
+  const char *data = header.data();
+  size_t id_start = 1;
+  bool in_id = true;
+  // start loop at first char after '>'
+  for (size_t i = 1; i < header.size(); ++i) {
+    if (data[i] == 0x01) {
+      // 0x01 starts new ID at next char
+      if (in_id && i > id_start)
+        fn(data + id_start, i - id_start);
+      id_start = i + 1;
+      in_id = true;
+    }
+    else if (in_id && isspace((unsigned char) data[i])) {
+      // spaces end ID
+      if (i > id_start)
+        fn(data + id_start, i - id_start);
+      in_id = false;
+    }
+  }
+  if (in_id && header.size() > id_start)
+    fn(data + id_start, header.size() - id_start);
+}
+
+// LCA of the taxa of all of a header's sequence IDs, 0 if none are mapped
+taxid_t SequenceTaxon(const string &header,
+    const SequenceIDMap &ID_to_taxon_map, const Taxonomy &taxonomy)
+{
+  taxid_t taxid = 0;
+  ForEachNCBISequenceID(header, [&](const char *id, size_t id_len) {
+    auto ext_taxid = ID_to_taxon_map.Get(id, id_len);
+    taxid = taxonomy.LowestCommonAncestor(taxid, taxonomy.GetInternalID(ext_taxid));
+  });
+  return taxid;
+}
+
+void SetMinimizerLCA(CompactHashTable &hash, uint64_t minimizer, taxid_t taxid,
+    LCACache &lca_cache)
+{
+  hvalue_t old_value = 0;
+  hvalue_t new_value = taxid;
+  while (! hash.CompareAndSet(minimizer, new_value, &old_value))
+    new_value = lca_cache.LowestCommonAncestor(old_value, taxid);
+}
+
+void ReportLCACacheUse(const vector<LCACache> &lca_caches) {
+  uint64_t lookup_ct = 0, hit_ct = 0;
+  for (auto &lca_cache : lca_caches) {
+    lookup_ct += lca_cache.lookup_ct();
+    hit_ct += lca_cache.hit_ct();
+  }
+  if (lookup_ct)
+    std::cerr << "LCA cache answered " << hit_ct << " of " << lookup_ct
+              << " LCA queries (" << (hit_ct * 100.0 / lookup_ct) << "%)"
+              << std::endl;
+}
+
+// Raises the soft limit on open files to the hard limit where allowed, and
+// returns the limit in effect
+size_t RaiseOpenFileLimit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+    err(EX_OSERR, "unable to get open file limit");
+  if (limit.rlim_cur != limit.rlim_max) {
+    struct rlimit raised = limit;
+    raised.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &raised) == 0)
+      limit = raised;
+  }
+  if (limit.rlim_cur == RLIM_INFINITY)
+    return SIZE_MAX;
+  return limit.rlim_cur;
+}
+
+void ProcessSequenceFast(const string &seq, taxid_t taxid,
+    CompactHashTable &hash, LCACache &lca_cache, MinimizerScanner &scanner,
+    uint64_t min_clear_hash_value)
+{
+  scanner.LoadSequence(seq);
+  uint64_t *minimizer_ptr;
+  bool have_last = false;
+  uint64_t last_minimizer = 0;
+  while ((minimizer_ptr = scanner.NextMinimizer())) {
+    if (scanner.is_ambiguous())
+      continue;
+    // A repeat of the last minimizer has its taxon set already
+    if (have_last && *minimizer_ptr == last_minimizer)
+      continue;
+    have_last = true;
+    last_minimizer = *minimizer_ptr;
+    if (min_clear_hash_value && MurmurHash3(*minimizer_ptr) < min_clear_hash_value)
+      continue;
+    hvalue_t existing_taxid = 0;
+    hvalue_t new_taxid = taxid;
+    while (! hash.CompareAndSet(*minimizer_ptr, new_taxid, &existing_taxid)) {
+      new_taxid = lca_cache.LowestCommonAncestor(new_taxid, existing_taxid);
+    }
+  }
+}
+
+void GenerateTaxonomy(Options &opts, const SequenceIDMap &id_map) {
+  auto ncbi_taxonomy = LoadNCBITaxonomy(opts.ncbi_taxonomy_directory);
+  id_map.ForEachTaxon([&](taxid_t taxid) {
+    if (taxid != 0)
+      ncbi_taxonomy->MarkNode(taxid);
+  });
+  ncbi_taxonomy->ConvertToKrakenTaxonomy(opts.taxonomy_filename.c_str());
+  delete ncbi_taxonomy;
 }
 
 void ParseCommandLine(int argc, char **argv, Options &opts) {
   int opt;
   long long sig;
 
-  while ((opt = getopt(argc, argv, "?hB:b:c:FH:m:n:o:t:k:l:M:p:r:s:S:T:X")) != -1) {
+  while ((opt = getopt(argc, argv, "?ha:B:b:c:C:D:FH:L:m:n:o:Rt:k:l:M:p:r:s:S:T:XY:")) != -1) {
     switch (opt) {
       case 'h' : case '?' :
         usage(0);
@@ -533,9 +1624,35 @@ void ParseCommandLine(int argc, char **argv, Options &opts) {
       case 'F' :
         opts.deterministic_build = false;
         break;
+      case 'L' :
+        sig = atoll(optarg);
+        if (sig < 1)
+          errx(EX_USAGE, "memory limit must be positive integer");
+        opts.memory_limit = sig;
+        break;
+      case 'D' :
+        opts.spill_directory = optarg;
+        break;
+      case 'a' :
+        opts.load_factor = atof(optarg);
+        if (opts.load_factor <= 0 || opts.load_factor > 1)
+          errx(EX_USAGE, "load factor must be in (0, 1]");
+        break;
+      case 'C' :
+        sig = atoll(optarg);
+        if (sig < 1)
+          errx(EX_USAGE, "checkpoint interval must be positive integer");
+        opts.checkpoint_interval = sig;
+        break;
+      case 'R' :
+        opts.resume = true;
+        break;
       case 'X' :
         opts.input_is_protein = true;
         break;
+      case 'Y' :
+        opts.minimizer_cache_directory = optarg;
+        break;
     }
   }
 
@@ -551,10 +1668,18 @@ void ParseCommandLine(int argc, char **argv, Options &opts) {
     cerr << "missing mandatory filename parameter" << endl;
     usage();
   }
-  if (opts.k == 0 || opts.l == 0 || opts.capacity == 0) {
+  if (opts.k == 0 || opts.l == 0 || (opts.capacity == 0 && opts.load_factor == 0)) {
     cerr << "missing mandatory integer parameter" << endl;
     usage();
   }
+  if (opts.capacity && opts.load_factor) {
+    cerr << "capacity and load factor can't both be given" << endl;
+    usage();
+  }
+  if (opts.load_factor && ! opts.deterministic_build) {
+    cerr << "load factor can't be used with fast build" << endl;
+    usage();
+  }
   if (opts.k < opts.l) {
     cerr << "k cannot be less than l" << endl;
     usage();
@@ -563,14 +1688,40 @@ void ParseCommandLine(int argc, char **argv, Options &opts) {
     cerr << "block size cannot be less than subblock size\n";
     usage();
   }
-  if (opts.maximum_capacity > opts.capacity) {
+  if (opts.capacity && opts.maximum_capacity > opts.capacity) {
     cerr << "maximum capacity option shouldn't specify larger capacity than normal" << endl;
     usage();
   }
+  if (opts.memory_limit && ! opts.deterministic_build) {
+    cerr << "memory limit can't be used with fast build" << endl;
+    usage();
+  }
+  if ((opts.checkpoint_interval || opts.resume) && ! opts.deterministic_build) {
+    cerr << "checkpoints can't be used with fast build" << endl;
+    usage();
+  }
+
+  vector<string> library_paths(argv + optind, argv + argc);
+  if (library_paths.empty())
+    library_paths.push_back("-");
+  opts.library_filenames = ListLibraryFiles(library_paths);
+  if (opts.library_filenames.empty())
+    errx(EX_NOINPUT, "no library files found");
+  // Standard input can't be identified or reread on resuming
+  if (opts.checkpoint_interval || opts.resume) {
+    for (auto &filename : opts.library_filenames)
+      if (filename == "-")
+        errx(EX_USAGE, "checkpoints can't be used when reading the library "
+             "from standard input");
+  }
 }
 
 void usage(int exit_code) {
-  cerr << "Usage: build_db <options>\n"
+  cerr << "Usage: build_db <options> [library files/directories]\n"
+       << "\n"
+       << "Reads the library from the given files, which may be gzipped, and\n"
+       << "from the .fna/.faa files found in the given directories, or from\n"
+       << "standard input if none are given.\n"
        << "\n"
        << "Options (*mandatory):\n"
        << "* -H FILENAME   Kraken 2 hash table filename\n"
@@ -581,12 +1732,24 @@ void usage(int exit_code) {
        << "* -k INT        Set length of k-mers\n"
        << "* -l INT        Set length of minimizers\n"
        << "* -c INT        Set capacity of hash table\n"
+       << "* -a FLOAT      Instead of -c, size hash table for this load factor\n"
+       << "                after counting minimizers (reads input once)\n"
        << "  -M INT        Set maximum capacity of hash table (MiniKraken)\n"
        << "  -S BITSTRING  Spaced seed mask\n"
        << "  -T BITSTRING  Minimizer toggle mask\n"
        << "  -X            Input seqs. are proteins\n"
        << "  -p INT        Number of threads\n"
        << "  -F            Use fast, nondeterministic building method\n"
+       << "  -L INT        Build out of core, using about INT bytes of memory\n"
+       << "                (including the sequence ID map and taxonomy)\n"
+       << "  -D DIR        Directory for out-of-core build temp. files\n"
+       << "  -C INT        Save a checkpoint at most every INT seconds (or after\n"
+       << "                each sorted run, when building out of core); an\n"
+       << "                in-memory table is written whole each time\n"
+       << "  -R            Resume from checkpoint, if there is one\n"
+       << "  -Y DIR        Cache each library file's minimizers in DIR, and\n"
+       << "                read them from there instead of the file in later\n"
+       << "                builds with the same k, l, masks and block size\n"
        << "  -B INT        Read block size\n"
        << "  -b INT        Read subblock size\n"
        << "  -r INT        Bit storage requested for taxid" << endl;
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#include "kraken2_headers.h"
+#include "taxonomy.h"
+
+using namespace kraken2;
+using std::string;
+
+struct Options {
+  int threads;
+  string taxonomy_directory;
+};
+
+void ParseCommandLine(int argc, char **argv, Options &opts);
+void usage(int exit_code = EX_USAGE);
+
+int main(int argc, char **argv) {
+  Options opts;
+  opts.threads = 1;
+  ParseCommandLine(argc, argv, opts);
+  omp_set_num_threads(opts.threads);
+
+  NCBITaxonomy taxonomy(opts.taxonomy_directory + "/nodes.dmp",
+                        opts.taxonomy_directory + "/names.dmp");
+  auto snapshot_filename = opts.taxonomy_directory + "/"
+                           + NCBITaxonomy::SNAPSHOT_FILENAME;
+  auto temp_filename = snapshot_filename + ".tmp";
+  taxonomy.WriteSnapshot(temp_filename.c_str());
+  if (rename(temp_filename.c_str(), snapshot_filename.c_str()) < 0)
+    err(EX_CANTCREAT, "unable to create %s", snapshot_filename.c_str());
+  std::cerr << "Saved " << taxonomy.node_count() << " taxonomy nodes to "
+            << snapshot_filename << std::endl;
+  return 0;
+}
+
+void ParseCommandLine(int argc, char **argv, Options &opts) {
+  int opt;
+  long long sig;
+
+  while ((opt = getopt(argc, argv, "?hp:")) != -1) {
+    switch (opt) {
+      case 'h' : case '?' :
+        usage(0);
+        break;
+      case 'p' :
+        sig = atoll(optarg);
+        if (sig < 1)
+          errx(EX_USAGE, "must have at least 1 thread");
+        opts.threads = sig;
+        break;
+    }
+  }
+  if (argc - optind != 1)
+    usage();
+  opts.taxonomy_directory = argv[optind];
+}
+
+void usage(int exit_code) {
+  std::cerr << "Usage: build_taxonomy_snapshot [-p threads] <taxonomy directory>" << std::endl
+            << std::endl
+            << "Saves the NCBI taxonomy in the directory's nodes.dmp and names.dmp" << std::endl
+            << "files as a binary snapshot, " << NCBITaxonomy::SNAPSHOT_FILENAME
+            << ", which build_db loads in" << std::endl
+            << "their place while it is at least as new as they are." << std::endl
+            << std::endl
+            << "Options:" << std::endl
+            << "  -p INT        Number of threads" << std::endl;
+  exit(exit_code);
+}
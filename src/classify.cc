@@ -15,6 +15,7 @@
 #include "reports.h"
 #include "utilities.h"
 #include "readcounts.h"
+#include "compression.h"
 using namespace kraken2;
 
 using std::cout;
@@ -56,6 +57,10 @@ struct Options {
   int minimum_hit_groups;
   bool use_memory_mapping;
   bool match_input_order;
+  vector<uint64_t> bin_taxids;
+  string bin_output_format;
+  bool bin_clades;
+  size_t max_open_bin_files;
 };
 
 struct ClassificationStats {
@@ -74,21 +79,63 @@ struct OutputStreamData {
   std::ostream *kraken_output;
 };
 
+// One unit of input, either a single file (or stdin) or a pair of mate files.
+// Several of these may be open at once, each read under its own lock, so
+// threads can move on to the next file while others finish the current one.
+struct InputFileData {
+  const char *filename1;
+  const char *filename2;
+  std::istream *fptr1;
+  std::istream *fptr2;
+  PairedSequenceReader *pair_reader;  // only used with 2-file pairs
+  SequenceFormat format1;
+  SequenceFormat format2;
+  omp_lock_t lock;
+  uint64_t next_block_id;
+  bool exhausted;        // protected by lock
+  uint64_t block_count;  // only valid once finished is set
+  bool finished;         // protected by output_queue critical section
+};
+
 struct OutputData {
+  uint64_t file_id;
   uint64_t block_id;
   string kraken_str;
   string classified_out1_str;
   string classified_out2_str;
   string unclassified_out1_str;
   string unclassified_out2_str;
+  vector<string> bin_strs;  // indexed by bin file
+};
+
+static const uint32_t NO_BIN = UINT32_MAX;
+
+// Per-taxon read binning: classified reads are also written to the file of
+// each bin whose taxon (or, with clade binning, whose clade) they fall into.
+// Files are opened by the writer as needed, with at most max_open_files
+// open at any time.
+struct TaxonBinData {
+  vector<uint64_t> external_ids;  // taxon of each bin
+  vector<uint32_t> nearest_bin;   // per internal taxid, innermost bin
+  vector<uint32_t> parent_bin;    // per bin, next enclosing bin
+  size_t mate_count;              // files per bin
+  vector<string> filenames;       // per bin file (bin * mate_count + mate)
+  vector<std::ofstream *> streams;
+  vector<bool> created;
+  std::list<size_t> open_files;   // most recently used first
+  size_t max_open_files;
+  CompressionType compression;
 };
 
 void ParseCommandLine(int argc, char **argv, Options &opts);
 void usage(int exit_code=EX_USAGE);
-void ProcessFiles(const char *filename1, const char *filename2,
+void OpenInputFile(InputFileData &input, Options &opts);
+void CloseInputFile(InputFileData &input);
+void ProcessFiles(vector<InputFileData> &inputs,
     KeyValueStore *hash, Taxonomy &tax,
     IndexOptions &idx_opts, Options &opts, ClassificationStats &stats,
-    OutputStreamData &outputs, taxon_counters_t &total_taxon_counters);
+    OutputStreamData &outputs, TaxonBinData &bins,
+    taxon_counters_t &total_taxon_counters);
 taxid_t ClassifySequence(Sequence &dna, Sequence &dna2, ostringstream &koss,
     KeyValueStore *hash, Taxonomy &tax, IndexOptions &idx_opts,
     Options &opts, ClassificationStats &stats, MinimizerScanner &scanner,
@@ -102,6 +149,11 @@ void ReportStats(struct timeval time1, struct timeval time2,
     ClassificationStats &stats);
 void InitializeOutputs(Options &opts, OutputStreamData &outputs, SequenceFormat format);
 void MaskLowQualityBases(Sequence &dna, int minimum_quality_score);
+void AppendSequenceRecord(string &out, Sequence &seq,
+    const char *header_suffix);
+void InitializeTaxonBins(Options &opts, Taxonomy &tax, TaxonBinData &bins);
+void WriteBinData(TaxonBinData &bins, size_t file_idx, const string &data);
+void CloseTaxonBins(TaxonBinData &bins);
 
 int main(int argc, char **argv) {
   Options opts;
@@ -118,6 +170,8 @@ int main(int argc, char **argv) {
   opts.minimum_quality_score = 0;
   opts.minimum_hit_groups = 0;
   opts.use_memory_mapping = false;
+  opts.bin_clades = false;
+  opts.max_open_bin_files = 128;
 
   taxon_counters_t taxon_counters; // stats per taxon
   ParseCommandLine(argc, argv, opts);
@@ -143,28 +197,35 @@ int main(int argc, char **argv) {
   ClassificationStats stats = {0, 0, 0};
 
   OutputStreamData outputs = { false, false, nullptr, nullptr, nullptr, nullptr, &std::cout };
+  TaxonBinData bins;
+  InitializeTaxonBins(opts, taxonomy, bins);
 
   struct timeval tv1, tv2;
   gettimeofday(&tv1, nullptr);
+  vector<InputFileData> inputs;
   if (optind == argc) {
     if (opts.paired_end_processing && ! opts.single_file_pairs)
       errx(EX_USAGE, "paired end processing used with no files specified");
-    ProcessFiles(nullptr, nullptr, hash_ptr, taxonomy, idx_opts, opts, stats, outputs, taxon_counters);
+    inputs.emplace_back();
+    inputs.back().filename1 = nullptr;
+    inputs.back().filename2 = nullptr;
   }
   else {
     for (int i = optind; i < argc; i++) {
+      inputs.emplace_back();
+      inputs.back().filename1 = argv[i];
+      inputs.back().filename2 = nullptr;
       if (opts.paired_end_processing && ! opts.single_file_pairs) {
         if (i + 1 == argc) {
           errx(EX_USAGE, "paired end processing used with unpaired file");
         }
-        ProcessFiles(argv[i], argv[i+1], hash_ptr, taxonomy, idx_opts, opts, stats, outputs, taxon_counters);
+        inputs.back().filename2 = argv[i+1];
         i += 1;
       }
-      else {
-        ProcessFiles(argv[i], nullptr, hash_ptr, taxonomy, idx_opts, opts, stats, outputs, taxon_counters);
-      }
     }
   }
+  ProcessFiles(inputs, hash_ptr, taxonomy, idx_opts, opts, stats, outputs, bins, taxon_counters);
+  CloseTaxonBins(bins);
   gettimeofday(&tv2, nullptr);
 
   delete hash_ptr;
@@ -218,34 +279,139 @@ void ReportStats(struct timeval time1, struct timeval time2,
           total_unclassified * 100.0 / stats.total_sequences);
 }
 
-void ProcessFiles(const char *filename1, const char *filename2,
+void OpenInputFile(InputFileData &input, Options &opts) {
+  if (input.filename1 == nullptr)
+    input.fptr1 = &std::cin;
+  else
+    input.fptr1 = new std::ifstream(input.filename1);
+  if (opts.paired_end_processing && ! opts.single_file_pairs) {
+    input.fptr2 = new std::ifstream(input.filename2);
+    input.pair_reader = new PairedSequenceReader(*input.fptr1, *input.fptr2);
+  }
+}
+
+void CloseInputFile(InputFileData &input) {
+  if (input.pair_reader != nullptr)
+    delete input.pair_reader;
+  input.pair_reader = nullptr;
+  if (input.fptr1 != nullptr && input.fptr1 != &std::cin)
+    delete input.fptr1;
+  if (input.fptr2 != nullptr)
+    delete input.fptr2;
+  input.fptr1 = input.fptr2 = nullptr;
+}
+
+void ProcessFiles(vector<InputFileData> &inputs,
     KeyValueStore *hash, Taxonomy &tax,
     IndexOptions &idx_opts, Options &opts, ClassificationStats &stats,
-    OutputStreamData &outputs,
+    OutputStreamData &outputs, TaxonBinData &bins,
     taxon_counters_t &total_taxon_counters)
 {
-  std::istream *fptr1 = nullptr, *fptr2 = nullptr;
-
-  if (filename1 == nullptr)
-    fptr1 = &std::cin;
-  else {
-    fptr1 = new std::ifstream(filename1);
-  }
-  if (opts.paired_end_processing && ! opts.single_file_pairs) {
-    fptr2 = new std::ifstream(filename2);
+  for (auto &input : inputs) {
+    input.fptr1 = input.fptr2 = nullptr;
+    input.pair_reader = nullptr;
+    input.format1 = input.format2 = FORMAT_AUTO_DETECT;
+    input.next_block_id = 0;
+    input.block_count = 0;
+    input.exhausted = false;
+    input.finished = false;
+    omp_init_lock(&input.lock);
   }
+  // Sequence output is compressed by the workers, block by block
+  auto classified_compression =
+    CompressionTypeForFilename(opts.classified_output_filename);
+  auto unclassified_compression =
+    CompressionTypeForFilename(opts.unclassified_output_filename);
+
+  // Inputs are opened in order as threads need them, and up to this many
+  // can be open (and read from by different threads) at once
+  size_t max_open_inputs = opts.num_threads;
+  size_t next_unopened_input = 0;
+  std::deque<size_t> open_inputs;
+  // Blocks waiting on an earlier, slower input are held for output; once
+  // this many are held, threads only read the input being output
+  size_t max_queued_blocks = 4 * (size_t) opts.num_threads;
 
   // The priority queue for output is designed to ensure fragment data
-  // is output in the same order it was input
+  // is output in the same order it was input (by input file, then by block)
   auto comparator = [](const OutputData &a, const OutputData &b) {
+    if (a.file_id != b.file_id)
+      return a.file_id > b.file_id;
     return a.block_id > b.block_id;
   };
   std::priority_queue<OutputData, vector<OutputData>, decltype(comparator)>
     output_queue(comparator);
-  uint64_t next_input_block_id = 0;
+  uint64_t next_output_file_id = 0;
   uint64_t next_output_block_id = 0;
   omp_lock_t output_lock;
   omp_init_lock(&output_lock);
+  // Counts changes to the output position (blocks written, inputs
+  // finished), so threads held back by the backlog can sleep until one
+  std::mutex output_progress_mutex;
+  std::condition_variable output_progress_cond;
+  uint64_t output_progress_ct = 0;
+
+  // Write out all queued blocks that are next in line; called whenever a
+  // block is queued or an input file's final block count becomes known
+  auto drain_output_queue = [&]() {
+    OutputData out_data;
+    bool output_loop = true;
+    bool progressed = false;
+    while (output_loop) {
+      #pragma omp critical(output_queue)
+      {
+        // Move on to the next input once all of this one's blocks are out
+        while (next_output_file_id < inputs.size()
+               && inputs[next_output_file_id].finished
+               && inputs[next_output_file_id].block_count == next_output_block_id)
+        {
+          next_output_file_id++;
+          next_output_block_id = 0;
+          progressed = true;
+        }
+        output_loop = ! output_queue.empty();
+        if (output_loop) {
+          out_data = output_queue.top();
+          if (out_data.file_id == next_output_file_id &&
+              out_data.block_id == next_output_block_id)
+          {
+            output_queue.pop();
+            // Acquiring output lock obligates thread to print out
+            // next output data block, contained in out_data
+            omp_set_lock(&output_lock);
+            next_output_block_id++;
+            progressed = true;
+          }
+          else
+            output_loop = false;
+        }
+      }
+      if (! output_loop)
+        break;
+      if (outputs.kraken_output != nullptr)
+        (*outputs.kraken_output) << out_data.kraken_str;
+      if (outputs.classified_output1 != nullptr)
+        (*outputs.classified_output1) << out_data.classified_out1_str;
+      if (outputs.classified_output2 != nullptr)
+        (*outputs.classified_output2) << out_data.classified_out2_str;
+      if (outputs.unclassified_output1 != nullptr)
+        (*outputs.unclassified_output1) << out_data.unclassified_out1_str;
+      if (outputs.unclassified_output2 != nullptr)
+        (*outputs.unclassified_output2) << out_data.unclassified_out2_str;
+      for (size_t i = 0; i < out_data.bin_strs.size(); i++) {
+        if (! out_data.bin_strs[i].empty())
+          WriteBinData(bins, i, out_data.bin_strs[i]);
+      }
+      omp_unset_lock(&output_lock);
+    }  // end while output loop
+    if (progressed) {
+      {
+        std::lock_guard<std::mutex> guard(output_progress_mutex);
+        output_progress_ct++;
+      }
+      output_progress_cond.notify_all();
+    }
+  };
 
   #pragma omp parallel
   {
@@ -254,14 +420,19 @@ void ProcessFiles(const char *filename1, const char *filename2,
                              idx_opts.revcom_version);
     vector<taxid_t> taxa;
     taxon_counts_t hit_counts;
-    ostringstream kraken_oss, c1_oss, c2_oss, u1_oss, u2_oss;
+    ostringstream kraken_oss;
+    string c1_str, c2_str, u1_str, u2_str;
+    vector<string> bin_strs;
     ClassificationStats thread_stats = {0, 0, 0};
     vector<string> translated_frames(6);
     BatchSequenceReader reader1, reader2;
     Sequence seq1, seq2;
-    uint64_t block_id;
+    uint64_t file_id, block_id;
     OutputData out_data;
     taxon_counters_t thread_taxon_counters;
+    BlockCompressor classified_compressor(classified_compression);
+    BlockCompressor unclassified_compressor(unclassified_compression);
+    BlockCompressor bin_compressor(bins.compression);
 
     while (true) {
       thread_stats.total_sequences = 0;
@@ -270,26 +441,126 @@ void ProcessFiles(const char *filename1, const char *filename2,
 
       auto ok_read = false;
 
-      #pragma omp critical(seqread)
-      {  // Input processing block
+      while (! ok_read) {  // Input processing loop
+        // Find an open input no other thread is reading from, opening the
+        // next queued input if all are busy; only wait on a busy input when
+        // no more can be opened
+        InputFileData *input = nullptr;
+        bool must_wait = false;
+        bool backlogged = false;
+        size_t output_input = 0;
+        // Read before checking the backlog, so no progress is missed
+        uint64_t progress_seen;
+        {
+          std::lock_guard<std::mutex> guard(output_progress_mutex);
+          progress_seen = output_progress_ct;
+        }
+        #pragma omp critical(output_queue)
+        {
+          if (output_queue.size() >= max_queued_blocks) {
+            backlogged = true;
+            output_input = next_output_file_id;
+          }
+        }
+        if (backlogged) {
+          #pragma omp critical(input_queue)
+          {
+            if (std::find(open_inputs.begin(), open_inputs.end(), output_input)
+                != open_inputs.end())
+            {
+              input = &inputs[output_input];
+              must_wait = true;
+            }
+            else if (output_input == next_unopened_input) {
+              input = &inputs[next_unopened_input];
+              open_inputs.push_back(next_unopened_input++);
+              omp_set_lock(&input->lock);
+            }
+          }
+          if (input == nullptr) {
+            // Its remaining blocks are being classified; wait for them
+            std::unique_lock<std::mutex> guard(output_progress_mutex);
+            output_progress_cond.wait(guard, [&]() {
+              return output_progress_ct != progress_seen;
+            });
+            continue;
+          }
+        }
+        else {
+          #pragma omp critical(input_queue)
+          {
+            for (auto idx : open_inputs) {
+              if (omp_test_lock(&inputs[idx].lock)) {
+                input = &inputs[idx];
+                break;
+              }
+            }
+            if (input == nullptr && next_unopened_input < inputs.size()
+                && open_inputs.size() < max_open_inputs)
+            {
+              input = &inputs[next_unopened_input];
+              open_inputs.push_back(next_unopened_input++);
+              omp_set_lock(&input->lock);
+            }
+            if (input == nullptr && ! open_inputs.empty()) {
+              input = &inputs[open_inputs.front()];
+              must_wait = true;
+            }
+          }
+        }
+        if (input == nullptr)
+          break;  // all inputs exhausted
+        if (must_wait)
+          omp_set_lock(&input->lock);
+        if (input->exhausted) {
+          omp_unset_lock(&input->lock);
+          continue;
+        }
+        if (input->fptr1 == nullptr)
+          OpenInputFile(*input, opts);
+
+        reader1.set_file_format(input->format1);
+        reader2.set_file_format(input->format2);
         if (! opts.paired_end_processing) {
           // Unpaired data?  Just read in a sized block
-          ok_read = reader1.LoadBlock(*fptr1, (size_t)(3 * 1024 * 1024));
+          ok_read = reader1.LoadBlock(*input->fptr1, (size_t)(3 * 1024 * 1024));
         }
         else if (! opts.single_file_pairs) {
-          // Paired data in 2 files?  Read a line-counted batch from each file.
-          ok_read = reader1.LoadBatch(*fptr1, NUM_FRAGMENTS_PER_THREAD);
-          if (ok_read && opts.paired_end_processing)
-            ok_read = reader2.LoadBatch(*fptr2, NUM_FRAGMENTS_PER_THREAD);
+          // Paired data in 2 files?  Read a matched batch from both files.
+          ok_read = input->pair_reader->LoadBatch(reader1, reader2,
+                                                  NUM_FRAGMENTS_PER_THREAD);
         }
         else {
           auto frags = NUM_FRAGMENTS_PER_THREAD * 2;
           // Ensure frag count is even - just in case above line is changed
           if (frags % 2 == 1)
             frags++;
-          ok_read = reader1.LoadBatch(*fptr1, frags);
+          ok_read = reader1.LoadBatch(*input->fptr1, frags);
         }
-        block_id = next_input_block_id++;
+        input->format1 = reader1.file_format();
+        input->format2 = reader2.file_format();
+
+        file_id = input - inputs.data();
+        if (ok_read) {
+          block_id = input->next_block_id++;
+        }
+        else {
+          input->exhausted = true;
+          CloseInputFile(*input);
+          #pragma omp critical(input_queue)
+          {
+            open_inputs.erase(std::find(open_inputs.begin(),
+                                        open_inputs.end(), file_id));
+          }
+          #pragma omp critical(output_queue)
+          {
+            input->block_count = input->next_block_id;
+            input->finished = true;
+          }
+        }
+        omp_unset_lock(&input->lock);
+        if (! ok_read)
+          drain_output_queue();
       }
 
       if (! ok_read)
@@ -297,10 +568,11 @@ void ProcessFiles(const char *filename1, const char *filename2,
 
       // Reset all dynamically-growing things
       kraken_oss.str("");
-      c1_oss.str("");
-      c2_oss.str("");
-      u1_oss.str("");
-      u2_oss.str("");
+      c1_str.clear();
+      c2_str.clear();
+      u1_str.clear();
+      u2_str.clear();
+      bin_strs.assign(bins.filenames.size(), "");
       thread_taxon_counters.clear();
 
       while (true) {
@@ -323,20 +595,29 @@ void ProcessFiles(const char *filename1, const char *filename2,
             kraken_oss, hash, tax, idx_opts, opts, thread_stats, scanner,
             taxa, hit_counts, translated_frames, thread_taxon_counters);
         if (call) {
-          char buffer[1024] = "";
-          sprintf(buffer, " kraken:taxid|%llu",
+          char buffer[64];
+          snprintf(buffer, sizeof(buffer), " kraken:taxid|%llu",
               (unsigned long long) tax.nodes()[call].external_id);
-          seq1.header += buffer;
-          c1_oss << seq1.to_string();
-          if (opts.paired_end_processing) {
-            seq2.header += buffer;
-            c2_oss << seq2.to_string();
+          if (! opts.classified_output_filename.empty()) {
+            AppendSequenceRecord(c1_str, seq1, buffer);
+            if (opts.paired_end_processing)
+              AppendSequenceRecord(c2_str, seq2, buffer);
+          }
+          if (! bins.nearest_bin.empty()) {
+            for (auto bin = bins.nearest_bin[call]; bin != NO_BIN;
+                 bin = bins.parent_bin[bin])
+            {
+              auto file_idx = bin * bins.mate_count;
+              AppendSequenceRecord(bin_strs[file_idx], seq1, buffer);
+              if (opts.paired_end_processing)
+                AppendSequenceRecord(bin_strs[file_idx + 1], seq2, buffer);
+            }
           }
         }
-        else {
-          u1_oss << seq1.to_string();
+        else if (! opts.unclassified_output_filename.empty()) {
+          AppendSequenceRecord(u1_str, seq1, nullptr);
           if (opts.paired_end_processing)
-            u2_oss << seq2.to_string();
+            AppendSequenceRecord(u2_str, seq2, nullptr);
         }
         thread_stats.total_bases += seq1.seq.size();
         if (opts.paired_end_processing)
@@ -361,16 +642,42 @@ void ProcessFiles(const char *filename1, const char *filename2,
         InitializeOutputs(opts, outputs, reader1.file_format());
       }
 
+      out_data.file_id = file_id;
       out_data.block_id = block_id;
       out_data.kraken_str.assign(kraken_oss.str());
-      out_data.classified_out1_str.assign(c1_oss.str());
-      out_data.classified_out2_str.assign(c2_oss.str());
-      out_data.unclassified_out1_str.assign(u1_oss.str());
-      out_data.unclassified_out2_str.assign(u2_oss.str());
+      if (classified_compression == COMPRESSION_NONE) {
+        out_data.classified_out1_str.swap(c1_str);
+        out_data.classified_out2_str.swap(c2_str);
+      }
+      else {
+        out_data.classified_out1_str.clear();
+        out_data.classified_out2_str.clear();
+        classified_compressor.Compress(c1_str, out_data.classified_out1_str);
+        classified_compressor.Compress(c2_str, out_data.classified_out2_str);
+      }
+      if (unclassified_compression == COMPRESSION_NONE) {
+        out_data.unclassified_out1_str.swap(u1_str);
+        out_data.unclassified_out2_str.swap(u2_str);
+      }
+      else {
+        out_data.unclassified_out1_str.clear();
+        out_data.unclassified_out2_str.clear();
+        unclassified_compressor.Compress(u1_str, out_data.unclassified_out1_str);
+        unclassified_compressor.Compress(u2_str, out_data.unclassified_out2_str);
+      }
+
+      if (bins.compression == COMPRESSION_NONE) {
+        out_data.bin_strs.swap(bin_strs);
+      }
+      else {
+        out_data.bin_strs.assign(bin_strs.size(), "");
+        for (size_t i = 0; i < bin_strs.size(); i++)
+          bin_compressor.Compress(bin_strs[i], out_data.bin_strs[i]);
+      }
 
       #pragma omp critical(output_queue)
       {
-        output_queue.push(out_data);
+        output_queue.push(std::move(out_data));
       }
 
       #pragma omp critical(update_taxon_counters)
@@ -380,55 +687,24 @@ void ProcessFiles(const char *filename1, const char *filename2,
         }
       }
 
-      bool output_loop = true;
-      while (output_loop) {
-        #pragma omp critical(output_queue)
-        {
-          output_loop = ! output_queue.empty();
-          if (output_loop) {
-            out_data = output_queue.top();
-            if (out_data.block_id == next_output_block_id) {
-              output_queue.pop();
-              // Acquiring output lock obligates thread to print out
-              // next output data block, contained in out_data
-              omp_set_lock(&output_lock);
-              next_output_block_id++;
-            }
-            else
-              output_loop = false;
-          }
-        }
-        if (! output_loop)
-          break;
-        if (outputs.kraken_output != nullptr)
-          (*outputs.kraken_output) << out_data.kraken_str;
-        if (outputs.classified_output1 != nullptr)
-          (*outputs.classified_output1) << out_data.classified_out1_str;
-        if (outputs.classified_output2 != nullptr)
-          (*outputs.classified_output2) << out_data.classified_out2_str;
-        if (outputs.unclassified_output1 != nullptr)
-          (*outputs.unclassified_output1) << out_data.unclassified_out1_str;
-        if (outputs.unclassified_output2 != nullptr)
-          (*outputs.unclassified_output2) << out_data.unclassified_out2_str;
-        omp_unset_lock(&output_lock);
-      }  // end while output loop
+      drain_output_queue();
     }  // end while
   }  // end parallel block
   omp_destroy_lock(&output_lock);
-  if (fptr1 != nullptr)
-    delete fptr1;
-  if (fptr2 != nullptr)
-    delete fptr2;
+  for (auto &input : inputs)
+    omp_destroy_lock(&input.lock);
   if (outputs.kraken_output != nullptr)
     (*outputs.kraken_output) << std::flush;
+  auto classified_end = CompressionEndMarker(classified_compression);
+  auto unclassified_end = CompressionEndMarker(unclassified_compression);
   if (outputs.classified_output1 != nullptr)
-    (*outputs.classified_output1) << std::flush;
+    (*outputs.classified_output1) << classified_end << std::flush;
   if (outputs.classified_output2 != nullptr)
-    (*outputs.classified_output2) << std::flush;
+    (*outputs.classified_output2) << classified_end << std::flush;
   if (outputs.unclassified_output1 != nullptr)
-    (*outputs.unclassified_output1) << std::flush;
+    (*outputs.unclassified_output1) << unclassified_end << std::flush;
   if (outputs.unclassified_output2 != nullptr)
-    (*outputs.unclassified_output2) << std::flush;
+    (*outputs.unclassified_output2) << unclassified_end << std::flush;
 }
 
 taxid_t ResolveTree(taxon_counts_t &hit_counts,
@@ -730,15 +1006,142 @@ void MaskLowQualityBases(Sequence &dna, int minimum_quality_score) {
     errx(EX_DATAERR, "%s: Sequence length (%d) != Quality string length (%d)",
                      dna.id.c_str(), (int) dna.seq.size(), (int) dna.quals.size());
   for (size_t i = 0; i < dna.seq.size(); i++) {
-    if ((dna.quals[i] - '!') < minimum_quality_score)
+    if ((dna.quals[i] - '!') < minimum_quality_score) {
       dna.seq[i] = 'x';
+      dna.raw_data = nullptr;  // original text no longer matches sequence
+    }
+  }
+}
+
+// Appends a sequence's record to an output buffer, with an optional suffix
+// added to its header.  Unmodified records are copied straight from the
+// reader's input block rather than rebuilt from their parsed fields.
+void AppendSequenceRecord(string &out, Sequence &seq,
+    const char *header_suffix)
+{
+  if (seq.raw_data == nullptr) {
+    auto header_size = seq.header.size();
+    if (header_suffix != nullptr)
+      seq.header += header_suffix;
+    out += seq.to_string();
+    seq.header.resize(header_size);
+    return;
   }
+  out.append(seq.raw_data, seq.raw_header_size);
+  if (header_suffix != nullptr)
+    out += header_suffix;
+  out.append(seq.raw_data + seq.raw_header_size,
+             seq.raw_size - seq.raw_header_size);
+  if (out.back() != '\n')  // last record of file may lack newline
+    out.push_back('\n');
+}
+
+void InitializeTaxonBins(Options &opts, Taxonomy &tax, TaxonBinData &bins) {
+  bins.mate_count = opts.paired_end_processing ? 2 : 1;
+  bins.max_open_files = opts.max_open_bin_files;
+  bins.compression = CompressionTypeForFilename(opts.bin_output_format);
+  if (opts.bin_taxids.empty())
+    return;
+
+  vector<string> format_fields = SplitString(opts.bin_output_format, "%", 3);
+  if (format_fields.size() != 2)
+    errx(EX_DATAERR, "Bin filename format must have exactly one %% character: %s",
+         opts.bin_output_format.c_str());
+
+  tax.GenerateExternalToInternalIDMap();
+  vector<uint32_t> bin_for_taxon(tax.node_count(), NO_BIN);
+  for (auto ext_taxid : opts.bin_taxids) {
+    auto taxid = tax.GetInternalID(ext_taxid);
+    if (taxid == 0) {
+      warnx("taxid %llu not in database taxonomy, not binning reads for it",
+            (unsigned long long) ext_taxid);
+      continue;
+    }
+    if (bin_for_taxon[taxid] != NO_BIN)
+      continue;
+    bin_for_taxon[taxid] = bins.external_ids.size();
+    bins.external_ids.push_back(ext_taxid);
+  }
+
+  // Parents have lower internal IDs than their children, so one pass in ID
+  // order finds each taxon's innermost enclosing bin
+  bins.nearest_bin.assign(tax.node_count(), NO_BIN);
+  bins.parent_bin.assign(bins.external_ids.size(), NO_BIN);
+  for (size_t i = 1; i < tax.node_count(); i++) {
+    auto parent_nearest = bins.nearest_bin[ tax.nodes()[i].parent_id ];
+    if (bin_for_taxon[i] != NO_BIN) {
+      bins.nearest_bin[i] = bin_for_taxon[i];
+      if (opts.bin_clades)
+        bins.parent_bin[ bin_for_taxon[i] ] = parent_nearest;
+    }
+    else if (opts.bin_clades) {
+      bins.nearest_bin[i] = parent_nearest;
+    }
+  }
+
+  for (auto ext_taxid : bins.external_ids) {
+    string filename = format_fields[0] + std::to_string(ext_taxid)
+                      + format_fields[1];
+    if (opts.paired_end_processing) {
+      vector<string> fields = SplitString(filename, "#", 3);
+      if (fields.size() != 2)
+        errx(EX_DATAERR, "Paired bin filename format must have exactly one # character: %s",
+             opts.bin_output_format.c_str());
+      bins.filenames.push_back(fields[0] + "_1" + fields[1]);
+      bins.filenames.push_back(fields[0] + "_2" + fields[1]);
+    }
+    else {
+      bins.filenames.push_back(filename);
+    }
+  }
+  bins.streams.assign(bins.filenames.size(), nullptr);
+  bins.created.assign(bins.filenames.size(), false);
+}
+
+// Append data to a bin's file, opening it (and closing the least recently
+// used file if needed) if it isn't already open.  Only called by the thread
+// holding the output lock.
+void WriteBinData(TaxonBinData &bins, size_t file_idx, const string &data) {
+  if (bins.streams[file_idx] == nullptr) {
+    if (bins.open_files.size() >= bins.max_open_files) {
+      auto lru_idx = bins.open_files.back();
+      bins.open_files.pop_back();
+      delete bins.streams[lru_idx];
+      bins.streams[lru_idx] = nullptr;
+    }
+    auto mode = bins.created[file_idx] ? ofstream::app : ofstream::trunc;
+    bins.streams[file_idx] = new ofstream(bins.filenames[file_idx],
+                                          ofstream::out | mode);
+    if (! *bins.streams[file_idx])
+      err(EX_CANTCREAT, "unable to open %s", bins.filenames[file_idx].c_str());
+    bins.created[file_idx] = true;
+  }
+  else {
+    bins.open_files.remove(file_idx);
+  }
+  bins.open_files.push_front(file_idx);
+  (*bins.streams[file_idx]) << data;
+}
+
+void CloseTaxonBins(TaxonBinData &bins) {
+  auto end_marker = CompressionEndMarker(bins.compression);
+  for (size_t i = 0; i < bins.filenames.size(); i++) {
+    if (! bins.created[i])
+      continue;
+    if (! end_marker.empty())
+      WriteBinData(bins, i, end_marker);
+    if (bins.streams[i] != nullptr) {
+      delete bins.streams[i];
+      bins.streams[i] = nullptr;
+    }
+  }
+  bins.open_files.clear();
 }
 
 void ParseCommandLine(int argc, char **argv, Options &opts) {
   int opt;
 
-  while ((opt = getopt(argc, argv, "h?H:t:o:T:p:R:C:U:O:Q:g:nmzqPSMK")) != -1) {
+  while ((opt = getopt(argc, argv, "h?H:t:o:T:p:R:C:U:O:Q:g:b:B:N:dnmzqPSMK")) != -1) {
     switch (opt) {
       case 'h' : case '?' :
         usage(0);
@@ -806,6 +1209,29 @@ void ParseCommandLine(int argc, char **argv, Options &opts) {
       case 'M' :
         opts.use_memory_mapping = true;
         break;
+      case 'b' :
+        for (auto &taxid_str : SplitString(optarg, ",")) {
+          char *end;
+          errno = 0;
+          auto taxid = strtoull(taxid_str.c_str(), &end, 10);
+          if (taxid_str.empty() || ! isdigit((unsigned char) taxid_str[0]) || *end != '\0'
+              || errno == ERANGE)
+            errx(EX_USAGE, "invalid taxonomy ID \"%s\" given to -b",
+                 taxid_str.c_str());
+          opts.bin_taxids.push_back(taxid);
+        }
+        break;
+      case 'B' :
+        opts.bin_output_format = optarg;
+        break;
+      case 'd' :
+        opts.bin_clades = true;
+        break;
+      case 'N' :
+        if (atoi(optarg) < 1)
+          errx(EX_USAGE, "must allow at least 1 open bin file");
+        opts.max_open_bin_files = atoi(optarg);
+        break;
     }
   }
 
@@ -821,6 +1247,11 @@ void ParseCommandLine(int argc, char **argv, Options &opts) {
     warnx("-m requires -R be used");
     usage();
   }
+
+  if (opts.bin_taxids.empty() != opts.bin_output_format.empty()) {
+    warnx("-b and -B must be used together");
+    usage();
+  }
 }
 
 void usage(int exit_code) {
@@ -843,8 +1274,15 @@ void usage(int exit_code) {
        << "  -n               Print scientific name instead of taxid in Kraken output" << endl
        << "  -g NUM           Minimum number of hit groups needed for call" << endl
        << "  -C filename      Filename/format to have classified sequences" << endl
+       << "                   (compressed if ending in .gz or .zst)" << endl
        << "  -U filename      Filename/format to have unclassified sequences" << endl
+       << "                   (compressed if ending in .gz or .zst)" << endl
        << "  -O filename      Output file for normal Kraken output" << endl
-       << "  -K               In comb. w/ -R, provide minimizer information in report" << endl;
+       << "  -K               In comb. w/ -R, provide minimizer information in report" << endl
+       << "  -b LIST          Comma-separated taxids to bin classified reads for" << endl
+       << "  -B filename      In comb. w/ -b, filename format for bins (% replaced" << endl
+       << "                   by taxid)" << endl
+       << "  -d               In comb. w/ -b, bin reads classified below bin taxa too" << endl
+       << "  -N NUM           In comb. w/ -b, max. number of open bin files (def. 128)" << endl;
   exit(exit_code);
 }
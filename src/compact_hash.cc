@@ -93,6 +93,10 @@ void CompactHashTable::LoadTable(const char *filename, bool memory_mapping) {
     if (! ifs)
       errx(EX_OSERR, "Error reading in hash table");
     file_backed_ = false;
+    // A table in memory can be updated, e.g. to resume a build
+    for (size_t i = 0; i < LOCK_ZONES; i++)
+      omp_init_lock(&zone_locks_[i]);
+    locks_initialized_ = true;
   }
 }
 
@@ -104,6 +108,8 @@ void CompactHashTable::WriteTable(const char *filename) {
   ofs.write((char *) &value_bits_, sizeof(value_bits_));
   ofs.write((char *) table_, sizeof(*table_) * capacity_);
   ofs.close();
+  if (! ofs)
+    errx(EX_IOERR, "error writing %s", filename);
 }
 
 hvalue_t CompactHashTable::Get(hkey_t key) const {
@@ -221,7 +227,7 @@ bool CompactHashTable::DirectCompareAndSet
 // Linear probing leads to more clustering, longer probing paths, and
 //   higher probability of a false answer
 // Double hashing can have shorter probing paths, but less cache efficiency
-inline uint64_t CompactHashTable::second_hash(uint64_t first_hash) const {
+inline uint64_t CompactHashTable::second_hash(uint64_t first_hash) {
 #ifdef LINEAR_PROBING
   return 1;
 #else  // Double hashing
@@ -246,4 +252,197 @@ taxon_counts_t CompactHashTable::GetValueCounts() const {
   return value_counts;
 }
 
+PartitionedTableWriter::PartitionedTableWriter(size_t capacity,
+    size_t key_bits, size_t value_bits, size_t partition_cells,
+    const string &temp_prefix)
+    : capacity_(capacity), size_(0), key_bits_(key_bits),
+      value_bits_(value_bits), partition_cells_(partition_cells),
+      temp_prefix_(temp_prefix), round_(0)
+{
+  if (key_bits + value_bits != sizeof(CompactHashCell) * 8)
+    errx(EX_SOFTWARE, "sum of key bits and value bits must equal %u",
+        (unsigned int) (sizeof(CompactHashCell) * 8));
+  if (partition_cells_ == 0 || partition_cells_ > capacity_)
+    partition_cells_ = capacity_;
+  partition_ct_ = (capacity_ + partition_cells_ - 1) / partition_cells_;
+  OpenSpillFiles();
+}
+
+PartitionedTableWriter::~PartitionedTableWriter() {
+  CloseSpillFiles();
+  for (size_t i = 0; i < partition_ct_; i++)
+    unlink(SpillFilename(round_, i).c_str());
+}
+
+string PartitionedTableWriter::SpillFilename(size_t round, size_t partition)
+    const
+{
+  return temp_prefix_ + "." + std::to_string(round) + "." + std::to_string(partition);
+}
+
+void PartitionedTableWriter::OpenSpillFiles() {
+  spill_files_.assign(partition_ct_, nullptr);
+  spill_counts_.assign(partition_ct_, 0);
+}
+
+void PartitionedTableWriter::CloseSpillFiles() {
+  for (auto &file : spill_files_) {
+    if (file == nullptr)
+      continue;
+    file->close();
+    if (! *file)
+      errx(EX_IOERR, "error writing table spill file");
+    delete file;
+    file = nullptr;
+  }
+}
+
+void PartitionedTableWriter::Spill(const PendingCell &pending) {
+  auto partition = pending.idx / partition_cells_;
+  auto &file = spill_files_[partition];
+  if (file == nullptr) {
+    auto filename = SpillFilename(round_, partition);
+    file = new ofstream(filename, ofstream::binary);
+    if (! *file)
+      err(EX_CANTCREAT, "unable to create %s", filename.c_str());
+  }
+  file->write((const char *) &pending, sizeof(pending));
+  spill_counts_[partition]++;
+}
+
+void PartitionedTableWriter::Add(hkey_t key, hvalue_t value) {
+  if (value == 0)
+    return;
+  // Zeroed so the struct's padding written to spill files is defined
+  PendingCell pending;
+  memset(&pending, 0, sizeof(pending));
+  pending.hc = MurmurHash3(key);
+  pending.idx = pending.hc % capacity_;
+  pending.value = value;
+  Spill(pending);
+}
+
+// Returns true if the pending pair was stored in (or merged into) the cell
+bool PartitionedTableWriter::Place(PendingCell &pending, CompactHashCell &cell,
+    merge_function_t &merge)
+{
+  hkey_t compacted_key = pending.hc >> (32 + value_bits_);
+  if (! cell.value(value_bits_)) {
+    cell.populate(compacted_key, pending.value, key_bits_, value_bits_);
+    size_++;
+    return true;
+  }
+  if (cell.hashed_key(value_bits_) == compacted_key) {
+    cell.populate(compacted_key, merge(cell.value(value_bits_), pending.value),
+                  key_bits_, value_bits_);
+    return true;
+  }
+  return false;
+}
+
+void PartitionedTableWriter::Advance(PendingCell &pending) {
+  pending.idx += CompactHashTable::second_hash(pending.hc);
+  pending.idx %= capacity_;
+  if (pending.idx == pending.hc % capacity_)
+    errx(EX_SOFTWARE, "compact hash table capacity exceeded");
+}
+
+void PartitionedTableWriter::Finish(const char *filename,
+    merge_function_t merge)
+{
+  const size_t header_size = 4 * sizeof(size_t);
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    err(EX_CANTCREAT, "unable to create %s", filename);
+  if (ftruncate(fd, header_size + capacity_ * sizeof(CompactHashCell)) < 0)
+    err(EX_IOERR, "unable to size %s", filename);
+
+  std::vector<CompactHashCell> cells;
+  std::vector<PendingCell> pending_list;
+  const size_t read_ct = 64 * 1024;
+  while (true) {
+    CloseSpillFiles();
+    auto counts = spill_counts_;
+    size_t pending_ct = 0;
+    for (auto count : counts)
+      pending_ct += count;
+    if (pending_ct == 0)
+      break;
+    round_++;
+    OpenSpillFiles();
+    // Once few pairs remain, probe the file directly rather than sweeping
+    // over whole partitions for them
+    bool direct = pending_ct < capacity_ / 1024;
+
+    for (size_t p = 0; p < partition_ct_; p++) {
+      if (counts[p] == 0)
+        continue;
+      size_t start = p * partition_cells_;
+      size_t cell_ct = std::min(partition_cells_, capacity_ - start);
+      off_t offset = header_size + start * sizeof(CompactHashCell);
+      if (! direct) {
+        cells.resize(cell_ct);
+        if (pread(fd, cells.data(), cell_ct * sizeof(CompactHashCell), offset)
+            != (ssize_t) (cell_ct * sizeof(CompactHashCell)))
+          err(EX_IOERR, "unable to read %s", filename);
+      }
+
+      auto spill_filename = SpillFilename(round_ - 1, p);
+      std::ifstream spill_file(spill_filename, std::ifstream::binary);
+      if (! spill_file)
+        err(EX_NOINPUT, "unable to read %s", spill_filename.c_str());
+      size_t remaining = counts[p];
+      while (remaining > 0) {
+        pending_list.resize(std::min(remaining, read_ct));
+        spill_file.read((char *) pending_list.data(),
+                        pending_list.size() * sizeof(PendingCell));
+        if (! spill_file)
+          errx(EX_IOERR, "error reading %s", spill_filename.c_str());
+        remaining -= pending_list.size();
+
+        for (auto &pending : pending_list) {
+          if (direct) {
+            while (true) {
+              CompactHashCell cell;
+              off_t cell_offset = header_size + pending.idx * sizeof(cell);
+              if (pread(fd, &cell, sizeof(cell), cell_offset) != sizeof(cell))
+                err(EX_IOERR, "unable to read %s", filename);
+              if (Place(pending, cell, merge)) {
+                if (pwrite(fd, &cell, sizeof(cell), cell_offset) != sizeof(cell))
+                  err(EX_IOERR, "unable to write %s", filename);
+                break;
+              }
+              Advance(pending);
+            }
+            continue;
+          }
+          while (true) {
+            if (pending.idx < start || pending.idx >= start + cell_ct) {
+              Spill(pending);
+              break;
+            }
+            if (Place(pending, cells[pending.idx - start], merge))
+              break;
+            Advance(pending);
+          }
+        }
+      }
+      spill_file.close();
+      unlink(spill_filename.c_str());
+
+      if (! direct) {
+        if (pwrite(fd, cells.data(), cell_ct * sizeof(CompactHashCell), offset)
+            != (ssize_t) (cell_ct * sizeof(CompactHashCell)))
+          err(EX_IOERR, "unable to write %s", filename);
+      }
+    }
+  }
+
+  size_t header[4] = { capacity_, size_, key_bits_, value_bits_ };
+  if (pwrite(fd, header, header_size, 0) != (ssize_t) header_size)
+    err(EX_IOERR, "unable to write %s", filename);
+  if (close(fd) < 0)
+    err(EX_IOERR, "unable to close %s", filename);
+}
+
 }  // end namespace
@@ -109,7 +109,58 @@ class CompactHashTable : public KeyValueStore {
   CompactHashTable& operator=(const CompactHashTable &rhs);
 
   void LoadTable(const char *filename, bool memory_mapping);
-  uint64_t second_hash(uint64_t first_hash) const;
+  static uint64_t second_hash(uint64_t first_hash);
+
+  friend class PartitionedTableWriter;
+};
+
+// Builds a CompactHashTable file on disk without holding the whole table
+// in memory.  Added pairs are spilled to temporary files by home partition;
+// Finish() then loads one partition of the table at a time, places the
+// pairs that probe into it, and spills those that probe onward into other
+// partitions for the next round.  Pairs are placed in the order they were
+// added, so the same input always gives the same file.
+class PartitionedTableWriter {
+  public:
+  // Called with (existing value, new value) when two keys share a cell
+  typedef std::function<hvalue_t(hvalue_t, hvalue_t)> merge_function_t;
+
+  PartitionedTableWriter(size_t capacity, size_t key_bits, size_t value_bits,
+      size_t partition_cells, const std::string &temp_prefix);
+  ~PartitionedTableWriter();
+
+  void Add(hkey_t key, hvalue_t value);
+  void Finish(const char *filename, merge_function_t merge);
+
+  size_t size() const { return size_; }
+
+  private:
+  struct PendingCell {
+    uint64_t hc;   // hash code of key
+    uint64_t idx;  // next cell to probe
+    hvalue_t value;
+  };
+
+  void OpenSpillFiles();
+  void CloseSpillFiles();
+  std::string SpillFilename(size_t round, size_t partition) const;
+  void Spill(const PendingCell &pending);
+  bool Place(PendingCell &pending, CompactHashCell &cell, merge_function_t &merge);
+  void Advance(PendingCell &pending);
+
+  size_t capacity_;
+  size_t size_;
+  size_t key_bits_;
+  size_t value_bits_;
+  size_t partition_cells_;
+  size_t partition_ct_;
+  std::string temp_prefix_;
+  size_t round_;
+  std::vector<std::ofstream *> spill_files_;
+  std::vector<size_t> spill_counts_;
+
+  PartitionedTableWriter(const PartitionedTableWriter &rhs);
+  PartitionedTableWriter& operator=(const PartitionedTableWriter &rhs);
 };
 
 }  // end namespace
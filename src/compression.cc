@@ -0,0 +1,220 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#include "compression.h"
+
+using std::string;
+
+namespace kraken2 {
+
+// gzip member header w/ BGZF "BC" extra subfield; block size goes at 16-17
+static const unsigned char BGZF_HEADER[] = {
+  0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00,
+  0x00, 0x00
+};
+static const size_t BGZF_FOOTER_SIZE = 8;  // CRC32 and input size
+
+static const unsigned char BGZF_EOF[] = {
+  0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00,
+  0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00
+};
+
+static bool HasSuffix(const string &str, const string &suffix) {
+  return str.size() >= suffix.size() &&
+         str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+CompressionType CompressionTypeForFilename(const string &filename) {
+  if (HasSuffix(filename, ".gz") || HasSuffix(filename, ".bgz"))
+    return COMPRESSION_BGZF;
+  if (HasSuffix(filename, ".zst")) {
+    #ifndef HAVE_ZSTD
+    errx(EX_USAGE, "%s: this build of Kraken 2 lacks zstd support",
+         filename.c_str());
+    #endif
+    return COMPRESSION_ZSTD;
+  }
+  return COMPRESSION_NONE;
+}
+
+string CompressionEndMarker(CompressionType type) {
+  if (type == COMPRESSION_BGZF)
+    return string((const char *) BGZF_EOF, sizeof(BGZF_EOF));
+  return "";
+}
+
+BlockCompressor::BlockCompressor(CompressionType type)
+    : type_(type), zs_initialized_(false)
+{
+  if (type_ == COMPRESSION_BGZF) {
+    memset(&zs_, 0, sizeof(zs_));
+    memset(&stored_zs_, 0, sizeof(stored_zs_));
+    // Negative window bits produce raw deflate data w/o zlib wrapper
+    if (deflateInit2(&zs_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK ||
+        deflateInit2(&stored_zs_, Z_NO_COMPRESSION, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      errx(EX_SOFTWARE, "unable to initialize deflate compressor");
+    zs_initialized_ = true;
+  }
+  #ifdef HAVE_ZSTD
+  zstd_ctx_ = nullptr;
+  if (type_ == COMPRESSION_ZSTD) {
+    zstd_ctx_ = ZSTD_createCCtx();
+    if (zstd_ctx_ == nullptr)
+      errx(EX_SOFTWARE, "unable to initialize zstd compressor");
+  }
+  #endif
+}
+
+BlockCompressor::~BlockCompressor() {
+  if (zs_initialized_) {
+    deflateEnd(&zs_);
+    deflateEnd(&stored_zs_);
+  }
+  #ifdef HAVE_ZSTD
+  if (zstd_ctx_ != nullptr)
+    ZSTD_freeCCtx(zstd_ctx_);
+  #endif
+}
+
+void BlockCompressor::Compress(const string &data, string &out) {
+  switch (type_) {
+    case COMPRESSION_NONE :
+      out.append(data);
+      break;
+    case COMPRESSION_BGZF :
+      for (size_t pos = 0; pos < data.size(); pos += BGZF_MAX_INPUT_SIZE) {
+        auto size = data.size() - pos;
+        if (size > BGZF_MAX_INPUT_SIZE)
+          size = BGZF_MAX_INPUT_SIZE;
+        CompressBGZFBlock(data.data() + pos, size, out);
+      }
+      break;
+    case COMPRESSION_ZSTD :
+      #ifdef HAVE_ZSTD
+      if (! data.empty()) {
+        auto old_size = out.size();
+        out.resize(old_size + ZSTD_compressBound(data.size()));
+        auto frame_size = ZSTD_compressCCtx(zstd_ctx_, &out[old_size],
+            out.size() - old_size, data.data(), data.size(),
+            ZSTD_CLEVEL_DEFAULT);
+        if (ZSTD_isError(frame_size))
+          errx(EX_SOFTWARE, "zstd compression error: %s",
+               ZSTD_getErrorName(frame_size));
+        out.resize(old_size + frame_size);
+      }
+      #endif
+      break;
+  }
+}
+
+// Writes one BGZF block: a complete gzip member holding at most 64 KB of
+// compressed data, whose total size is recorded in the header
+void BlockCompressor::CompressBGZFBlock(const char *data, size_t size,
+    string &out)
+{
+  auto block_start = out.size();
+  auto max_deflate_size = BGZF_MAX_BLOCK_SIZE - sizeof(BGZF_HEADER)
+                          - BGZF_FOOTER_SIZE;
+  out.append((const char *) BGZF_HEADER, sizeof(BGZF_HEADER));
+  out.resize(block_start + sizeof(BGZF_HEADER) + max_deflate_size);
+
+  z_stream *zs = &zs_;
+  while (true) {
+    deflateReset(zs);
+    zs->next_in = (Bytef *) data;
+    zs->avail_in = size;
+    zs->next_out = (Bytef *) &out[block_start + sizeof(BGZF_HEADER)];
+    zs->avail_out = max_deflate_size;
+    auto ret = deflate(zs, Z_FINISH);
+    if (ret == Z_STREAM_END)
+      break;
+    // Incompressible data, store it instead (which always fits)
+    if (ret == Z_OK && zs != &stored_zs_)
+      zs = &stored_zs_;
+    else
+      errx(EX_SOFTWARE, "deflate error while compressing output");
+  }
+  auto deflate_size = max_deflate_size - zs->avail_out;
+  out.resize(block_start + sizeof(BGZF_HEADER) + deflate_size);
+
+  uint32_t crc = crc32(0, (const Bytef *) data, size);
+  uint32_t isize = size;
+  unsigned char footer[BGZF_FOOTER_SIZE];
+  for (int i = 0; i < 4; i++) {
+    footer[i] = (crc >> (8 * i)) & 0xff;
+    footer[i + 4] = (isize >> (8 * i)) & 0xff;
+  }
+  out.append((const char *) footer, BGZF_FOOTER_SIZE);
+
+  auto block_size_m1 = out.size() - block_start - 1;
+  out[block_start + 16] = block_size_m1 & 0xff;
+  out[block_start + 17] = (block_size_m1 >> 8) & 0xff;
+}
+
+GzipFileBuffer::GzipFileBuffer() : file_(nullptr), buffer_offset_(0) { }
+
+GzipFileBuffer::~GzipFileBuffer() {
+  close();
+}
+
+bool GzipFileBuffer::open(const string &filename) {
+  close();
+  filename_ = filename;
+  if (filename == "-")
+    file_ = gzdopen(dup(STDIN_FILENO), "rb");
+  else
+    file_ = gzopen(filename.c_str(), "rb");
+  if (file_ == nullptr)
+    return false;
+  gzbuffer(file_, 128 * 1024);
+  buffer_.resize(BUFFER_SIZE);
+  buffer_offset_ = 0;
+  setg(buffer_.data(), buffer_.data(), buffer_.data());
+  return true;
+}
+
+bool GzipFileBuffer::seek(uint64_t offset) {
+  if (file_ == nullptr || gzseek(file_, offset, SEEK_SET) < 0)
+    return false;
+  buffer_offset_ = offset;
+  setg(buffer_.data(), buffer_.data(), buffer_.data());
+  return true;
+}
+
+void GzipFileBuffer::close() {
+  if (file_ != nullptr)
+    gzclose(file_);
+  file_ = nullptr;
+  std::vector<char>().swap(buffer_);
+  setg(nullptr, nullptr, nullptr);
+}
+
+GzipFileBuffer::int_type GzipFileBuffer::underflow() {
+  if (gptr() < egptr())
+    return traits_type::to_int_type(*gptr());
+  if (file_ == nullptr)
+    return traits_type::eof();
+  int read_ct = gzread(file_, buffer_.data(), buffer_.size());
+  if (read_ct < 0) {
+    int errnum;
+    const char *msg = gzerror(file_, &errnum);
+    errx(EX_IOERR, "error reading %s: %s", filename_.c_str(), msg);
+  }
+  buffer_offset_ += egptr() - eback();
+  if (read_ct == 0) {
+    setg(buffer_.data(), buffer_.data(), buffer_.data());
+    return traits_type::eof();
+  }
+  setg(buffer_.data(), buffer_.data(), buffer_.data() + read_ct);
+  return traits_type::to_int_type(*gptr());
+}
+
+}  // end namespace
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#ifndef KRAKEN2_COMPRESSION_H_
+#define KRAKEN2_COMPRESSION_H_
+
+#include "kraken2_headers.h"
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace kraken2 {
+
+enum CompressionType {
+  COMPRESSION_NONE,
+  COMPRESSION_BGZF,  // gzip-compatible, written as independent 64 KB blocks
+  COMPRESSION_ZSTD
+};
+
+// Picks compression from filename extension (.gz/.bgz or .zst)
+CompressionType CompressionTypeForFilename(const std::string &filename);
+
+// Data that must end a compressed file (BGZF's empty EOF block)
+std::string CompressionEndMarker(CompressionType type);
+
+/**
+ Compresses buffers into self-contained frames (BGZF blocks or zstd frames),
+ so that independently compressed buffers can simply be concatenated in
+ order to form a valid compressed file.  Each thread should use its own
+ compressor.
+ **/
+
+class BlockCompressor {
+  public:
+  BlockCompressor(CompressionType type);
+  ~BlockCompressor();
+  BlockCompressor(const BlockCompressor &rhs) = delete;
+  BlockCompressor& operator=(const BlockCompressor &rhs) = delete;
+
+  // Appends compressed form of data to out
+  void Compress(const std::string &data, std::string &out);
+
+  CompressionType type() const { return type_; }
+
+  private:
+  static const size_t BGZF_MAX_INPUT_SIZE = 0xff00;
+  static const size_t BGZF_MAX_BLOCK_SIZE = 0x10000;
+
+  void CompressBGZFBlock(const char *data, size_t size, std::string &out);
+
+  CompressionType type_;
+  z_stream zs_;
+  z_stream stored_zs_;  // fallback for input deflate can't shrink enough
+  bool zs_initialized_;
+  #ifdef HAVE_ZSTD
+  ZSTD_CCtx *zstd_ctx_;
+  #endif
+};
+
+// Stream buffer reading a file through zlib, which decompresses gzip data
+// and passes anything else through unchanged; "-" reads standard input.
+class GzipFileBuffer : public std::streambuf {
+  public:
+  GzipFileBuffer();
+  ~GzipFileBuffer();
+  GzipFileBuffer(const GzipFileBuffer &rhs) = delete;
+  GzipFileBuffer& operator=(const GzipFileBuffer &rhs) = delete;
+
+  bool open(const std::string &filename);
+  void close();
+  bool is_open() const { return file_ != nullptr; }
+  // Offsets are in uncompressed bytes; seeking on standard input is only
+  // possible forward, from the current position
+  uint64_t tell() const { return buffer_offset_ + (gptr() - eback()); }
+  bool seek(uint64_t offset);
+
+  protected:
+  int_type underflow();
+
+  private:
+  static const size_t BUFFER_SIZE = 1024 * 1024;
+
+  gzFile file_;
+  std::string filename_;
+  std::vector<char> buffer_;
+  uint64_t buffer_offset_;  // file offset of start of buffer
+};
+
+}
+
+#endif
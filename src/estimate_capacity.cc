@@ -9,6 +9,7 @@
 #include "mmscanner.h"
 #include "seqreader.h"
 #include "utilities.h"
+#include "library_reader.h"
 
 using std::string;
 using std::cout;
@@ -17,7 +18,6 @@ using std::cerr;
 using std::endl;
 using std::ifstream;
 using std::ofstream;
-using std::unordered_set;
 using std::vector;
 using namespace kraken2;
 
@@ -26,20 +26,67 @@ using namespace kraken2;
 #define MAX_N RANGE_SECTIONS
 #define DEFAULT_N 4
 #define DEFAULT_BLOCK_SIZE (30 * 1024 * 1024)  // yes, 30 MB
+#define DEFAULT_LOAD_FACTOR 0.7
+#define CAPACITY_PADDING 8192  // as added by kraken2-build
+#define SAMPLE_GROUPS 8  // disjoint groups of the sample (bits of a mask)
+// 97.5th percentile of Student's t with SAMPLE_GROUPS - 1 degrees of freedom
+#define JACKKNIFE_T95 2.365
+// Fewer sampled files (or sequences) than this make for a poor estimate
+#define MIN_SAMPLED_FILES (4 * SAMPLE_GROUPS)
+
+// Minimizer parameters to estimate for
+struct ParameterSet {
+  size_t k, l;
+  string seed;  // spaced seed bitstring, empty for none
+  uint64_t spaced_seed_mask;
+};
+
+// A sampled minimizer, with the sample groups it was seen in
+struct SampledMinimizer {
+  uint64_t minimizer;
+  uint8_t groups;
+};
+
+// Distinct minimizer estimate, with a 95% confidence interval if the
+// library was sampled
+struct Estimate {
+  size_t value, low, high;
+  double exponent;  // measured growth exponent, 1 if not sampled
+};
 
 struct Options {
   size_t k, l, n;
+  double sample_fraction;
+  bool sample_genomes;  // sample genomes within files, not whole files
   bool input_is_protein;
   int threads;
   size_t block_size;
-  uint64_t spaced_seed_mask;
+  string seed;
   uint64_t toggle_mask;
+  double load_factor;
+  bool sweep;  // print a table of estimates for all parameter sets
+  vector<ParameterSet> parameter_sets;
+  vector<string> library_filenames;
 };
 
 void ParseCommandLine(int argc, char **argv, Options &opts);
 void usage(int exit_code = EX_USAGE);
-void ProcessSequence(string &seq, Options &opts,
-    vector<unordered_set<uint64_t>> &sets);
+ParameterSet ParseParameterSet(const string &spec);
+int SampleGroup(const char *key, size_t key_len, double fraction);
+int GenomeSampleGroup(const Sequence &seq, double fraction);
+void ProcessSequence(string &seq, int group, Options &opts,
+    vector<MinimizerScanner> &scanners,
+    vector<vector<vector<SampledMinimizer>>> &set_sections);
+void CompactSection(vector<SampledMinimizer> &section);
+double UnionCount(const vector<size_t> &mask_counts, unsigned groups_mask,
+    double scale);
+int GroupCount(unsigned groups_mask);
+double ExtrapolateGroups(const vector<size_t> &mask_counts,
+    unsigned groups_mask, double scale,
+    const vector<double> &group_fractions, double &exponent, double &bound);
+double JackknifeError(const vector<double> &replicates);
+Estimate Extrapolate(const vector<size_t> &mask_counts,
+    const vector<double> &group_fractions, Options &opts);
 void ProcessSequences(Options &opts);
 
 int main(int argc, char **argv) {
@@ -47,49 +94,343 @@ int main(int argc, char **argv) {
   opts.k = 0;
   opts.l = 0;
   opts.n = DEFAULT_N;
+  opts.sample_fraction = 1;
+  opts.sample_genomes = false;
   opts.threads = 1;
   opts.input_is_protein = false;
-  opts.spaced_seed_mask = DEFAULT_SPACED_SEED_MASK;
   opts.toggle_mask = DEFAULT_TOGGLE_MASK;
   opts.block_size = DEFAULT_BLOCK_SIZE;
+  opts.load_factor = DEFAULT_LOAD_FACTOR;
+  opts.sweep = false;
   ParseCommandLine(argc, argv, opts);
   omp_set_num_threads(opts.threads);
   ProcessSequences(opts);
   return 0;
 }
 
+// Each thread buffers the qualifying minimizers of each hash range section
+// it sees, for each parameter set, so the threads don't share any state
+// until the end, when each section's buffers are merged and its distinct
+// minimizers counted.  The library is read once for all parameter sets.
+// When sampling by file, unsampled files aren't read at all.
 void ProcessSequences(Options &opts)
 {
-  vector<unordered_set<uint64_t>> sets(opts.n);
+  bool sampled = opts.sample_fraction < 1;
+  vector<string> filenames = opts.library_filenames;
+  vector<int> file_groups(filenames.size(), 0);
+  if (sampled && ! opts.sample_genomes) {
+    filenames.clear();
+    file_groups.clear();
+    for (auto &filename : opts.library_filenames) {
+      int group = SampleGroup(filename.data(), filename.size(),
+                              opts.sample_fraction);
+      if (group >= 0) {
+        filenames.push_back(filename);
+        file_groups.push_back(group);
+      }
+    }
+    cerr << "Sampled " << filenames.size() << " of "
+         << opts.library_filenames.size() << " library files" << endl;
+    if (filenames.empty())
+      errx(EX_NOINPUT, "no library files sampled; use a larger fraction, or "
+           "-g to sample genomes");
+    if (filenames.size() < MIN_SAMPLED_FILES)
+      warnx("only %zu library files sampled, so the estimate may be poor; "
+            "-g samples genomes instead", filenames.size());
+  }
+  LibraryReader library(filenames, opts.threads);
+  // Files, or with -g sequences, in each sample group and in all
+  vector<size_t> group_units(SAMPLE_GROUPS, 0);
+  size_t total_units = 0;
+  if (! opts.sample_genomes) {
+    for (auto group : file_groups)
+      group_units[group]++;
+    total_units = opts.library_filenames.size();
+  }
+  auto set_ct = opts.parameter_sets.size();
+  vector<vector<vector<vector<SampledMinimizer>>>>
+    thread_sections(opts.threads);
 
   #pragma omp parallel
   {
-    bool have_work = true;
     BatchSequenceReader reader;
     Sequence sequence;
+    vector<MinimizerScanner> scanners;
+    for (auto &params : opts.parameter_sets)
+      scanners.emplace_back(params.k, params.l, params.spaced_seed_mask,
+                            ! opts.input_is_protein, opts.toggle_mask);
+    auto &set_sections = thread_sections[omp_get_thread_num()];
+    set_sections.assign(set_ct, vector<vector<SampledMinimizer>>(opts.n));
+
+    vector<size_t> thread_group_units(SAMPLE_GROUPS, 0);
+    size_t thread_total_units = 0;
+    size_t file_index;
+    while (library.LoadBlock(reader, opts.block_size, &file_index)) {
+      while (reader.NextSequence(sequence)) {
+        int group = file_groups[file_index];
+        if (opts.sample_genomes) {
+          group = GenomeSampleGroup(sequence, opts.sample_fraction);
+          thread_total_units++;
+          if (group >= 0)
+            thread_group_units[group]++;
+        }
+        if (group >= 0)
+          ProcessSequence(sequence.seq, group, opts, scanners, set_sections);
+      }
+    }
+    #pragma omp critical(group_units)
+    {
+      for (int i = 0; i < SAMPLE_GROUPS; i++)
+        group_units[i] += thread_group_units[i];
+      total_units += thread_total_units;
+    }
+  }
+  if (sampled && opts.sample_genomes) {
+    size_t sampled_ct = 0;
+    for (auto units : group_units)
+      sampled_ct += units;
+    if (sampled_ct < MIN_SAMPLED_FILES)
+      warnx("too few sequences sampled (%zu), so the estimate may be poor",
+            sampled_ct);
+  }
+  // The fraction of the library actually sampled in each group, which
+  // differs from the nominal one by chance
+  vector<double> group_fractions(SAMPLE_GROUPS, 0);
+  for (int i = 0; i < SAMPLE_GROUPS; i++)
+    group_fractions[i] = total_units ? group_units[i] * 1.0 / total_units : 0;
 
-    while (have_work) {
-      #pragma omp critical(batch_reading)
-      have_work = reader.LoadBlock(std::cin, opts.block_size);
-      if (have_work)
-        while (reader.NextSequence(sequence))
-          ProcessSequence(sequence.seq, opts, sets);
+  // Distinct minimizers per parameter set, by the set of sample groups
+  // containing them
+  vector<vector<size_t>> mask_counts(set_ct,
+                                     vector<size_t>(1 << SAMPLE_GROUPS, 0));
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < set_ct * opts.n; i++) {
+    auto set_idx = i / opts.n, section_idx = i % opts.n;
+    vector<SampledMinimizer> section;
+    for (auto &set_sections : thread_sections) {
+      if (set_sections.empty())
+        continue;
+      auto &thread_section = set_sections[set_idx][section_idx];
+      section.insert(section.end(), thread_section.begin(),
+                     thread_section.end());
+      vector<SampledMinimizer>().swap(thread_section);
     }
+    CompactSection(section);
+    for (auto &sampled : section) {
+      #pragma omp atomic
+      mask_counts[set_idx][sampled.groups]++;
+    }
+  }
+
+  if (opts.sweep) {
+    cout << "k\tl\tseed\testimate";
+    if (sampled)
+      cout << "\tci95_low\tci95_high\texponent";
+    cout << "\ttable_bytes" << endl;
+  }
+  for (size_t i = 0; i < set_ct; i++) {
+    auto estimate = Extrapolate(mask_counts[i], group_fractions, opts);
+    if (! opts.sweep) {
+      if (sampled) {
+        cerr << "Estimated " << estimate.value << " distinct minimizers (95% CI "
+             << estimate.low << "-" << estimate.high << ") from a "
+             << opts.sample_fraction << " sample, growth exponent "
+             << estimate.exponent << endl;
+      }
+      cout << estimate.value << endl;
+      continue;
+    }
+    // Sized as kraken2-build would, in 32-bit cells
+    auto capacity = (size_t) ((estimate.value + CAPACITY_PADDING)
+                              / opts.load_factor);
+    auto &params = opts.parameter_sets[i];
+    cout << params.k << "\t" << params.l << "\t"
+         << (params.seed.empty() ? "-" : params.seed) << "\t"
+         << estimate.value;
+    if (sampled)
+      cout << "\t" << estimate.low << "\t" << estimate.high << "\t"
+           << estimate.exponent;
+    cout << "\t" << capacity * sizeof(uint32_t) << endl;
+  }
+}
+
+// Samples by hashing a key (a file's path, or a genome's taxid or
+// sequence ID), so the sample is the same from run to run.  Returns -1 if
+// the key isn't sampled, otherwise which of SAMPLE_GROUPS equal, disjoint
+// groups of the sample it belongs to.
+int SampleGroup(const char *key, size_t key_len, double fraction) {
+  if (fraction >= 1)
+    return 0;
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < key_len; i++) {
+    hash ^= (unsigned char) key[i];
+    hash *= 0x100000001b3ull;
   }
+  double u = MurmurHash3(hash) / 18446744073709551616.0;  // 2^64
+  if (u >= fraction)
+    return -1;
+  return std::min((int) (u / fraction * SAMPLE_GROUPS), SAMPLE_GROUPS - 1);
+}
 
-  size_t sum_set_sizes = 0;
-  for (auto &s : sets) {
-    sum_set_sizes += s.size();
+// Genomes are identified by the taxid in a kraken:taxid header tag if
+// present, and by the sequence ID otherwise
+int GenomeSampleGroup(const Sequence &seq, double fraction) {
+  const char *key = seq.id.data();
+  size_t key_len = seq.id.size();
+  auto tag_pos = seq.header.find("kraken:taxid|");
+  if (tag_pos != string::npos) {
+    key = seq.header.data() + tag_pos + strlen("kraken:taxid|");
+    key_len = 0;
+    while (isdigit(key[key_len]))
+      key_len++;
   }
-  sum_set_sizes++;  // ensure non-zero estimate
-  cout << (size_t) (sum_set_sizes * RANGE_SECTIONS * 1.0 / opts.n) << endl;
+  return SampleGroup(key, key_len, fraction);
+}
+
+// Distinct minimizers seen in any of the sample groups in groups_mask
+double UnionCount(const vector<size_t> &mask_counts, unsigned groups_mask,
+    double scale)
+{
+  size_t count = 0;
+  for (unsigned mask = 1; mask < mask_counts.size(); mask++)
+    if (mask & groups_mask)
+      count += mask_counts[mask];
+  return count * scale;
+}
+
+int GroupCount(unsigned groups_mask) {
+  int count = 0;
+  for (; groups_mask; groups_mask &= groups_mask - 1)
+    count++;
+  return count;
+}
+
+// The count grows with the fraction f of the library sampled about as
+// f^b.  b is measured between the given groups and the mean over all
+// subsets of half of them, and their count extrapolated to the whole
+// library with it.  The expected count is concave in f (each genome added
+// brings no more new minimizers than the one before), so extending the line
+// through those two points to f = 1 gives an upper bound.  The estimate
+// stays between the groups' own count and that bound.
+double ExtrapolateGroups(const vector<size_t> &mask_counts,
+    unsigned groups_mask, double scale,
+    const vector<double> &group_fractions, double &exponent, double &bound)
+{
+  auto fraction_of = [&](unsigned mask) {
+    double fraction = 0;
+    for (int i = 0; i < SAMPLE_GROUPS; i++)
+      if (mask & (1u << i))
+        fraction += group_fractions[i];
+    return fraction;
+  };
+  int half_ct = GroupCount(groups_mask) / 2;
+  // ensure non-zero estimate
+  double count = UnionCount(mask_counts, groups_mask, scale) + scale;
+  double fraction = fraction_of(groups_mask);
+  double half_count = 0, half_fraction = 0;
+  size_t subset_ct = 0;
+  for (unsigned subset = groups_mask; subset; subset = (subset - 1) & groups_mask) {
+    if (GroupCount(subset) == half_ct) {
+      half_count += UnionCount(mask_counts, subset, scale);
+      half_fraction += fraction_of(subset);
+      subset_ct++;
+    }
+  }
+  exponent = 1;
+  bound = count;
+  if (fraction <= 0)
+    return count;
+  bound = count / fraction;
+  if (subset_ct == 0 || half_count <= 0 || half_fraction >= fraction * subset_ct)
+    return bound;
+  half_count /= subset_ct;
+  half_fraction /= subset_ct;
+  exponent = std::min(1.0, std::max(0.0,
+                      log(count / half_count) / log(fraction / half_fraction)));
+  bound = std::min(bound, count + (1 - fraction) * (count - half_count)
+                                  / (fraction - half_fraction));
+  return std::min(bound, count * pow(1 / fraction, exponent));
+}
+
+// Returns the jackknife standard error of a statistic computed without
+// each group in turn
+double JackknifeError(const vector<double> &replicates) {
+  double mean = 0;
+  for (auto replicate : replicates)
+    mean += replicate / replicates.size();
+  double variance = 0;
+  for (auto replicate : replicates)
+    variance += (replicate - mean) * (replicate - mean);
+  return sqrt(variance * (replicates.size() - 1) / replicates.size());
+}
+
+// Without sampling, the count is scaled up from the sampled hash range
+// sections.  With sampling, the sample's count is extrapolated.  The
+// confidence interval runs from the extrapolation to the concavity bound,
+// widened by each one's delete-one-group jackknife error, so it covers
+// both the sampling error and growth anywhere between a power law and a
+// straight line.
+Estimate Extrapolate(const vector<size_t> &mask_counts,
+    const vector<double> &group_fractions, Options &opts)
+{
+  double scale = RANGE_SECTIONS * 1.0 / opts.n;
+  unsigned all_groups = (1u << SAMPLE_GROUPS) - 1;
+  double sample_count = UnionCount(mask_counts, all_groups, scale) + scale;
+  Estimate estimate;
+  if (opts.sample_fraction >= 1) {
+    // ensure non-zero estimate
+    estimate.value = estimate.low = estimate.high = (size_t) sample_count;
+    estimate.exponent = 1;
+    return estimate;
+  }
+
+  double bound;
+  double value = ExtrapolateGroups(mask_counts, all_groups, scale,
+                                   group_fractions, estimate.exponent, bound);
+  vector<double> value_replicates, bound_replicates;
+  for (int group = 0; group < SAMPLE_GROUPS; group++) {
+    double exponent, replicate_bound;
+    value_replicates.push_back(ExtrapolateGroups(mask_counts,
+        all_groups & ~(1u << group), scale, group_fractions, exponent,
+        replicate_bound));
+    bound_replicates.push_back(replicate_bound);
+  }
+  double sample_fraction = 0;
+  for (auto fraction : group_fractions)
+    sample_fraction += fraction;
+  double linear_count = sample_fraction > 0 ? sample_count / sample_fraction
+                                            : sample_count;
+  estimate.value = (size_t) value;
+  estimate.low = (size_t) std::max(sample_count,
+      value - JACKKNIFE_T95 * JackknifeError(value_replicates));
+  estimate.high = (size_t) std::min(linear_count,
+      bound + JACKKNIFE_T95 * JackknifeError(bound_replicates));
+  return estimate;
+}
+
+// Sorts and removes duplicates, merging each minimizer's sample groups
+void CompactSection(vector<SampledMinimizer> &section) {
+  std::sort(section.begin(), section.end(),
+    [](const SampledMinimizer &a, const SampledMinimizer &b) {
+      return a.minimizer < b.minimizer;
+    });
+  size_t kept = 0;
+  for (size_t i = 0; i < section.size(); i++) {
+    if (kept > 0 && section[kept - 1].minimizer == section[i].minimizer)
+      section[kept - 1].groups |= section[i].groups;
+    else
+      section[kept++] = section[i];
+  }
+  section.resize(kept);
 }
 
 void ParseCommandLine(int argc, char **argv, Options &opts) {
   int opt;
   long long sig;
 
-  while ((opt = getopt(argc, argv, "?hk:l:n:S:T:B:p:X")) != -1) {
+  vector<string> set_specs;
+
+  while ((opt = getopt(argc, argv, "?hk:l:n:S:T:B:p:XP:a:f:g")) != -1) {
     switch (opt) {
       case 'h' : case '?' :
         usage(0);
@@ -132,7 +473,23 @@ void ParseCommandLine(int argc, char **argv, Options &opts) {
         opts.input_is_protein = true;
         break;
       case 'S' :
-        opts.spaced_seed_mask = strtol(optarg, nullptr, 2);
+        opts.seed = optarg;
+        break;
+      case 'P' :
+        set_specs.push_back(optarg);
+        break;
+      case 'f' :
+        opts.sample_fraction = atof(optarg);
+        if (opts.sample_fraction <= 0 || opts.sample_fraction > 1)
+          errx(EX_USAGE, "sample fraction must be in (0, 1]");
+        break;
+      case 'g' :
+        opts.sample_genomes = true;
+        break;
+      case 'a' :
+        opts.load_factor = atof(optarg);
+        if (opts.load_factor <= 0 || opts.load_factor > 1)
+          errx(EX_USAGE, "load factor must be in (0, 1]");
         break;
       case 'T' :
         opts.toggle_mask = strtol(optarg, nullptr, 2);
@@ -140,50 +497,124 @@ void ParseCommandLine(int argc, char **argv, Options &opts) {
     }
   }
 
-  if (opts.spaced_seed_mask != DEFAULT_SPACED_SEED_MASK)
-    ExpandSpacedSeedMask(opts.spaced_seed_mask,
-      opts.input_is_protein ? BITS_PER_CHAR_PRO : BITS_PER_CHAR_DNA);
-  if (opts.k == 0 || opts.l == 0) {
+  if (opts.k || opts.l) {
+    if (opts.k == 0 || opts.l == 0) {
+      cerr << "missing mandatory integer parameter" << endl;
+      usage();
+    }
+    opts.parameter_sets.push_back(ParameterSet{opts.k, opts.l, opts.seed, 0});
+  }
+  for (auto &spec : set_specs)
+    opts.parameter_sets.push_back(ParseParameterSet(spec));
+  opts.sweep = ! set_specs.empty();
+  if (opts.parameter_sets.empty()) {
     cerr << "missing mandatory integer parameter" << endl;
     usage();
   }
-  if (opts.k < opts.l) {
-    cerr << "k cannot be less than l" << endl;
-    usage();
+  for (auto &params : opts.parameter_sets) {
+    if (params.k < params.l) {
+      cerr << "k cannot be less than l" << endl;
+      usage();
+    }
+    params.spaced_seed_mask = DEFAULT_SPACED_SEED_MASK;
+    if (! params.seed.empty()) {
+      params.spaced_seed_mask = strtol(params.seed.c_str(), nullptr, 2);
+      ExpandSpacedSeedMask(params.spaced_seed_mask,
+        opts.input_is_protein ? BITS_PER_CHAR_PRO : BITS_PER_CHAR_DNA);
+    }
   }
+
+  vector<string> library_paths(argv + optind, argv + argc);
+  if (library_paths.empty())
+    library_paths.push_back("-");
+  opts.library_filenames = ListLibraryFiles(library_paths);
+  if (opts.library_filenames.empty())
+    errx(EX_NOINPUT, "no library files found");
+  if (opts.sample_fraction < 1 && ! opts.sample_genomes
+      && std::find(opts.library_filenames.begin(), opts.library_filenames.end(),
+                   "-") != opts.library_filenames.end())
+    errx(EX_USAGE, "standard input can't be sampled by file; use -g");
+}
+
+// Parses "K,L[,BITSTRING]"
+ParameterSet ParseParameterSet(const string &spec) {
+  auto fields = SplitString(spec, ",");
+  if (fields.size() < 2 || fields.size() > 3)
+    errx(EX_USAGE, "parameter set must be K,L[,BITSTRING]: %s", spec.c_str());
+  ParameterSet params;
+  params.k = atoll(fields[0].c_str());
+  params.l = atoll(fields[1].c_str());
+  if (params.k < 1 || params.l < 1)
+    errx(EX_USAGE, "k and l must be positive integers: %s", spec.c_str());
+  if (params.l > 31)
+    errx(EX_USAGE, "l must be no more than 31: %s", spec.c_str());
+  if (fields.size() == 3)
+    params.seed = fields[2];
+  params.spaced_seed_mask = 0;
+  return params;
 }
 
 void usage(int exit_code) {
-  cerr << "Usage: estimate_capacity <options>" << endl
+  cerr << "Usage: estimate_capacity <options> [library files/directories]" << endl
        << endl
-       << "Options (*mandatory):" << endl
+       << "Reads sequences from the given files, which may be gzipped, and" << endl
+       << "from the .fna/.faa files found in the given directories, or from" << endl
+       << "standard input if none are given." << endl
+       << endl
+       << "Prints the estimated number of distinct minimizers.  With -P, the" << endl
+       << "library is read once for all parameter sets (including -k/-l/-S, if" << endl
+       << "given), and a table gives each set's estimate and the hash table" << endl
+       << "size kraken2-build would use for it." << endl
+       << endl
+       << "Options (*mandatory, unless -P is given):" << endl
        << "* -k INT        Set length of k-mers" << endl
        << "* -l INT        Set length of minimizers" << endl
        << "  -n INT        Set maximum qualifying hash code" << endl
        << "  -X            Input sequences are proteins" << endl
        << "  -S BITSTRING  Spaced seed mask" << endl
+       << "  -P K,L[,BITSTRING]" << endl
+       << "                Also estimate for this k-mer length, minimizer length" << endl
+       << "                and spaced seed mask; may be repeated" << endl
+       << "  -a FLOAT      Load factor for table sizes in -P output (def: "
+                           << DEFAULT_LOAD_FACTOR << ")" << endl
+       << "  -f FLOAT      Read only this fraction of the library files and" << endl
+       << "                extrapolate, with a 95% confidence interval" << endl
+       << "  -g            With -f, sample genomes (by kraken:taxid tag, else" << endl
+       << "                sequence ID) instead of files; every file is read," << endl
+       << "                but only sampled genomes are scanned" << endl
        << "  -T BITSTRING  Minimizer ordering toggle mask" << endl
        << "  -B INT        Read block size" << endl
        << "  -p INT        Number of threads" << endl;
   exit(exit_code);
 }
 
-void ProcessSequence(string &seq, Options &opts,
-    vector<unordered_set<uint64_t>> &sets)
+void ProcessSequence(string &seq, int group, Options &opts,
+    vector<MinimizerScanner> &scanners,
+    vector<vector<vector<SampledMinimizer>>> &set_sections)
 {
-  MinimizerScanner scanner(opts.k, opts.l, opts.spaced_seed_mask, ! opts.input_is_protein, opts.toggle_mask);
   // Add terminator for protein sequences if not already there
   if (opts.input_is_protein && seq.back() != '*')
     seq.push_back('*');
-  scanner.LoadSequence(seq);
-  uint64_t *minimizer_ptr;
-  while ((minimizer_ptr = scanner.NextMinimizer())) {
-    if (scanner.is_ambiguous())
-      continue;
-    uint64_t hash_code = MurmurHash3(*minimizer_ptr);
-    if ((hash_code & RANGE_MASK) < opts.n) {
-      #pragma omp critical(set_insert)
-      sets[hash_code & RANGE_MASK].insert(*minimizer_ptr);
+  for (size_t i = 0; i < scanners.size(); i++) {
+    auto &scanner = scanners[i];
+    auto &sections = set_sections[i];
+    scanner.LoadSequence(seq);
+    uint64_t *minimizer_ptr;
+    while ((minimizer_ptr = scanner.NextMinimizer())) {
+      if (scanner.is_ambiguous())
+        continue;
+      uint64_t hash_code = MurmurHash3(*minimizer_ptr);
+      if ((hash_code & RANGE_MASK) < opts.n) {
+        auto &section = sections[hash_code & RANGE_MASK];
+        // Compact when the buffer fills, so it stays within about twice the
+        // section's distinct minimizer count
+        if (section.size() == section.capacity() && section.size() >= 1024) {
+          CompactSection(section);
+          section.reserve(section.size() * 2);
+        }
+        section.push_back(SampledMinimizer{*minimizer_ptr,
+                                           (uint8_t) (1 << group)});
+      }
     }
   }
 }
@@ -0,0 +1,248 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#include "library_reader.h"
+
+using std::string;
+using std::vector;
+
+namespace kraken2 {
+
+static bool HasSuffix(const string &str, const string &suffix) {
+  return str.size() >= suffix.size() &&
+         str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static bool IsLibraryFilename(const string &name) {
+  for (auto &suffix : { ".fna", ".faa", ".fna.gz", ".faa.gz" })
+    if (HasSuffix(name, suffix))
+      return true;
+  return false;
+}
+
+static void ListDirectory(const string &dirname, vector<string> &files) {
+  DIR *dir = opendir(dirname.c_str());
+  if (dir == nullptr)
+    err(EX_NOINPUT, "unable to open directory %s", dirname.c_str());
+  vector<string> names;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    string name = entry->d_name;
+    if (name != "." && name != "..")
+      names.push_back(name);
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+
+  for (auto &name : names) {
+    string path = dirname + "/" + name;
+    struct stat sb;
+    if (lstat(path.c_str(), &sb) < 0)
+      err(EX_NOINPUT, "unable to stat %s", path.c_str());
+    if (S_ISDIR(sb.st_mode))
+      ListDirectory(path, files);
+    else if (IsLibraryFilename(name))
+      files.push_back(path);
+  }
+}
+
+vector<string> ListLibraryFiles(const vector<string> &paths) {
+  vector<string> files;
+  for (auto &path : paths) {
+    struct stat sb;
+    if (path != "-" && stat(path.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode)) {
+      string dirname = path;
+      while (dirname.size() > 1 && dirname.back() == '/')
+        dirname.pop_back();
+      ListDirectory(dirname, files);
+    }
+    else {
+      files.push_back(path);
+    }
+  }
+  return files;
+}
+
+LibraryFile::LibraryFile(const string &filename)
+    : filename_(filename), stream_(&buffer_)
+{
+  if (! buffer_.open(filename))
+    err(EX_NOINPUT, "unable to open %s", filename.c_str());
+}
+
+void LibraryFile::Seek(uint64_t offset) {
+  if (! buffer_.seek(offset))
+    errx(EX_IOERR, "unable to seek to offset %llu in %s",
+         (unsigned long long) offset, filename_.c_str());
+  stream_.clear();
+}
+
+LibraryReader::LibraryReader(const vector<string> &filenames, size_t max_open)
+    : filenames_(filenames), next_file_(0), max_open_(max_open)
+{
+  if (max_open_ < 1)
+    max_open_ = 1;
+  omp_init_lock(&lock_);
+}
+
+LibraryReader::~LibraryReader() {
+  for (auto file : files_) {
+    delete file->file;
+    omp_destroy_lock(&file->lock);
+    delete file;
+  }
+  omp_destroy_lock(&lock_);
+}
+
+bool LibraryReader::LoadBlock(BatchSequenceReader &reader, size_t block_size,
+    size_t *file_index)
+{
+  while (true) {
+    OpenFile *file = nullptr;
+    bool wait = false;
+    omp_set_lock(&lock_);
+    for (auto open_file : open_files_) {
+      if (omp_test_lock(&open_file->lock)) {
+        file = open_file;
+        break;
+      }
+    }
+    if (file == nullptr && open_files_.size() < max_open_
+        && next_file_ < filenames_.size())
+    {
+      file = new OpenFile;
+      file->index = next_file_;
+      file->file = nullptr;
+      file->format = FORMAT_AUTO_DETECT;
+      file->exhausted = false;
+      omp_init_lock(&file->lock);
+      omp_set_lock(&file->lock);
+      file->file = new LibraryFile(filenames_[next_file_++]);
+      files_.push_back(file);
+      open_files_.push_back(file);
+    }
+    if (file == nullptr && ! open_files_.empty()) {
+      // Every open file is being read; wait for the first one
+      file = open_files_.front();
+      wait = true;
+    }
+    omp_unset_lock(&lock_);
+
+    if (file == nullptr)
+      return false;
+    if (wait) {
+      omp_set_lock(&file->lock);
+      if (file->exhausted) {
+        omp_unset_lock(&file->lock);
+        continue;
+      }
+    }
+
+    reader.set_file_format(file->format);
+    bool ok = reader.LoadBlock(file->file->stream(), block_size);
+    file->format = reader.file_format();
+    if (! ok) {
+      omp_set_lock(&lock_);
+      file->exhausted = true;
+      open_files_.erase(std::find(open_files_.begin(), open_files_.end(), file));
+      omp_unset_lock(&lock_);
+      delete file->file;
+      file->file = nullptr;
+    }
+    omp_unset_lock(&file->lock);
+    if (ok) {
+      if (file_index != nullptr)
+        *file_index = file->index;
+      return true;
+    }
+  }
+}
+
+OrderedLibraryReader::OrderedLibraryReader(const vector<string> &filenames,
+    size_t max_open, LibraryPosition start)
+    : filenames_(filenames), start_(start), next_file_(start.file_index),
+      max_open_(max_open)
+{
+  if (max_open_ < 1)
+    max_open_ = 1;
+}
+
+OrderedLibraryReader::~OrderedLibraryReader() {
+  for (auto slot : window_) {
+    delete slot->file;
+    delete slot;
+  }
+}
+
+bool OrderedLibraryReader::LoadBlocks(size_t block_size,
+    vector<LibraryBlock> &blocks)
+{
+  blocks.clear();
+  for (auto slot : window_) {
+    if (slot->handed_out)
+      slot->loaded = slot->handed_out = false;
+  }
+
+  while (blocks.empty()) {
+    while (! window_.empty() && ! window_.front()->loaded
+           && window_.front()->exhausted)
+    {
+      delete window_.front();
+      window_.pop_front();
+    }
+    while (window_.size() < max_open_ && next_file_ < filenames_.size()) {
+      auto slot = new FileSlot;
+      slot->file_index = next_file_;
+      slot->file = nullptr;
+      slot->end_offset = 0;
+      slot->loaded = slot->exhausted = slot->handed_out = false;
+      window_.push_back(slot);
+      next_file_++;
+    }
+    if (window_.empty())
+      return false;
+
+    // Read the next block of every file in the window that needs one
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < window_.size(); i++) {
+      auto slot = window_[i];
+      if (slot->loaded || slot->exhausted)
+        continue;
+      if (slot->file == nullptr) {
+        slot->file = new LibraryFile(filenames_[slot->file_index]);
+        if (slot->file_index == start_.file_index && start_.offset > 0)
+          slot->file->Seek(start_.offset);
+      }
+      slot->loaded = slot->reader.LoadBlock(slot->file->stream(), block_size);
+      slot->end_offset = slot->file->tell();
+      if (! slot->loaded || slot->file->at_end()) {
+        slot->exhausted = true;
+        delete slot->file;
+        slot->file = nullptr;
+      }
+    }
+
+    // Hand out blocks in order, up to the first file that isn't finished
+    for (auto slot : window_) {
+      if (slot->loaded) {
+        LibraryBlock block;
+        block.reader = &slot->reader;
+        block.file_index = slot->file_index;
+        if (slot->exhausted)
+          block.end = LibraryPosition{slot->file_index + 1, 0};
+        else
+          block.end = LibraryPosition{slot->file_index, slot->end_offset};
+        blocks.push_back(block);
+        slot->handed_out = true;
+      }
+      if (! slot->exhausted)
+        break;
+    }
+  }
+  return true;
+}
+
+}
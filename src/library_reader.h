@@ -0,0 +1,122 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#ifndef KRAKEN2_LIBRARY_READER_H_
+#define KRAKEN2_LIBRARY_READER_H_
+
+#include "kraken2_headers.h"
+#include "seqreader.h"
+#include "compression.h"
+
+namespace kraken2 {
+
+// Expands paths into the list of reference library files to read.
+// Directories are searched recursively, in sorted order, for .fna and .faa
+// files (optionally gzipped); other paths are used as given.
+std::vector<std::string> ListLibraryFiles(const std::vector<std::string> &paths);
+
+// A library file, decompressed if gzipped; "-" is standard input
+class LibraryFile {
+  public:
+  explicit LibraryFile(const std::string &filename);
+  LibraryFile(const LibraryFile &rhs) = delete;
+  LibraryFile& operator=(const LibraryFile &rhs) = delete;
+
+  std::istream &stream() { return stream_; }
+  bool at_end() { return stream_.peek() == std::istream::traits_type::eof(); }
+  // Uncompressed offset of the next byte to be read from the stream
+  uint64_t tell() const { return buffer_.tell(); }
+  void Seek(uint64_t offset);
+
+  private:
+  std::string filename_;
+  GzipFileBuffer buffer_;
+  std::istream stream_;
+};
+
+// Hands out blocks of sequences from a list of files to reader threads, in
+// no particular order.  Up to max_open files are open at once, each read
+// by one thread at a time, so that files are read and decompressed
+// concurrently.  LoadBlock() may be called from several threads.
+class LibraryReader {
+  public:
+  LibraryReader(const std::vector<std::string> &filenames, size_t max_open);
+  ~LibraryReader();
+  LibraryReader(const LibraryReader &rhs) = delete;
+  LibraryReader& operator=(const LibraryReader &rhs) = delete;
+
+  // Returns false once all files have been read; sets *file_index, if
+  // given, to the index of the file the block was read from
+  bool LoadBlock(BatchSequenceReader &reader, size_t block_size,
+                 size_t *file_index = nullptr);
+
+  private:
+  struct OpenFile {
+    size_t index;
+    LibraryFile *file;
+    SequenceFormat format;
+    bool exhausted;
+    omp_lock_t lock;
+  };
+
+  std::vector<std::string> filenames_;
+  std::vector<OpenFile *> files_;  // kept until destruction, for waiters
+  std::deque<OpenFile *> open_files_;
+  size_t next_file_;
+  size_t max_open_;
+  omp_lock_t lock_;
+};
+
+// A point in a list of library files: the file, and the uncompressed offset
+// within it
+struct LibraryPosition {
+  size_t file_index;
+  uint64_t offset;
+};
+
+struct LibraryBlock {
+  BatchSequenceReader *reader;
+  size_t file_index;    // file the block was read from
+  LibraryPosition end;  // where the block after this one starts
+};
+
+// Hands out blocks in the order they'd have if the files were concatenated,
+// while reading ahead in up to max_open files concurrently.  Used by one
+// thread; each call returns one or more blocks, valid until the next call.
+// Reading can start from the end of a block handed out earlier, giving the
+// same blocks from there on.
+class OrderedLibraryReader {
+  public:
+  OrderedLibraryReader(const std::vector<std::string> &filenames,
+      size_t max_open, LibraryPosition start = LibraryPosition{0, 0});
+  ~OrderedLibraryReader();
+  OrderedLibraryReader(const OrderedLibraryReader &rhs) = delete;
+  OrderedLibraryReader& operator=(const OrderedLibraryReader &rhs) = delete;
+
+  // Returns false once all files have been read
+  bool LoadBlocks(size_t block_size, std::vector<LibraryBlock> &blocks);
+
+  private:
+  struct FileSlot {
+    size_t file_index;
+    LibraryFile *file;
+    BatchSequenceReader reader;
+    uint64_t end_offset;
+    bool loaded;     // reader holds a block not yet handed out
+    bool exhausted;  // no blocks after the loaded one
+    bool handed_out;
+  };
+
+  std::vector<std::string> filenames_;
+  std::deque<FileSlot *> window_;
+  LibraryPosition start_;
+  size_t next_file_;
+  size_t max_open_;
+};
+
+}
+
+#endif
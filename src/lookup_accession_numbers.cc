@@ -7,100 +7,370 @@
 #include "kraken2_headers.h"
 #include "mmap_file.h"
 #include "utilities.h"
+#include "accession_index.h"
 
 using namespace kraken2;
 using std::string;
-using std::unordered_map;
 using std::vector;
 
-int main(int argc, char **argv) {
-  if (argc < 3)
-    errx(EX_USAGE, "Usage: lookup_accession_numbers <lookup file> <accmaps>");
+#define CHUNK_SIZE (64 * 1024 * 1024)
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+// An accession number being looked up, and where its first match was found
+struct Target {
+  size_t accnum_offset;  // in TargetSet::accnums_
+  size_t accnum_len;
+  size_t first_seqid;    // seqids for the target are contiguous
+  size_t seqid_ct;
+  size_t match_chunk;    // SIZE_MAX if not found
+  const char *match_line;
+  taxid_t taxid;
+};
+
+// The accession numbers, stored end to end in one string and indexed by an
+// open-addressed table, so lines can be checked without copying their
+// accession numbers
+class TargetSet {
+  public:
+  void ReadFile(const char *filename);
+
+  // Returns the target's index, or -1 if the accession isn't a target
+  ssize_t Find(const char *accnum, size_t accnum_len) const;
+  string Accession(size_t idx) const {
+    return accnums_.substr(targets[idx].accnum_offset, targets[idx].accnum_len);
+  }
+
+  vector<Target> targets;
+  vector<string> seqids;
+
+  private:
+  static uint64_t Hash(const char *str, size_t len);
+
+  string accnums_;
+  vector<ssize_t> slots_;  // power-of-2 size, -1 if empty
+};
+
+// A line-aligned part of one accession map file, or a whole index
+struct Chunk {
+  size_t file_index;
+  AccessionMapChunk data;
+  AccessionIndex *index;
+};
+
+void usage(int exit_code = EX_USAGE);
+void SearchChunk(const Chunk &chunk, size_t chunk_index, const char *filename,
+    TargetSet &targets, size_t &found_ct, size_t &stop_after,
+    uint64_t &accessions_searched);
+void SearchIndex(const AccessionIndex &index, size_t chunk_index,
+    TargetSet &targets, size_t &found_ct, uint64_t &accessions_searched);
+void ReportProgress(size_t found_ct, size_t target_ct, uint64_t searched);
 
-  unordered_map<string, vector<string>> target_lists;
-  std::ifstream lookup_list_file(argv[1]);
+uint64_t TargetSet::Hash(const char *str, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) str[i];
+    hash *= 0x100000001b3ull;
+  }
+  hash ^= hash >> 33;
+  return hash;
+}
+
+void TargetSet::ReadFile(const char *filename) {
+  std::ifstream lookup_list_file(filename);
+  if (! lookup_list_file)
+    err(EX_NOINPUT, "unable to read %s", filename);
+  vector<std::pair<string, string>> pairs;
   string line;
   while (getline(lookup_list_file, line)) {
     auto fields = SplitString(line, "\t", 2);
-    string seqid = fields[0];
-    string accnum = fields[1];
-    target_lists[accnum].push_back(seqid);
+    if (fields.size() < 2)
+      errx(EX_DATAERR, "expected TAB not found in %s", filename);
+    pairs.emplace_back(fields[1], fields[0]);
   }
-  lookup_list_file.close();
+  // Stable, so each accession's seqids keep their order in the file
+  std::stable_sort(pairs.begin(), pairs.end(),
+    [](const std::pair<string, string> &a, const std::pair<string, string> &b)
+    { return a.first < b.first; });
 
-  auto initial_target_count = target_lists.size();
+  for (auto &pair : pairs) {
+    if (targets.empty() || pair.first != Accession(targets.size() - 1)) {
+      Target target;
+      target.accnum_offset = accnums_.size();
+      target.accnum_len = pair.first.size();
+      target.first_seqid = seqids.size();
+      target.seqid_ct = 0;
+      target.match_chunk = SIZE_MAX;
+      target.match_line = nullptr;
+      target.taxid = 0;
+      targets.push_back(target);
+      accnums_ += pair.first;
+    }
+    targets.back().seqid_ct++;
+    seqids.push_back(pair.second);
+  }
+
+  size_t slot_ct = 16;
+  while (slot_ct * 7 / 10 < targets.size())
+    slot_ct *= 2;
+  slots_.assign(slot_ct, -1);
+  for (size_t i = 0; i < targets.size(); i++) {
+    auto idx = Hash(accnums_.data() + targets[i].accnum_offset,
+                    targets[i].accnum_len) & (slot_ct - 1);
+    while (slots_[idx] >= 0)
+      idx = (idx + 1) & (slot_ct - 1);
+    slots_[idx] = i;
+  }
+}
+
+ssize_t TargetSet::Find(const char *accnum, size_t accnum_len) const {
+  size_t mask = slots_.size() - 1;
+  for (auto idx = Hash(accnum, accnum_len) & mask; ; idx = (idx + 1) & mask) {
+    auto target_idx = slots_[idx];
+    if (target_idx < 0)
+      return -1;
+    auto &target = targets[target_idx];
+    if (target.accnum_len == accnum_len &&
+        memcmp(accnums_.data() + target.accnum_offset, accnum, accnum_len) == 0)
+      return target_idx;
+  }
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  long long sig;
+  int threads = 1;
+  while ((opt = getopt(argc, argv, "?hp:")) != -1) {
+    switch (opt) {
+      case 'h' : case '?' :
+        usage(0);
+        break;
+      case 'p' :
+        sig = atoll(optarg);
+        if (sig < 1)
+          errx(EX_USAGE, "must have at least 1 thread");
+        threads = sig;
+        break;
+    }
+  }
+  if (argc - optind < 2)
+    usage();
+  omp_set_num_threads(threads);
+
+  TargetSet targets;
+  targets.ReadFile(argv[optind]);
+  auto initial_target_count = targets.targets.size();
+
+  // Map every file and split it into chunks after its header line; chunks
+  // are numbered in file order, so the first match of an accession is the
+  // one in the lowest-numbered chunk.  An index is a single chunk.
+  vector<char *> filenames(argv + optind + 1, argv + argc);
+  vector<MMapFile> accmap_files(filenames.size());
+  vector<AccessionIndex> indexes(filenames.size());
+  vector<Chunk> chunks;
+  for (size_t i = 0; i < filenames.size(); i++) {
+    if (AccessionIndex::IsIndexFile(filenames[i])) {
+      indexes[i].OpenFile(filenames[i]);
+      chunks.push_back(Chunk{i, AccessionMapChunk{nullptr, nullptr},
+                             &indexes[i]});
+      continue;
+    }
+    accmap_files[i].OpenFile(filenames[i]);
+    for (auto &data : SplitAccessionMap(accmap_files[i].fptr(),
+                        accmap_files[i].filesize(), CHUNK_SIZE))
+      chunks.push_back(Chunk{i, data, nullptr});
+  }
 
-  MMapFile accmap_file;
   if (isatty(fileno(stderr)))
     std::cerr << "\rFound 0/" << initial_target_count << " targets...";
+  size_t found_ct = 0;
+  size_t stop_after = SIZE_MAX;
   uint64_t accessions_searched = 0;
-  for (int i = 2; i < argc; i++) {
-    if (target_lists.empty())  // Stop processing files if we've found all we need
-      break;
-    accmap_file.OpenFile(argv[i]);
-    char *ptr = accmap_file.fptr();
-    // Skip header line
-    char *lf_ptr = (char *) memchr(ptr, '\n', accmap_file.filesize());
-    if (lf_ptr != nullptr)
-      ptr = lf_ptr + 1;
-
-    while ((size_t)(ptr - accmap_file.fptr()) < accmap_file.filesize()) {
-      lf_ptr = (char *) memchr(ptr, '\n', accmap_file.filesize() - (ptr - accmap_file.fptr()));
-      if (lf_ptr == nullptr) {
-        warnx("expected EOL not found at EOF in %s", argv[i]);
-        break;
-      }
-      char *tab_ptr = (char *) memchr(ptr, '\t', lf_ptr - ptr);
-      if (tab_ptr == nullptr) {
-        warnx("expected TAB not found in %s", argv[i]);
-        break;
-      }
-      string accnum(ptr, tab_ptr - ptr);
-      accessions_searched++;
-      if (target_lists.count(accnum)) {
-        for (int j = 0; j < 2; j++) {
-          ptr = tab_ptr + 1;
-          tab_ptr = (char *) memchr(ptr, '\t', lf_ptr - ptr);
-          if (tab_ptr == nullptr) {
-            warnx("expected TAB not found in %s", argv[i]);
-            break;
-          }
-        }
-        if (tab_ptr == nullptr)
-          break;
-        string taxid(ptr, tab_ptr - ptr);
-        for (auto &seqid : target_lists[accnum])
-          std::cout << seqid << "\t" << taxid << std::endl;
-        target_lists.erase(accnum);
-        if (isatty(fileno(stderr)))
-          std::cerr << "\rFound " << (initial_target_count - target_lists.size())
-              << "/" << initial_target_count << " targets, searched through "
-              << accessions_searched << " accession IDs...";
-        if (target_lists.empty())  // Stop processing file if we've found all we need
-          break;
-      }
-      if (accessions_searched % 10000000 == 0 && isatty(fileno(stderr)))
-        std::cerr << "\rFound " << (initial_target_count - target_lists.size())
-            << "/" << initial_target_count << " targets, searched through "
-            << accessions_searched << " accession IDs...";
-      ptr = lf_ptr + 1;
+  // Runs of text chunks are searched in parallel, indexes one at a time
+  size_t run_start = 0;
+  while (run_start < chunks.size() && found_ct < initial_target_count) {
+    if (chunks[run_start].index != nullptr) {
+      SearchIndex(*chunks[run_start].index, run_start, targets, found_ct,
+                  accessions_searched);
+      run_start++;
+      continue;
+    }
+    size_t run_end = run_start;
+    while (run_end < chunks.size() && chunks[run_end].index == nullptr)
+      run_end++;
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = run_start; i < run_end; i++) {
+      SearchChunk(chunks[i], i, filenames[chunks[i].file_index], targets,
+                  found_ct, stop_after, accessions_searched);
+    }
+    run_start = run_end;
+  }
+
+  // Report in accession order (targets are sorted), which doesn't depend
+  // on the layout of the map files, so an index gives the same output as
+  // the text maps it was built from
+  size_t found_target_ct = 0;
+  string output;
+  for (auto &target : targets.targets) {
+    if (target.match_chunk == SIZE_MAX)
+      continue;
+    found_target_ct++;
+    for (size_t j = 0; j < target.seqid_ct; j++) {
+      output += targets.seqids[target.first_seqid + j];
+      output.push_back('\t');
+      output += std::to_string(target.taxid);
+      output.push_back('\n');
+    }
+    if (output.size() >= OUTPUT_BUFFER_SIZE) {
+      fwrite(output.data(), 1, output.size(), stdout);
+      output.clear();
     }
-    accmap_file.CloseFile();
   }
+  fwrite(output.data(), 1, output.size(), stdout);
+  if (fflush(stdout) != 0)
+    err(EX_IOERR, "unable to write output");
+
   if (isatty(fileno(stderr)))
     std::cerr << "\r";
-  std::cerr << "Found " << (initial_target_count - target_lists.size())
+  std::cerr << "Found " << found_target_ct
       << "/" << initial_target_count << " targets, searched through "
       << accessions_searched << " accession IDs, search complete." << std::endl;
 
-  if (! target_lists.empty()) {
-    std::cerr << "lookup_accession_numbers: " << target_lists.size() << "/"
+  if (found_target_ct < initial_target_count) {
+    std::cerr << "lookup_accession_numbers: "
+         << initial_target_count - found_target_ct << "/"
          << initial_target_count << " accession numbers remain unmapped, see "
          << "unmapped.txt in DB directory" << std::endl;
     std::ofstream ofs("unmapped.txt");
-    for (auto &kv_pair : target_lists)
-      ofs << kv_pair.first << std::endl;
+    for (size_t i = 0; i < targets.targets.size(); i++)
+      if (targets.targets[i].match_chunk == SIZE_MAX)
+        ofs << targets.Accession(i) << "\n";
   }
 
   return 0;
 }
+
+// Records the first match of each target in the chunk.  Once every target
+// has a match, lines after all of the matches can't change the results and
+// aren't searched.
+void SearchChunk(const Chunk &chunk, size_t chunk_index, const char *filename,
+    TargetSet &targets, size_t &found_ct, size_t &stop_after,
+    uint64_t &accessions_searched)
+{
+  size_t stop;
+  #pragma omp atomic read
+  stop = stop_after;
+  if (chunk_index > stop)
+    return;
+
+  uint64_t searched = 0;
+  const char *ptr = chunk.data.begin;
+  while (ptr < chunk.data.end) {
+    auto lf_ptr = (const char *) memchr(ptr, '\n', chunk.data.end - ptr);
+    if (lf_ptr == nullptr) {
+      warnx("expected EOL not found at EOF in %s", filename);
+      break;
+    }
+    auto tab_ptr = (const char *) memchr(ptr, '\t', lf_ptr - ptr);
+    if (tab_ptr == nullptr) {
+      warnx("expected TAB not found in %s", filename);
+      break;
+    }
+    if (++searched % 65536 == 0) {
+      #pragma omp atomic read
+      stop = stop_after;
+      if (chunk_index > stop)
+        break;
+    }
+    auto target_idx = targets.Find(ptr, tab_ptr - ptr);
+    if (target_idx >= 0) {
+      // Taxid is the third field
+      const char *taxid = tab_ptr + 1;
+      tab_ptr = (const char *) memchr(taxid, '\t', lf_ptr - taxid);
+      if (tab_ptr != nullptr) {
+        taxid = tab_ptr + 1;
+        tab_ptr = (const char *) memchr(taxid, '\t', lf_ptr - taxid);
+      }
+      if (tab_ptr == nullptr) {
+        warnx("expected TAB not found in %s", filename);
+        break;
+      }
+      #pragma omp critical(record_match)
+      {
+        auto &target = targets.targets[target_idx];
+        if (target.match_chunk == SIZE_MAX)
+          found_ct++;
+        if (target.match_chunk > chunk_index ||
+            (target.match_chunk == chunk_index && target.match_line > ptr))
+        {
+          target.match_chunk = chunk_index;
+          target.match_line = ptr;
+          target.taxid = strtoull(taxid, nullptr, 10);
+        }
+        if (found_ct == targets.targets.size() && stop_after == SIZE_MAX) {
+          size_t last_match = 0;
+          for (auto &t : targets.targets)
+            last_match = std::max(last_match, t.match_chunk);
+          #pragma omp atomic write
+          stop_after = last_match;
+        }
+        stop = stop_after;
+      }
+      // No later line of this chunk can be an earlier match
+      if (stop <= chunk_index)
+        break;
+    }
+    ptr = lf_ptr + 1;
+  }
+
+  size_t found;
+  #pragma omp atomic read
+  found = found_ct;
+  #pragma omp critical(report_progress)
+  {
+    accessions_searched += searched;
+    if (isatty(fileno(stderr)))
+      ReportProgress(found, targets.targets.size(), accessions_searched);
+  }
+}
+
+// Looks up the targets not yet found; a target's record is its position in
+// the index
+void SearchIndex(const AccessionIndex &index, size_t chunk_index,
+    TargetSet &targets, size_t &found_ct, uint64_t &accessions_searched)
+{
+  size_t newly_found = 0;
+  #pragma omp parallel for schedule(dynamic, 1024) reduction(+:newly_found)
+  for (size_t i = 0; i < targets.targets.size(); i++) {
+    auto &target = targets.targets[i];
+    if (target.match_chunk != SIZE_MAX)
+      continue;
+    auto accession = targets.Accession(i);
+    auto record = index.Find(accession.data(), accession.size());
+    if (record == nullptr)
+      continue;
+    target.match_chunk = chunk_index;
+    target.match_line = record;
+    target.taxid = index.RecordTaxid(record);
+    newly_found++;
+  }
+  found_ct += newly_found;
+  accessions_searched += index.size();
+  if (isatty(fileno(stderr)))
+    ReportProgress(found_ct, targets.targets.size(), accessions_searched);
+}
+
+void ReportProgress(size_t found_ct, size_t target_ct, uint64_t searched) {
+  std::cerr << "\rFound " << found_ct << "/" << target_ct
+      << " targets, searched through " << searched << " accession IDs...";
+}
+
+void usage(int exit_code) {
+  std::cerr << "Usage: lookup_accession_numbers [-p threads] <lookup file> <accmaps>" << std::endl
+            << std::endl
+            << "Prints the taxid of each sequence ID in the lookup file (lines of" << std::endl
+            << "\"seqid<TAB>accession\"), from the first of the accession to taxid" << std::endl
+            << "map files to list its accession number.  Indexes made by" << std::endl
+            << "build_accession_index can be given in place of map files." << std::endl
+            << "Output is sorted by accession number." << std::endl;
+  exit(exit_code);
+}
@@ -0,0 +1,318 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#include "low_complexity.h"
+
+using std::string;
+using std::vector;
+
+namespace kraken2 {
+
+#define DUST_WORD_LEN 3
+#define DUST_WORD_CT (1 << (2 * DUST_WORD_LEN))
+#define SEG_ALPHABET_SIZE 20
+#define SEG_MAX_TRIM 100
+
+namespace {
+
+// A window suffix scoring above the threshold, which no part of scores
+// higher; starts are kept in decreasing order
+struct PerfectInterval {
+  long start, finish;
+  int r, l;
+};
+
+// State of the DUST scan over the current stretch of ACGT characters, named
+// as in the paper: the window's triplets, the score rw of the whole window
+// and rv of its suffix of the last L triplets (both counting repeated
+// triplet pairs), and the triplet counts behind those scores
+struct DustState {
+  int window, threshold;
+  std::deque<int> words;
+  int rw, rv, L;
+  int cw[DUST_WORD_CT], cv[DUST_WORD_CT];
+  vector<PerfectInterval> perfect;
+  vector<MaskInterval> *intervals;
+
+  void Reset() {
+    words.clear();
+    rw = rv = L = 0;
+    std::fill(cw, cw + DUST_WORD_CT, 0);
+    std::fill(cv, cv + DUST_WORD_CT, 0);
+  }
+
+  void ShiftWindow(int t) {
+    if ((int) words.size() >= window - DUST_WORD_LEN + 1) {
+      int s = words.front();
+      words.pop_front();
+      rw -= --cw[s];
+      if (L > (int) words.size()) {
+        --L;
+        rv -= --cv[s];
+      }
+    }
+    words.push_back(t);
+    ++L;
+    rw += cw[t]++;
+    rv += cv[t]++;
+    // Shrink the suffix until its newest triplet no longer repeats too often
+    if (cv[t] * 10 > threshold * 2) {
+      int s;
+      do {
+        s = words[words.size() - L];
+        rv -= --cv[s];
+        --L;
+      } while (s != t);
+    }
+  }
+
+  // Saves the leftmost perfect interval once the window has moved past
+  // where it starts
+  void SaveMaskedRegions(long start) {
+    if (perfect.empty() || perfect.back().start >= start)
+      return;
+    auto &p = perfect.back();
+    if (! intervals->empty() && p.start <= (long) intervals->back().second) {
+      if ((long) intervals->back().second < p.finish)
+        intervals->back().second = p.finish;
+    }
+    else {
+      intervals->emplace_back(p.start, p.finish);
+    }
+    while (! perfect.empty() && perfect.back().start < start)
+      perfect.pop_back();
+  }
+
+  void FindPerfect(long start) {
+    int c[DUST_WORD_CT];
+    std::copy(cv, cv + DUST_WORD_CT, c);
+    int r = rv, max_r = 0, max_l = 0;
+    for (long i = (long) words.size() - L - 1; i >= 0; --i) {
+      int t = words[i];
+      r += c[t]++;
+      int new_r = r, new_l = words.size() - i - 1;
+      if (new_r * 10 <= threshold * new_l)
+        continue;
+      size_t j;
+      for (j = 0; j < perfect.size() && perfect[j].start >= i + start; ++j) {
+        auto &p = perfect[j];
+        if (max_r == 0 || p.r * max_l > max_r * p.l) {
+          max_r = p.r;
+          max_l = p.l;
+        }
+      }
+      if (max_r == 0 || new_r * max_l >= max_r * new_l) {
+        max_r = new_r;
+        max_l = new_l;
+        PerfectInterval p = { i + start,
+          (long) words.size() + DUST_WORD_LEN - 1 + start, new_r, new_l };
+        perfect.insert(perfect.begin() + j, p);
+      }
+    }
+  }
+};
+
+int NucleotideCode(char c) {
+  switch (c) {
+    case 'A' : case 'a' : return 0;
+    case 'C' : case 'c' : return 1;
+    case 'G' : case 'g' : return 2;
+    case 'T' : case 't' : return 3;
+    default : return 4;
+  }
+}
+
+int ResidueCode(char c) {
+  static const char *alphabet = "ACDEFGHIKLMNPQRSTVWY";
+  const char *p = strchr(alphabet, toupper(c));
+  return c != '\0' && p != nullptr ? p - alphabet : -1;
+}
+
+}  // namespace
+
+void DustIntervals(const string &seq, int window, int threshold,
+    vector<MaskInterval> &intervals)
+{
+  DustState state;
+  state.window = window;
+  state.threshold = threshold;
+  state.intervals = &intervals;
+  state.Reset();
+  intervals.clear();
+
+  long len = seq.size(), l = 0;
+  int t = 0;
+  for (long i = 0; i <= len; i++) {
+    int b = i < len ? NucleotideCode(seq[i]) : 4;
+    if (b < 4) {
+      ++l;
+      t = ((t << 2) | b) & (DUST_WORD_CT - 1);
+      if (l >= DUST_WORD_LEN) {
+        long start = (l - window > 0 ? l - window : 0) + (i + 1 - l);
+        state.SaveMaskedRegions(start);
+        state.ShiftWindow(t);
+        if (state.rw * 10 > state.L * threshold)
+          state.FindPerfect(start);
+      }
+    }
+    else {
+      long start = (l - window + 1 > 0 ? l - window + 1 : 0) + (i + 1 - l);
+      while (! state.perfect.empty())
+        state.SaveMaskedRegions(start++);
+      state.Reset();
+      l = t = 0;
+    }
+  }
+}
+
+// Shannon entropy (bits) of each window of residue codes in
+// [begin, begin + len), indexed by window center; -1 where not scored
+static void WindowEntropies(const vector<int> &codes, size_t begin,
+    long len, int window, vector<double> &entropies)
+{
+  int downset = (window + 1) / 2 - 1;
+  entropies.assign(len, -1);
+  int counts[SEG_ALPHABET_SIZE] = { 0 };
+  int invalid = 0;
+  for (long i = 0; i < len; i++) {
+    int code = codes[begin + i];
+    if (code < 0) invalid++; else counts[code]++;
+    if (i >= window) {
+      code = codes[begin + i - window];
+      if (code < 0) invalid--; else counts[code]--;
+    }
+    if (i < window - 1 || invalid)
+      continue;
+    double entropy = 0;
+    for (int c = 0; c < SEG_ALPHABET_SIZE; c++) {
+      if (counts[c]) {
+        double freq = (double) counts[c] / window;
+        entropy -= freq * log2(freq);
+      }
+    }
+    entropies[i - window + 1 + downset] = entropy;
+  }
+}
+
+// Natural log of the probability of a composition of len residues: the
+// number of sequences with compositions of the same shape, over 20^len
+static double CompositionLnProbability(const int *counts, int len,
+    const vector<double> &lnfac)
+{
+  int sorted[SEG_ALPHABET_SIZE];
+  std::copy(counts, counts + SEG_ALPHABET_SIZE, sorted);
+  std::sort(sorted, sorted + SEG_ALPHABET_SIZE);
+  double ln_assignments = lnfac[SEG_ALPHABET_SIZE];
+  double ln_permutations = lnfac[len];
+  int class_size = 1;
+  for (int i = 0; i < SEG_ALPHABET_SIZE; i++) {
+    ln_permutations -= lnfac[sorted[i]];
+    if (i + 1 < SEG_ALPHABET_SIZE && sorted[i + 1] == sorted[i]) {
+      class_size++;
+    }
+    else {
+      ln_assignments -= lnfac[class_size];
+      class_size = 1;
+    }
+  }
+  return ln_assignments + ln_permutations - len * log(SEG_ALPHABET_SIZE);
+}
+
+// Narrows the closed range [*left, *right] to its least probable
+// subrange, trimming at most SEG_MAX_TRIM residues in all
+static void TrimSegment(const vector<int> &codes, long *left, long *right) {
+  long len = *right - *left + 1;
+  long min_len = 1;
+  if (len - SEG_MAX_TRIM > min_len)
+    min_len = len - SEG_MAX_TRIM;
+  vector<double> lnfac(len + 1, 0);
+  for (long i = 2; i <= len; i++)
+    lnfac[i] = lnfac[i - 1] + log(i);
+
+  double min_prob = 1.0;
+  long best_left = 0, best_right = len - 1;
+  for (long wlen = len; wlen > min_len; wlen--) {
+    int counts[SEG_ALPHABET_SIZE] = { 0 };
+    for (long i = 0; i < wlen; i++)
+      counts[codes[*left + i]]++;
+    for (long i = 0; ; i++) {
+      double prob = CompositionLnProbability(counts, wlen, lnfac);
+      if (prob < min_prob) {
+        min_prob = prob;
+        best_left = i;
+        best_right = i + wlen - 1;
+      }
+      if (i + wlen >= len)
+        break;
+      counts[codes[*left + i]]--;
+      counts[codes[*left + i + wlen]]++;
+    }
+  }
+  *right = *left + best_right;
+  *left += best_left;
+}
+
+static void SegRange(const vector<int> &codes, size_t begin, size_t end,
+    int window, double locut, double hicut, vector<MaskInterval> &intervals)
+{
+  long len = end - begin;
+  if (len < window)
+    return;
+  vector<double> entropies;
+  WindowEntropies(codes, begin, len, window, entropies);
+  int downset = (window + 1) / 2 - 1;
+  int upset = window - downset;
+  long last = len - upset;
+  long low_limit = downset;
+
+  for (long i = downset; i <= last; i++) {
+    if (entropies[i] < 0 || entropies[i] > locut)
+      continue;
+    // Extend the trigger window over neighbors below the high cutoff
+    long lo = i, hi = i;
+    while (lo > low_limit && entropies[lo - 1] >= 0
+           && entropies[lo - 1] <= hicut)
+      lo--;
+    while (hi < last && entropies[hi + 1] >= 0 && entropies[hi + 1] <= hicut)
+      hi++;
+    long left = begin + lo - downset, right = begin + hi + upset - 1;
+    TrimSegment(codes, &left, &right);
+    left -= begin;
+    right -= begin;
+    if (i + upset - 1 < left) {
+      // The trimmed-off left part holds a trigger window of its own
+      SegRange(codes, begin + lo - downset, begin + left, window, locut,
+               hicut, intervals);
+    }
+    intervals.emplace_back(begin + left, begin + right + 1);
+    i = std::min(hi, right + downset);
+    low_limit = i + 1;
+  }
+}
+
+void SegIntervals(const string &seq, int window, double locut,
+    double hicut, vector<MaskInterval> &intervals)
+{
+  intervals.clear();
+  vector<int> codes(seq.size());
+  for (size_t i = 0; i < seq.size(); i++)
+    codes[i] = ResidueCode(seq[i]);
+  SegRange(codes, 0, codes.size(), window, locut, hicut, intervals);
+
+  // Merge overlapping and adjacent segments
+  std::sort(intervals.begin(), intervals.end());
+  size_t merged = 0;
+  for (size_t i = 0; i < intervals.size(); i++) {
+    if (merged > 0 && intervals[i].first <= intervals[merged - 1].second)
+      intervals[merged - 1].second = std::max(intervals[merged - 1].second,
+                                              intervals[i].second);
+    else
+      intervals[merged++] = intervals[i];
+  }
+  intervals.resize(merged);
+}
+
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#ifndef KRAKEN2_LOW_COMPLEXITY_H_
+#define KRAKEN2_LOW_COMPLEXITY_H_
+
+#include "kraken2_headers.h"
+
+namespace kraken2 {
+
+// Half-open range [first, second) of sequence positions
+typedef std::pair<size_t, size_t> MaskInterval;
+
+#define DEFAULT_DUST_WINDOW 64
+#define DEFAULT_DUST_THRESHOLD 20
+#define DEFAULT_SEG_WINDOW 12
+#define DEFAULT_SEG_LOCUT 2.2
+#define DEFAULT_SEG_HICUT 2.5
+
+// Finds low-complexity regions of a nucleotide sequence with the symmetric
+// DUST algorithm (Morgulis et al., 2006), as used by NCBI's dustmasker.
+// Non-ACGT characters split the sequence into independently scored pieces.
+void DustIntervals(const std::string &seq, int window, int threshold,
+    std::vector<MaskInterval> &intervals);
+
+// Finds low-complexity regions of a protein sequence with the SEG algorithm
+// (Wootton & Federhen, 1993), as used by NCBI's segmasker.  Windows that
+// contain residues other than the 20 standard amino acids aren't scored.
+void SegIntervals(const std::string &seq, int window, double locut,
+    double hicut, std::vector<MaskInterval> &intervals);
+
+}
+
+#endif
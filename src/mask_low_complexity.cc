@@ -0,0 +1,280 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#include "kraken2_headers.h"
+#include "seqreader.h"
+#include "library_reader.h"
+#include "compression.h"
+#include "low_complexity.h"
+
+using std::string;
+using std::cerr;
+using std::endl;
+using std::vector;
+using namespace kraken2;
+
+#define DEFAULT_BLOCK_SIZE (16 * 1024 * 1024)
+#define FASTA_LINE_WIDTH 60
+#define MASK_CHARACTER 'x'
+
+struct Options {
+  bool input_is_protein;
+  int threads;
+  size_t block_size;
+  int window;
+  int dust_threshold;
+  double seg_locut;
+  double seg_hicut;
+  vector<string> filenames;
+};
+
+// Masked copy of one library file, written beside it until complete
+struct MaskedFile {
+  string filename;
+  string temp_filename;
+  FILE *fp;
+  CompressionType compression;
+};
+
+void ParseCommandLine(int argc, char **argv, Options &opts);
+void usage(int exit_code = EX_USAGE);
+void MaskFiles(Options &opts);
+void MaskSequence(const Sequence &seq, const Options &opts,
+    vector<MaskInterval> &intervals, string &out);
+CompressionType OutputCompression(const string &filename);
+void OpenMaskedFile(MaskedFile &file, const string &filename);
+void CloseMaskedFile(MaskedFile &file);
+
+int main(int argc, char **argv) {
+  Options opts;
+  opts.input_is_protein = false;
+  opts.threads = 1;
+  opts.block_size = DEFAULT_BLOCK_SIZE;
+  opts.window = 0;
+  opts.dust_threshold = DEFAULT_DUST_THRESHOLD;
+  opts.seg_locut = DEFAULT_SEG_LOCUT;
+  opts.seg_hicut = DEFAULT_SEG_HICUT;
+  ParseCommandLine(argc, argv, opts);
+  omp_set_num_threads(opts.threads);
+  MaskFiles(opts);
+  return 0;
+}
+
+// Files are read ahead concurrently, and the sequences of all blocks read
+// in one pass are masked in parallel, then written out in file order.
+// Each file is replaced by its masked copy once its last block is written.
+void MaskFiles(Options &opts) {
+  OrderedLibraryReader library(opts.filenames, opts.threads);
+  vector<LibraryBlock> blocks;
+  vector<Sequence> sequences;
+  vector<size_t> block_ends;
+  vector<string> outputs;
+  MaskedFile output;
+  output.fp = nullptr;
+  size_t output_index = 0;
+  size_t seq_ct = 0, masked_ct = 0;
+
+  while (library.LoadBlocks(opts.block_size, blocks)) {
+    size_t loaded_ct = 0;
+    block_ends.clear();
+    for (auto &block : blocks) {
+      while (true) {
+        if (loaded_ct == sequences.size())
+          sequences.emplace_back();
+        if (! block.reader->NextSequence(sequences[loaded_ct]))
+          break;
+        if (sequences[loaded_ct].format != FORMAT_FASTA)
+          errx(EX_DATAERR, "%s: only FASTA files can be masked",
+               opts.filenames[block.file_index].c_str());
+        loaded_ct++;
+      }
+      block_ends.push_back(loaded_ct);
+    }
+    if (outputs.size() < loaded_ct)
+      outputs.resize(loaded_ct);
+
+    #pragma omp parallel
+    {
+      vector<MaskInterval> intervals;
+      string masked;
+      BlockCompressor compressor(COMPRESSION_BGZF);
+      #pragma omp for schedule(dynamic) reduction(+:masked_ct)
+      for (size_t i = 0; i < loaded_ct; i++) {
+        MaskSequence(sequences[i], opts, intervals, masked);
+        if (! intervals.empty())
+          masked_ct++;
+        auto block_idx = std::upper_bound(block_ends.begin(),
+                           block_ends.end(), i) - block_ends.begin();
+        outputs[i].clear();
+        if (OutputCompression(opts.filenames[blocks[block_idx].file_index])
+            == COMPRESSION_BGZF)
+          compressor.Compress(masked, outputs[i]);
+        else
+          outputs[i].swap(masked);
+      }
+    }
+    seq_ct += loaded_ct;
+
+    size_t seq_idx = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+      if (output.fp == nullptr || output_index != blocks[i].file_index) {
+        if (output.fp != nullptr)
+          CloseMaskedFile(output);
+        output_index = blocks[i].file_index;
+        OpenMaskedFile(output, opts.filenames[output_index]);
+      }
+      for (; seq_idx < block_ends[i]; seq_idx++) {
+        auto &data = outputs[seq_idx];
+        if (fwrite(data.data(), 1, data.size(), output.fp) != data.size())
+          err(EX_IOERR, "unable to write to %s", output.temp_filename.c_str());
+      }
+      if (blocks[i].end.file_index > output_index)
+        CloseMaskedFile(output);
+    }
+  }
+  if (output.fp != nullptr)
+    CloseMaskedFile(output);
+  cerr << "Masked low-complexity regions in " << masked_ct << " of "
+       << seq_ct << " sequences" << endl;
+}
+
+// Writes the sequence as FASTA with masked residues replaced, in the
+// layout dustmasker/segmasker use
+void MaskSequence(const Sequence &seq, const Options &opts,
+    vector<MaskInterval> &intervals, string &out)
+{
+  if (opts.input_is_protein)
+    SegIntervals(seq.seq, opts.window ? opts.window : DEFAULT_SEG_WINDOW,
+                 opts.seg_locut, opts.seg_hicut, intervals);
+  else
+    DustIntervals(seq.seq, opts.window ? opts.window : DEFAULT_DUST_WINDOW,
+                  opts.dust_threshold, intervals);
+
+  out.assign(seq.header);
+  out.push_back('\n');
+  auto interval = intervals.begin();
+  for (size_t i = 0; i < seq.seq.size(); i++) {
+    while (interval != intervals.end() && interval->second <= i)
+      ++interval;
+    if (interval != intervals.end() && interval->first <= i)
+      out.push_back(MASK_CHARACTER);
+    else
+      out.push_back(toupper(seq.seq[i]));
+    if ((i + 1) % FASTA_LINE_WIDTH == 0 || i + 1 == seq.seq.size())
+      out.push_back('\n');
+  }
+}
+
+// Gzipped files stay gzipped (as BGZF, so threads can compress their own
+// sequences); everything else is written uncompressed
+CompressionType OutputCompression(const string &filename) {
+  return CompressionTypeForFilename(filename) == COMPRESSION_BGZF
+         ? COMPRESSION_BGZF : COMPRESSION_NONE;
+}
+
+void OpenMaskedFile(MaskedFile &file, const string &filename) {
+  file.filename = filename;
+  file.compression = OutputCompression(filename);
+  if (filename == "-") {
+    file.temp_filename = "standard output";
+    file.fp = stdout;
+    return;
+  }
+  file.temp_filename = filename + ".tmp";
+  file.fp = fopen(file.temp_filename.c_str(), "wb");
+  if (file.fp == nullptr)
+    err(EX_CANTCREAT, "unable to create %s", file.temp_filename.c_str());
+}
+
+void CloseMaskedFile(MaskedFile &file) {
+  auto end_marker = CompressionEndMarker(file.compression);
+  if (fwrite(end_marker.data(), 1, end_marker.size(), file.fp)
+      != end_marker.size() || fflush(file.fp) != 0)
+    err(EX_IOERR, "unable to write to %s", file.temp_filename.c_str());
+  if (file.fp != stdout) {
+    if (fclose(file.fp) != 0)
+      err(EX_IOERR, "unable to write to %s", file.temp_filename.c_str());
+    if (rename(file.temp_filename.c_str(), file.filename.c_str()) < 0)
+      err(EX_CANTCREAT, "unable to replace %s", file.filename.c_str());
+  }
+  file.fp = nullptr;
+}
+
+void ParseCommandLine(int argc, char **argv, Options &opts) {
+  int opt;
+  long long sig;
+
+  while ((opt = getopt(argc, argv, "?hXp:B:W:T:L:U:")) != -1) {
+    switch (opt) {
+      case 'h' : case '?' :
+        usage(0);
+        break;
+      case 'X' :
+        opts.input_is_protein = true;
+        break;
+      case 'p' :
+        sig = atoll(optarg);
+        if (sig < 1)
+          errx(EX_USAGE, "must have at least 1 thread");
+        opts.threads = sig;
+        break;
+      case 'B' :
+        sig = atoll(optarg);
+        if (sig < 1)
+          errx(EX_USAGE, "block size must be positive");
+        opts.block_size = sig;
+        break;
+      case 'W' :
+        sig = atoll(optarg);
+        if (sig < 4)
+          errx(EX_USAGE, "window length must be at least 4");
+        opts.window = sig;
+        break;
+      case 'T' :
+        sig = atoll(optarg);
+        if (sig < 1)
+          errx(EX_USAGE, "DUST threshold must be positive");
+        opts.dust_threshold = sig;
+        break;
+      case 'L' :
+        opts.seg_locut = atof(optarg);
+        break;
+      case 'U' :
+        opts.seg_hicut = atof(optarg);
+        break;
+    }
+  }
+
+  if (opts.seg_hicut < opts.seg_locut)
+    errx(EX_USAGE, "SEG high cutoff can't be less than low cutoff");
+  vector<string> paths(argv + optind, argv + argc);
+  if (paths.empty())
+    paths.push_back("-");
+  opts.filenames = ListLibraryFiles(paths);
+  if (opts.filenames.empty())
+    errx(EX_NOINPUT, "no library files found");
+}
+
+void usage(int exit_code) {
+  cerr << "Usage: mask_low_complexity <options> [library files/directories]" << endl
+       << endl
+       << "Masks low-complexity regions of the sequences in the given FASTA" << endl
+       << "files, which may be gzipped, and in the .fna/.faa files found in" << endl
+       << "the given directories, replacing each file with its masked copy." << endl
+       << "Reads standard input and writes standard output if no files are" << endl
+       << "given.  Nucleotide sequences are masked with DUST, proteins with SEG." << endl
+       << endl
+       << "Options:" << endl
+       << "  -X            Input sequences are proteins" << endl
+       << "  -W INT        Window length (def: " << DEFAULT_DUST_WINDOW
+                           << " for DUST, " << DEFAULT_SEG_WINDOW << " for SEG)" << endl
+       << "  -T INT        DUST score threshold (def: " << DEFAULT_DUST_THRESHOLD << ")" << endl
+       << "  -L FLOAT      SEG low entropy cutoff (def: " << DEFAULT_SEG_LOCUT << ")" << endl
+       << "  -U FLOAT      SEG high entropy cutoff (def: " << DEFAULT_SEG_HICUT << ")" << endl
+       << "  -B INT        Read block size" << endl
+       << "  -p INT        Number of threads" << endl;
+  exit(exit_code);
+}
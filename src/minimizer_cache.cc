@@ -0,0 +1,190 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#include "minimizer_cache.h"
+
+using std::string;
+using std::vector;
+
+namespace kraken2 {
+
+// FNV-1a
+static uint64_t HashBytes(const char *data, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= (unsigned char) data[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+string MinimizerCacheFilename(const string &cache_directory,
+    const string &library_filename, MinimizerCacheKey &key)
+{
+  struct stat sb;
+  if (stat(library_filename.c_str(), &sb) < 0)
+    err(EX_NOINPUT, "unable to stat %s", library_filename.c_str());
+  if (! S_ISREG(sb.st_mode))
+    errx(EX_USAGE, "can't cache minimizers of %s, not a regular file",
+         library_filename.c_str());
+  char *path = realpath(library_filename.c_str(), nullptr);
+  if (path == nullptr)
+    err(EX_NOINPUT, "unable to resolve %s", library_filename.c_str());
+  key.path_hash = HashBytes(path, strlen(path));
+  free(path);
+  key.file_size = sb.st_size;
+  key.file_mtime = sb.st_mtime;
+
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.k2m",
+           (unsigned long long) HashBytes((const char *) &key, sizeof(key)));
+  return cache_directory + "/" + name;
+}
+
+static bool ReadCacheHeader(std::istream &is, const MinimizerCacheKey &key) {
+  char magic[8];
+  MinimizerCacheKey file_key;
+  is.read(magic, sizeof(magic));
+  is.read((char *) &file_key, sizeof(file_key));
+  return is && memcmp(magic, MinimizerCacheWriter::FILE_MAGIC,
+                      sizeof(magic)) == 0
+         && memcmp(&file_key, &key, sizeof(key)) == 0;
+}
+
+bool IsMinimizerCacheFile(const string &filename,
+    const MinimizerCacheKey &key)
+{
+  std::ifstream ifs(filename, std::ifstream::binary);
+  return ReadCacheHeader(ifs, key);
+}
+
+void EncodeCachedSequence(string &data, const string &header,
+    uint64_t char_ct, const uint64_t *minimizers,
+    const uint32_t *block_indexes, size_t count)
+{
+  string minimizer_data;
+  uint64_t last = 0;
+  for (size_t i = 0; i < count; i++) {
+    AppendVarint(minimizer_data, minimizers[i] - last);
+    last = minimizers[i];
+    if (block_indexes != nullptr)
+      AppendVarint(minimizer_data, block_indexes[i]);
+  }
+  AppendVarint(data, header.size());
+  data.append(header);
+  AppendVarint(data, char_ct);
+  AppendVarint(data, (count << 1) | (block_indexes != nullptr));
+  AppendVarint(data, minimizer_data.size());
+  data.append(minimizer_data);
+}
+
+const char *DecodeCachedSequence(const char *ptr, CachedSequence &seq) {
+  auto header_len = ReadVarint(ptr);
+  seq.header.assign(ptr, header_len);
+  ptr += header_len;
+  seq.char_ct = ReadVarint(ptr);
+  auto count = ReadVarint(ptr);
+  seq.minimizer_ct = count >> 1;
+  seq.has_block_indexes = count & 1;
+  auto minimizer_data_size = ReadVarint(ptr);
+  seq.minimizer_data = ptr;
+  return ptr + minimizer_data_size;
+}
+
+constexpr const char *MinimizerCacheWriter::FILE_MAGIC;
+
+MinimizerCacheWriter::MinimizerCacheWriter(const string &filename,
+    const MinimizerCacheKey &key)
+    : filename_(filename),
+      temp_filename_(filename + ".tmp" + std::to_string(getpid()))
+{
+  fp_ = fopen(temp_filename_.c_str(), "wb");
+  if (fp_ == nullptr)
+    err(EX_CANTCREAT, "unable to create %s", temp_filename_.c_str());
+  if (fwrite(FILE_MAGIC, 1, strlen(FILE_MAGIC), fp_) != strlen(FILE_MAGIC)
+      || fwrite(&key, sizeof(key), 1, fp_) != 1)
+    err(EX_IOERR, "unable to write %s", temp_filename_.c_str());
+}
+
+// An unfinished cache is removed
+MinimizerCacheWriter::~MinimizerCacheWriter() {
+  if (fp_ != nullptr) {
+    fclose(fp_);
+    unlink(temp_filename_.c_str());
+  }
+}
+
+void MinimizerCacheWriter::AddBlock(uint64_t size, uint64_t end_offset,
+    uint64_t seq_ct, const string &data)
+{
+  uint64_t header[4] = { size, end_offset, seq_ct, data.size() };
+  if (fwrite(header, sizeof(header), 1, fp_) != 1
+      || fwrite(data.data(), 1, data.size(), fp_) != data.size())
+    err(EX_IOERR, "unable to write %s", temp_filename_.c_str());
+}
+
+void MinimizerCacheWriter::Finish() {
+  int result = fclose(fp_);
+  fp_ = nullptr;
+  if (result != 0)
+    err(EX_IOERR, "unable to write %s", temp_filename_.c_str());
+  if (rename(temp_filename_.c_str(), filename_.c_str()) < 0)
+    err(EX_CANTCREAT, "unable to create %s", filename_.c_str());
+}
+
+MinimizerCacheReader::MinimizerCacheReader(const vector<string> &filenames,
+    const vector<MinimizerCacheKey> &keys, LibraryPosition start)
+    : filenames_(filenames), keys_(keys), start_(start),
+      file_index_(start.file_index)
+{ }
+
+bool MinimizerCacheReader::NextBlock(CachedBlock &block) {
+  while (file_index_ < filenames_.size()) {
+    if (! file_.is_open()) {
+      auto &filename = filenames_[file_index_];
+      file_.open(filename, std::ifstream::binary);
+      if (! ReadCacheHeader(file_, keys_[file_index_]))
+        errx(EX_DATAERR, "minimizer cache file %s is missing or out of date",
+             filename.c_str());
+    }
+    if (ReadBlock(block))
+      return true;
+    file_.close();
+    file_index_++;
+  }
+  return false;
+}
+
+// Reads the open file's next block after the start position, returning
+// false at end of file
+bool MinimizerCacheReader::ReadBlock(CachedBlock &block) {
+  auto &filename = filenames_[file_index_];
+  uint64_t header[4];
+  while (file_.read((char *) header, sizeof(header))) {
+    block.size = header[0];
+    if (header[1] == 0)
+      block.end = LibraryPosition{file_index_ + 1, 0};
+    else
+      block.end = LibraryPosition{file_index_, header[1]};
+    block.seq_ct = header[2];
+    if (block.end.file_index == start_.file_index
+        && block.end.offset <= start_.offset)
+    {
+      if (! file_.seekg(header[3], std::ios::cur))
+        errx(EX_DATAERR, "malformed minimizer cache file %s", filename.c_str());
+      continue;
+    }
+    block.data.resize(header[3]);
+    if (! file_.read(&block.data[0], header[3]))
+      errx(EX_DATAERR, "malformed minimizer cache file %s", filename.c_str());
+    return true;
+  }
+  if (file_.gcount() != 0)
+    errx(EX_DATAERR, "malformed minimizer cache file %s", filename.c_str());
+  return false;
+}
+
+}
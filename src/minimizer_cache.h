@@ -0,0 +1,162 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#ifndef KRAKEN2_MINIMIZER_CACHE_H_
+#define KRAKEN2_MINIMIZER_CACHE_H_
+
+#include "kraken2_headers.h"
+#include "library_reader.h"
+
+namespace kraken2 {
+
+/**
+ Per library file caches of the minimizers build_db finds, so that later
+ builds with the same scanning settings needn't read and scan the file.
+
+ A cache file holds the magic string and its key, then the blocks the
+ library file was read in.  Each block is its input size, where the input
+ after it starts (0 for the file's last block), its sequence count and data
+ size as uint64_t, then the data: for each sequence, as varints, the header
+ length, the header, the sequence length, the minimizer count (shifted left
+ one bit, with the low bit set if block indexes follow the minimizers) and
+ the size of the minimizer data.  The minimizer data holds the sequence's
+ distinct minimizers in sorted order, delta encoded as varints, each one
+ followed by the index of the sequence block it first occurs in if the
+ sequence has more than one block.  Minimizers aren't subsampled.
+ **/
+
+// What a library file's cached minimizers depend on.  The file is
+// identified by its path, size and modification time.
+struct MinimizerCacheKey {
+  uint64_t path_hash;
+  uint64_t file_size;
+  uint64_t file_mtime;
+  uint64_t k;
+  uint64_t l;
+  uint64_t spaced_seed_mask;
+  uint64_t toggle_mask;
+  uint64_t dna_db;
+  uint64_t block_size;       // sequence block size
+  uint64_t read_block_size;  // size of the blocks the file is read in
+};
+
+// Fills in the key's file identity and returns the name of the file's
+// cache in cache_directory
+std::string MinimizerCacheFilename(const std::string &cache_directory,
+    const std::string &library_filename, MinimizerCacheKey &key);
+
+// Whether filename is a complete cache file made with key
+bool IsMinimizerCacheFile(const std::string &filename,
+    const MinimizerCacheKey &key);
+
+// A block of a cached library file
+struct CachedBlock {
+  uint64_t size;        // bytes of input
+  LibraryPosition end;  // where the input after the block starts
+  uint64_t seq_ct;
+  std::string data;
+};
+
+// A sequence in a cached block's data; minimizer_data points into the block
+struct CachedSequence {
+  std::string header;
+  uint64_t char_ct;
+  uint64_t minimizer_ct;
+  bool has_block_indexes;
+  const char *minimizer_data;
+};
+
+inline void AppendVarint(std::string &data, uint64_t value) {
+  while (value >= 0x80) {
+    data.push_back((char) (value | 0x80));
+    value >>= 7;
+  }
+  data.push_back((char) value);
+}
+
+inline uint64_t ReadVarint(const char *&ptr) {
+  uint64_t value = 0;
+  int shift = 0;
+  while (*ptr & 0x80) {
+    value |= (uint64_t) (*ptr++ & 0x7f) << shift;
+    shift += 7;
+  }
+  value |= (uint64_t) (unsigned char) *ptr++ << shift;
+  return value;
+}
+
+// Appends a sequence to a cached block's data.  The minimizers must be
+// sorted and distinct; block_indexes gives the sequence block each first
+// occurs in, and is nullptr if the sequence has one block.
+void EncodeCachedSequence(std::string &data, const std::string &header,
+    uint64_t char_ct, const uint64_t *minimizers,
+    const uint32_t *block_indexes, size_t count);
+// Reads the sequence at ptr, returning the start of the next one
+const char *DecodeCachedSequence(const char *ptr, CachedSequence &seq);
+
+// Calls fn(minimizer, block_index) for each of a sequence's minimizers
+template <typename F>
+void ForEachCachedMinimizer(const CachedSequence &seq, F fn) {
+  const char *ptr = seq.minimizer_data;
+  uint64_t minimizer = 0;
+  uint32_t block_index = 0;
+  for (uint64_t i = 0; i < seq.minimizer_ct; i++) {
+    minimizer += ReadVarint(ptr);
+    if (seq.has_block_indexes)
+      block_index = ReadVarint(ptr);
+    fn(minimizer, block_index);
+  }
+}
+
+// Writes a cache file, under a temporary name until Finish() is called
+class MinimizerCacheWriter {
+  public:
+  MinimizerCacheWriter(const std::string &filename,
+      const MinimizerCacheKey &key);
+  ~MinimizerCacheWriter();
+  MinimizerCacheWriter(const MinimizerCacheWriter &rhs) = delete;
+  MinimizerCacheWriter& operator=(const MinimizerCacheWriter &rhs) = delete;
+
+  // end_offset is 0 for the file's last block
+  void AddBlock(uint64_t size, uint64_t end_offset, uint64_t seq_ct,
+      const std::string &data);
+  void Finish();
+
+  static constexpr const char *FILE_MAGIC = "K2MMCACH";
+
+  private:
+  std::string filename_;
+  std::string temp_filename_;
+  FILE *fp_;
+};
+
+// Hands out the blocks of a list of cache files (one per library file) in
+// order, starting from a position in the library, as OrderedLibraryReader
+// would for the library files themselves.  Only one file is open at once.
+class MinimizerCacheReader {
+  public:
+  MinimizerCacheReader(const std::vector<std::string> &filenames,
+      const std::vector<MinimizerCacheKey> &keys,
+      LibraryPosition start = LibraryPosition{0, 0});
+  MinimizerCacheReader(const MinimizerCacheReader &rhs) = delete;
+  MinimizerCacheReader& operator=(const MinimizerCacheReader &rhs) = delete;
+
+  // Returns false once all files have been read
+  bool NextBlock(CachedBlock &block);
+
+  private:
+  bool ReadBlock(CachedBlock &block);
+
+  std::vector<std::string> filenames_;
+  std::vector<MinimizerCacheKey> keys_;
+  LibraryPosition start_;
+  size_t file_index_;
+  std::ifstream file_;
+};
+
+}
+
+#endif
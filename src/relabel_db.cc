@@ -0,0 +1,270 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#include "kraken2_headers.h"
+#include "taxonomy.h"
+#include "mmap_file.h"
+#include "kraken2_data.h"
+
+using namespace kraken2;
+using std::string;
+using std::vector;
+using std::unordered_map;
+using std::unordered_set;
+
+#define CHUNK_CELLS (16 * 1024 * 1024)
+
+struct Options {
+  int threads;
+  string ncbi_taxonomy_directory;
+  string hash_filename;
+  string taxonomy_filename;
+  string new_hash_filename;
+  string new_taxonomy_filename;
+};
+
+void ParseCommandLine(int argc, char **argv, Options &opts);
+void usage(int exit_code = EX_USAGE);
+void ReadMergedTaxa(const string &filename,
+    unordered_map<uint64_t, uint64_t> &merged);
+void ReadDeletedTaxa(const string &filename, unordered_set<uint64_t> &deleted);
+vector<taxid_t> RelabelTaxonomy(const Options &opts);
+void RelabelTable(const Options &opts, const vector<taxid_t> &value_map,
+    size_t min_value_bits);
+
+int main(int argc, char **argv) {
+  Options opts;
+  opts.threads = 1;
+  ParseCommandLine(argc, argv, opts);
+  omp_set_num_threads(opts.threads);
+
+  auto value_map = RelabelTaxonomy(opts);
+  Taxonomy new_taxonomy(opts.new_taxonomy_filename);
+  size_t bits_needed_for_value = 1;
+  while ((1 << bits_needed_for_value) < (ssize_t) new_taxonomy.node_count())
+    bits_needed_for_value++;
+  RelabelTable(opts, value_map, bits_needed_for_value);
+  return 0;
+}
+
+// Lines are "old taxid<TAB>|<TAB>new taxid<TAB>|"
+void ReadMergedTaxa(const string &filename,
+    unordered_map<uint64_t, uint64_t> &merged)
+{
+  std::ifstream ifs(filename);
+  if (! ifs)
+    return;
+  string line;
+  while (getline(ifs, line)) {
+    auto sep = line.find('|');
+    if (sep == string::npos)
+      errx(EX_DATAERR, "malformed line in %s", filename.c_str());
+    merged[strtoull(line.c_str(), nullptr, 10)] =
+      strtoull(line.c_str() + sep + 1, nullptr, 10);
+  }
+}
+
+void ReadDeletedTaxa(const string &filename, unordered_set<uint64_t> &deleted)
+{
+  std::ifstream ifs(filename);
+  if (! ifs)
+    return;
+  string line;
+  while (getline(ifs, line))
+    deleted.insert(strtoull(line.c_str(), nullptr, 10));
+}
+
+// Writes the new Kraken taxonomy and returns the new value of each old
+// internal ID.  Old taxa are followed through merged.dmp; those that are
+// gone from the new taxonomy take their nearest surviving ancestor's
+// place.  As taxa may have moved, each old value becomes the LCA, in the
+// new taxonomy, of its whole old subtree, which covers every genome that
+// could have given a minimizer that value.
+vector<taxid_t> RelabelTaxonomy(const Options &opts) {
+  Taxonomy old_taxonomy(opts.taxonomy_filename);
+  auto old_nodes = old_taxonomy.nodes();
+  size_t old_node_ct = old_taxonomy.node_count();
+  if (old_node_ct < 2)
+    errx(EX_DATAERR, "%s has no taxa", opts.taxonomy_filename.c_str());
+
+  unordered_map<uint64_t, uint64_t> merged;
+  unordered_set<uint64_t> deleted;
+  ReadMergedTaxa(opts.ncbi_taxonomy_directory + "/merged.dmp", merged);
+  ReadDeletedTaxa(opts.ncbi_taxonomy_directory + "/delnodes.dmp", deleted);
+  auto ncbi_taxonomy = LoadNCBITaxonomy(opts.ncbi_taxonomy_directory);
+
+  // Internal IDs are assigned breadth first, so parents come first
+  vector<uint64_t> new_external_ids(old_node_ct, 0);
+  size_t merged_ct = 0, deleted_ct = 0, unlisted_ct = 0, unrooted_ct = 0;
+  for (size_t i = 1; i < old_node_ct; i++) {
+    auto &node = old_nodes[i];
+    if (i > 1 && node.parent_id == 0) {
+      // Space held for a taxid that wasn't in the old taxonomy
+      new_external_ids[i] = new_external_ids[1];
+      unrooted_ct++;
+      continue;
+    }
+    uint64_t taxid = node.external_id;
+    for (size_t steps = 0; steps < merged.size() && merged.count(taxid); steps++)
+      taxid = merged[taxid];
+    if (ncbi_taxonomy->HasNode(taxid)) {
+      new_external_ids[i] = taxid;
+      if (taxid != node.external_id)
+        merged_ct++;
+      continue;
+    }
+    if (i == 1)
+      errx(EX_DATAERR, "root taxon %llu not in new taxonomy",
+           (unsigned long long) node.external_id);
+    new_external_ids[i] = new_external_ids[node.parent_id];
+    deleted_ct++;
+    if (! deleted.count(node.external_id))
+      unlisted_ct++;
+  }
+  for (size_t i = 1; i < old_node_ct; i++)
+    ncbi_taxonomy->MarkNode(new_external_ids[i]);
+  ncbi_taxonomy->ConvertToKrakenTaxonomy(opts.new_taxonomy_filename.c_str());
+  delete ncbi_taxonomy;
+
+  Taxonomy new_taxonomy(opts.new_taxonomy_filename);
+  new_taxonomy.GenerateExternalToInternalIDMap();
+  vector<taxid_t> value_map(old_node_ct, 0);
+  for (size_t i = 1; i < old_node_ct; i++)
+    value_map[i] = new_taxonomy.GetInternalID(new_external_ids[i]);
+  size_t widened_ct = 0;
+  for (size_t i = old_node_ct - 1; i > 1; i--) {
+    auto parent = old_nodes[i].parent_id;
+    if (parent == 0)
+      continue;
+    auto lca = new_taxonomy.LowestCommonAncestor(value_map[parent],
+                                                 value_map[i]);
+    if (lca != value_map[parent]) {
+      if (value_map[parent] == new_taxonomy.GetInternalID(
+                                 new_external_ids[parent]))
+        widened_ct++;
+      value_map[parent] = lca;
+    }
+  }
+
+  std::cerr << "Relabeled " << old_node_ct - 1 << " taxa: " << merged_ct
+            << " merged, " << deleted_ct << " deleted";
+  if (unlisted_ct > 0)
+    std::cerr << " (" << unlisted_ct << " not in delnodes.dmp)";
+  std::cerr << ", " << widened_ct << " widened to the LCA of moved descendants"
+            << std::endl;
+  if (unrooted_ct > 0)
+    warnx("%llu taxa without a node in the old taxonomy were relabeled as the root",
+          (unsigned long long) unrooted_ct);
+  return value_map;
+}
+
+// Rewrites every cell's value in one pass; each cell stays where it is.
+// The table can't take more value bits: that would drop low key bits,
+// making some keys equal without merging their cells, so a taxonomy that
+// needs more is refused.
+void RelabelTable(const Options &opts, const vector<taxid_t> &value_map,
+    size_t min_value_bits)
+{
+  MMapFile hash_file;
+  hash_file.OpenFile(opts.hash_filename);
+  size_t header[4];  // capacity, size, key bits, value bits
+  if (hash_file.filesize() < sizeof(header))
+    errx(EX_DATAERR, "malformed hash table %s", opts.hash_filename.c_str());
+  memcpy((char *) header, hash_file.fptr(), sizeof(header));
+  size_t capacity = header[0];
+  size_t value_bits = header[3];
+  if (value_bits == 0 || value_bits >= 32 || header[2] + value_bits != 32
+      || hash_file.filesize() != sizeof(header) + capacity * sizeof(uint32_t))
+    errx(EX_DATAERR, "malformed hash table %s", opts.hash_filename.c_str());
+  auto cells = (const uint32_t *) (hash_file.fptr() + sizeof(header));
+
+  if (min_value_bits > value_bits)
+    errx(EX_DATAERR, "new taxonomy needs %zu value bits, but %s has %zu; "
+         "rebuild the database instead", min_value_bits,
+         opts.hash_filename.c_str(), value_bits);
+  uint32_t value_mask = ((uint32_t) 1 << value_bits) - 1;
+
+  FILE *fp = fopen(opts.new_hash_filename.c_str(), "wb");
+  if (fp == nullptr)
+    err(EX_CANTCREAT, "unable to create %s", opts.new_hash_filename.c_str());
+  if (fwrite(header, sizeof(header), 1, fp) != 1)
+    err(EX_IOERR, "unable to write %s", opts.new_hash_filename.c_str());
+  vector<uint32_t> buffer(std::min<size_t>(capacity, CHUNK_CELLS));
+  size_t bad_value_ct = 0;
+  for (size_t start = 0; start < capacity; start += buffer.size()) {
+    size_t chunk_ct = std::min(buffer.size(), capacity - start);
+    #pragma omp parallel for schedule(static) reduction(+:bad_value_ct)
+    for (size_t i = 0; i < chunk_ct; i++) {
+      uint32_t cell = cells[start + i];
+      uint32_t value = cell & value_mask;
+      if (value == 0) {  // empty cell
+        buffer[i] = 0;
+        continue;
+      }
+      if (value >= value_map.size()) {
+        bad_value_ct++;
+        continue;
+      }
+      buffer[i] = (cell & ~value_mask) | value_map[value];
+    }
+    if (bad_value_ct > 0)
+      errx(EX_DATAERR, "%s has values outside the taxonomy in %s",
+           opts.hash_filename.c_str(), opts.taxonomy_filename.c_str());
+    if (fwrite(buffer.data(), sizeof(uint32_t), chunk_ct, fp) != chunk_ct)
+      err(EX_IOERR, "unable to write %s", opts.new_hash_filename.c_str());
+  }
+  if (fclose(fp) != 0)
+    err(EX_IOERR, "unable to write %s", opts.new_hash_filename.c_str());
+  std::cerr << "Relabeled " << header[1] << " hash table entries" << std::endl;
+}
+
+void ParseCommandLine(int argc, char **argv, Options &opts) {
+  int opt;
+  long long sig;
+
+  while ((opt = getopt(argc, argv, "?hp:n:")) != -1) {
+    switch (opt) {
+      case 'h' : case '?' :
+        usage(0);
+        break;
+      case 'p' :
+        sig = atoll(optarg);
+        if (sig < 1)
+          errx(EX_USAGE, "must have at least 1 thread");
+        opts.threads = sig;
+        break;
+      case 'n' :
+        opts.ncbi_taxonomy_directory = optarg;
+        break;
+    }
+  }
+  if (opts.ncbi_taxonomy_directory.empty()) {
+    std::cerr << "missing mandatory filename parameter" << std::endl;
+    usage();
+  }
+  if (argc - optind != 4)
+    usage();
+  opts.hash_filename = argv[optind];
+  opts.taxonomy_filename = argv[optind + 1];
+  opts.new_hash_filename = argv[optind + 2];
+  opts.new_taxonomy_filename = argv[optind + 3];
+}
+
+void usage(int exit_code) {
+  std::cerr << "Usage: relabel_db [-p threads] -n <taxonomy directory> <hash.k2d> <taxo.k2d> <new hash.k2d> <new taxo.k2d>" << std::endl
+            << std::endl
+            << "Relabels a database's hash table for the NCBI taxonomy in the" << std::endl
+            << "given directory, without rescanning its library.  Taxa listed in" << std::endl
+            << "merged.dmp take their new taxids, and those no longer in the" << std::endl
+            << "taxonomy take their nearest remaining ancestor's.  A taxonomy" << std::endl
+            << "too large for the table's value bits needs a rebuild." << std::endl
+            << std::endl
+            << "Options:" << std::endl
+            << "  -n DIR        NCBI taxonomy directory (nodes.dmp, names.dmp," << std::endl
+            << "                merged.dmp and delnodes.dmp)" << std::endl
+            << "  -p INT        Number of threads" << std::endl;
+  exit(exit_code);
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#include "seqid_map.h"
+
+using std::string;
+using std::vector;
+
+namespace kraken2 {
+
+static bool IsBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static bool IsIDChar(char c) {
+  return c != '\n' && ! IsBlank(c);
+}
+
+// Parses one line at ptr (ending before end), returns the start of the next
+// line.  An empty ID means the line has none.
+static const char *ParseMapLine(const char *ptr, const char *end,
+    const char **id, size_t *id_len, taxid_t *taxid)
+{
+  while (ptr < end && IsBlank(*ptr))
+    ptr++;
+  *id = ptr;
+  while (ptr < end && IsIDChar(*ptr))
+    ptr++;
+  *id_len = ptr - *id;
+  while (ptr < end && IsBlank(*ptr))
+    ptr++;
+  *taxid = 0;
+  while (ptr < end && *ptr >= '0' && *ptr <= '9')
+    *taxid = *taxid * 10 + (*ptr++ - '0');
+  while (ptr < end && *ptr != '\n')
+    ptr++;
+  return ptr < end ? ptr + 1 : end;
+}
+
+SequenceIDMap::SequenceIDMap()
+    : data_(nullptr), data_size_(0), shards_(1 << SHARD_BITS), size_(0)
+{
+  for (auto &shard : shards_)
+    omp_init_lock(&shard.lock);
+}
+
+SequenceIDMap::~SequenceIDMap() {
+  for (auto &shard : shards_)
+    omp_destroy_lock(&shard.lock);
+}
+
+// FNV-1a, with a final mix so both the high (shard) and low (slot) bits
+// depend on every character
+uint64_t SequenceIDMap::HashID(const char *id, size_t id_len) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < id_len; i++) {
+    hash ^= (unsigned char) id[i];
+    hash *= 0x100000001b3ull;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+bool SequenceIDMap::IDMatches(uint64_t position, const char *id,
+    size_t id_len) const
+{
+  const char *stored = data_ + position - 1;
+  size_t remaining = data_size_ - (position - 1);
+  return remaining >= id_len && memcmp(stored, id, id_len) == 0
+         && (remaining == id_len || ! IsIDChar(stored[id_len]));
+}
+
+void SequenceIDMap::ReadFile(const string &filename) {
+  struct stat sb;
+  if (stat(filename.c_str(), &sb) < 0)
+    err(EX_NOINPUT, "unable to read from '%s'", filename.c_str());
+  if (sb.st_size == 0)
+    return;
+  map_file_.OpenFile(filename);
+  data_ = map_file_.fptr();
+  data_size_ = map_file_.filesize();
+  const char *end = data_ + data_size_;
+
+  // Split the file into chunks of whole lines
+  size_t chunk_ct = omp_get_max_threads() * 16;
+  vector<const char *> chunk_starts(chunk_ct + 1, end);
+  chunk_starts[0] = data_;
+  for (size_t i = 1; i < chunk_ct; i++) {
+    const char *ptr = data_ + data_size_ / chunk_ct * i;
+    if (ptr < chunk_starts[i - 1])
+      ptr = chunk_starts[i - 1];
+    ptr = (const char *) memchr(ptr, '\n', end - ptr);
+    chunk_starts[i] = ptr == nullptr ? end : ptr + 1;
+  }
+
+  // Count IDs per shard to size the tables
+  vector<size_t> shard_counts(shards_.size(), 0);
+  #pragma omp parallel
+  {
+    vector<size_t> thread_counts(shards_.size(), 0);
+    #pragma omp for schedule(dynamic)
+    for (size_t i = 0; i < chunk_ct; i++) {
+      const char *ptr = chunk_starts[i], *id;
+      size_t id_len;
+      taxid_t taxid;
+      while (ptr < chunk_starts[i + 1]) {
+        ptr = ParseMapLine(ptr, chunk_starts[i + 1], &id, &id_len, &taxid);
+        if (id_len)
+          thread_counts[HashID(id, id_len) >> (64 - SHARD_BITS)]++;
+      }
+    }
+    #pragma omp critical(shard_counts)
+    for (size_t i = 0; i < shards_.size(); i++)
+      shard_counts[i] += thread_counts[i];
+  }
+  for (size_t i = 0; i < shards_.size(); i++) {
+    size_t slot_ct = 16;
+    while (slot_ct * 7 / 10 < shard_counts[i])
+      slot_ct *= 2;
+    shards_[i].slots.assign(slot_ct, Slot{0, 0});
+  }
+
+  // Insert the IDs; an ID later in the file replaces an earlier one
+  size_t inserted = 0;
+  #pragma omp parallel for schedule(dynamic) reduction(+:inserted)
+  for (size_t i = 0; i < chunk_ct; i++) {
+    const char *ptr = chunk_starts[i], *id;
+    size_t id_len;
+    taxid_t taxid;
+    while (ptr < chunk_starts[i + 1]) {
+      ptr = ParseMapLine(ptr, chunk_starts[i + 1], &id, &id_len, &taxid);
+      if (! id_len)
+        continue;
+      uint64_t hash = HashID(id, id_len);
+      auto &shard = shards_[hash >> (64 - SHARD_BITS)];
+      uint64_t position = id - data_ + 1;
+      size_t mask = shard.slots.size() - 1;
+      omp_set_lock(&shard.lock);
+      for (size_t idx = hash & mask; ; idx = (idx + 1) & mask) {
+        auto &slot = shard.slots[idx];
+        if (slot.position == 0) {
+          slot.position = position;
+          slot.taxid = taxid;
+          inserted++;
+          break;
+        }
+        if (IDMatches(slot.position, id, id_len)) {
+          if (slot.position < position) {
+            slot.position = position;
+            slot.taxid = taxid;
+          }
+          break;
+        }
+      }
+      omp_unset_lock(&shard.lock);
+    }
+  }
+  size_ = inserted;
+}
+
+taxid_t SequenceIDMap::Get(const char *id, size_t id_len) const {
+  if (size_ == 0)
+    return 0;
+  uint64_t hash = HashID(id, id_len);
+  auto &shard = shards_[hash >> (64 - SHARD_BITS)];
+  size_t mask = shard.slots.size() - 1;
+  for (size_t idx = hash & mask; ; idx = (idx + 1) & mask) {
+    auto &slot = shard.slots[idx];
+    if (slot.position == 0)
+      return 0;
+    if (IDMatches(slot.position, id, id_len))
+      return slot.taxid;
+  }
+}
+
+size_t SequenceIDMap::memory_usage() const {
+  size_t usage = data_size_;
+  for (auto &shard : shards_)
+    usage += shard.slots.size() * sizeof(Slot);
+  return usage;
+}
+
+}
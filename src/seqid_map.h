@@ -0,0 +1,70 @@
+/*
+ * Copyright 2013-2021, Derrick Wood <dwood@cs.jhu.edu>
+ *
+ * This file is part of the Kraken 2 taxonomic sequence classification system.
+ */
+
+#ifndef KRAKEN2_SEQID_MAP_H_
+#define KRAKEN2_SEQID_MAP_H_
+
+#include "kraken2_headers.h"
+#include "kraken2_data.h"
+#include "mmap_file.h"
+
+namespace kraken2 {
+
+// Maps sequence IDs to taxon IDs, as listed in a seqid2taxid.map file
+// (lines of "ID<whitespace>taxid"; later lines override earlier ones).
+// The file is memory mapped and serves as the storage for the ID strings,
+// which are indexed by open-addressed hash tables, one per shard of the
+// hash space, so the file can be parsed and indexed by several threads.
+class SequenceIDMap {
+  public:
+  SequenceIDMap();
+  ~SequenceIDMap();
+  SequenceIDMap(const SequenceIDMap &rhs) = delete;
+  SequenceIDMap& operator=(const SequenceIDMap &rhs) = delete;
+
+  void ReadFile(const std::string &filename);
+
+  // Returns 0 for IDs not in the map
+  taxid_t Get(const char *id, size_t id_len) const;
+  taxid_t Get(const std::string &id) const { return Get(id.data(), id.size()); }
+  size_t size() const { return size_; }
+  // Bytes held by the mapped file and the hash tables
+  size_t memory_usage() const;
+
+  // Calls fn(taxid) for every ID in the map
+  template <typename F>
+  void ForEachTaxon(F fn) const {
+    for (auto &shard : shards_)
+      for (auto &slot : shard.slots)
+        if (slot.position)
+          fn(slot.taxid);
+  }
+
+  private:
+  struct Slot {
+    uint64_t position;  // 1 + file offset of the ID, 0 if empty
+    taxid_t taxid;
+  };
+  struct Shard {
+    std::vector<Slot> slots;  // power-of-2 size
+    omp_lock_t lock;
+  };
+
+  static const int SHARD_BITS = 10;
+
+  static uint64_t HashID(const char *id, size_t id_len);
+  bool IDMatches(uint64_t position, const char *id, size_t id_len) const;
+
+  MMapFile map_file_;
+  const char *data_;
+  size_t data_size_;
+  std::vector<Shard> shards_;
+  size_t size_;
+};
+
+}
+
+#endif
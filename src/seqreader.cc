@@ -37,50 +37,44 @@ string &Sequence::to_string() {
 BatchSequenceReader::BatchSequenceReader() {
   file_format_ = FORMAT_AUTO_DETECT;
   str_buffer_.reserve(8192);
-  block_buffer_ = new char[8192];
-  block_buffer_size_ = 8192;
+  buffer_pos_ = 0;
 }
 
 BatchSequenceReader::~BatchSequenceReader() {
-  delete[] block_buffer_;
 }
 
 bool BatchSequenceReader::LoadBlock(std::istream &ifs, size_t block_size) {
-  ss_.clear();
-  ss_.str("");
-  if (block_buffer_size_ < block_size) {
-    delete[] block_buffer_;
-    block_buffer_ = new char[block_size];
-    block_buffer_size_ = block_size;
-  }
-  ifs.read(block_buffer_, block_size);
-  if (! ifs && ifs.gcount() <= 0)
+  buffer_pos_ = 0;
+  buffer_.resize(block_size);
+  ifs.read(&buffer_[0], block_size);
+  if (! ifs && ifs.gcount() <= 0) {
+    buffer_.clear();
     return false;
+  }
+  buffer_.resize(ifs.gcount());
 
   if (file_format_ == FORMAT_AUTO_DETECT) {
-    switch (block_buffer_[0]) {
+    switch (buffer_[0]) {
       case '@' : file_format_ = FORMAT_FASTQ; break;
       case '>' : file_format_ = FORMAT_FASTA; break;
       default:
         errx(EX_DATAERR, "sequence reader - unrecognized file format");
     }
   }
-  str_buffer_.assign(block_buffer_, ifs.gcount());
-  ss_ << str_buffer_;
   if (getline(ifs, str_buffer_))
-    ss_ << str_buffer_ << "\n";
+    buffer_.append(str_buffer_).append("\n");
   if (file_format_ == FORMAT_FASTQ) {
     while (getline(ifs, str_buffer_)) {
-      ss_ << str_buffer_ << "\n";
+      buffer_.append(str_buffer_).append("\n");
       if (str_buffer_[0] == '@')
         break;
     }
     int lines_to_read = 0;
     if (getline(ifs, str_buffer_)) {
-      ss_ << str_buffer_ << "\n";
+      buffer_.append(str_buffer_).append("\n");
       lines_to_read = str_buffer_[0] == '@' ? 3 : 2;
       while (lines_to_read-- > 0 && getline(ifs, str_buffer_))
-        ss_ << str_buffer_ << "\n";
+        buffer_.append(str_buffer_).append("\n");
     }
   }
   else {
@@ -88,15 +82,15 @@ bool BatchSequenceReader::LoadBlock(std::istream &ifs, size_t block_size) {
       if (ifs.peek() == '>')
         break;
       if (getline(ifs, str_buffer_))
-        ss_ << str_buffer_ << "\n";
+        buffer_.append(str_buffer_).append("\n");
     }
   }
   return true;
 }
 
 bool BatchSequenceReader::LoadBatch(std::istream &ifs, size_t record_count) {
-  ss_.clear();
-  ss_.str("");
+  buffer_pos_ = 0;
+  buffer_.clear();
   auto valid = false;
   if (file_format_ == FORMAT_AUTO_DETECT) {
     if (! ifs)
@@ -124,15 +118,216 @@ bool BatchSequenceReader::LoadBatch(std::istream &ifs, size_t record_count) {
       if (ifs.peek() == '>')
         record_count--;
     }
-    ss_ << str_buffer_ << "\n";
+    buffer_.append(str_buffer_).append("\n");
   }
 
   return valid;
 }
 
+void BatchSequenceReader::LoadBuffer(const char *data, size_t size) {
+  buffer_pos_ = 0;
+  buffer_.assign(data, size);
+}
+
 bool BatchSequenceReader::NextSequence(Sequence &seq) {
-  return BatchSequenceReader::ReadNextSequence
-           (ss_, seq, str_buffer_, file_format_);
+  return ParseNextSequence(seq);
+}
+
+// Finds next line in loaded buffer, minus newline and trailing whitespace
+bool BatchSequenceReader::NextBufferLine(const char **line, size_t *line_len) {
+  if (buffer_pos_ >= buffer_.size())
+    return false;
+  const char *start = buffer_.data() + buffer_pos_;
+  size_t remaining = buffer_.size() - buffer_pos_;
+  const char *lf_ptr = (const char *) memchr(start, '\n', remaining);
+  size_t len = lf_ptr == nullptr ? remaining : lf_ptr - start;
+  buffer_pos_ += lf_ptr == nullptr ? len : len + 1;
+  while (len > 0 && isspace(start[len - 1]))
+    len--;
+  *line = start;
+  *line_len = len;
+  return true;
+}
+
+// Same parsing rules as ReadNextSequence(), applied to the loaded buffer
+bool BatchSequenceReader::ParseNextSequence(Sequence &seq) {
+  const char *line;
+  size_t line_len;
+  seq.raw_data = nullptr;
+  if (! NextBufferLine(&line, &line_len))
+    return false;
+  const char *record_start = line;
+  SequenceFormat file_format = file_format_;
+  if (file_format == FORMAT_AUTO_DETECT) {
+    switch (line_len ? line[0] : 0) {
+      case '@' : file_format = FORMAT_FASTQ; break;
+      case '>' : file_format = FORMAT_FASTA; break;
+      default:
+        errx(EX_DATAERR, "sequence reader - unrecognized file format");
+    }
+  }
+  seq.format = file_format;
+  if (seq.format == FORMAT_FASTQ) {
+    if (line_len == 0) // Allow empty line to end file
+      return false;
+    if (line[0] != '@')
+      errx(EX_DATAERR, "malformed FASTQ file (exp. '@', saw \"%.*s\"), aborting",
+           (int) line_len, line);
+  }
+  else if (seq.format == FORMAT_FASTA) {
+    if (line_len == 0 || line[0] != '>')
+      errx(EX_DATAERR, "malformed FASTA file (exp. '>', saw \"%.*s\"), aborting",
+           (int) line_len, line);
+  }
+  else
+    errx(EX_SOFTWARE, "illegal sequence format encountered in parsing");
+  seq.header.assign(line, line_len);
+  if (line_len <= 1)
+    return false;
+  size_t id_end = 1;
+  while (id_end < line_len && line[id_end] != ' ' && line[id_end] != '\t'
+         && line[id_end] != '\r')
+    id_end++;
+  seq.id.assign(line + 1, id_end - 1);
+
+  if (seq.format == FORMAT_FASTQ) {
+    if (! NextBufferLine(&line, &line_len))
+      return false;
+    seq.seq.assign(line, line_len);
+    if (! NextBufferLine(&line, &line_len))  //  + line, discard
+      return false;
+    if (! NextBufferLine(&line, &line_len))
+      return false;
+    seq.quals.assign(line, line_len);
+  }
+  else if (seq.format == FORMAT_FASTA) {
+    seq.quals.assign("");
+    seq.seq.assign("");
+    while (buffer_pos_ < buffer_.size() && buffer_[buffer_pos_] != '>') {
+      NextBufferLine(&line, &line_len);
+      seq.seq.append(line, line_len);
+    }
+  }
+  seq.raw_data = record_start;
+  seq.raw_size = buffer_.data() + buffer_pos_ - record_start;
+  seq.raw_header_size = seq.header.size();
+  return true;
+}
+
+PairedSequenceReader::PairedSequenceReader(std::istream &ifs1,
+    std::istream &ifs2, size_t chunk_size)
+    : chunk_size_(chunk_size)
+{
+  inputs_[0].is = &ifs1;
+  inputs_[1].is = &ifs2;
+  for (auto &input : inputs_) {
+    input.pos = input.scan_pos = 0;
+    input.line_count = input.record_count = 0;
+    input.records_end = 0;
+    input.eof = false;
+    input.format = FORMAT_AUTO_DETECT;
+  }
+}
+
+// Appends next raw chunk of input to buffer, discarding data already handed
+// out; returns false when nothing more can be read
+bool PairedSequenceReader::FillChunk(ChunkedInput &input) {
+  if (input.eof)
+    return false;
+  if (input.pos > 0) {
+    input.buffer.erase(0, input.pos);
+    input.scan_pos -= input.pos;
+    input.records_end -= input.pos;
+    input.pos = 0;
+  }
+  auto old_size = input.buffer.size();
+  input.buffer.resize(old_size + chunk_size_);
+  input.is->read(&input.buffer[old_size], chunk_size_);
+  auto read_size = input.is->gcount();
+  input.buffer.resize(old_size + read_size);
+  if (! *input.is)
+    input.eof = true;
+  return read_size > 0;
+}
+
+// Count complete records past input.pos, up to max_records
+void PairedSequenceReader::IndexRecords(ChunkedInput &input,
+    size_t max_records)
+{
+  const char *data = input.buffer.data();
+  size_t size = input.buffer.size();
+  while (input.record_count < max_records && input.scan_pos < size) {
+    auto lf_ptr = (const char *) memchr(data + input.scan_pos, '\n',
+                                        size - input.scan_pos);
+    if (lf_ptr == nullptr)
+      break;
+    size_t line_end = lf_ptr - data + 1;
+    if (input.format == FORMAT_FASTQ) {
+      if (++input.line_count % 4 == 0) {
+        input.record_count++;
+        input.records_end = line_end;
+      }
+    }
+    else {
+      // A FASTA record only ends where the next one's header begins
+      if (line_end == size)
+        break;
+      if (data[line_end] == '>') {
+        input.record_count++;
+        input.records_end = line_end;
+      }
+    }
+    input.scan_pos = line_end;
+  }
+  // Last record in file might not have trailing newline/following header
+  if (input.eof && input.record_count < max_records) {
+    auto i = input.records_end;
+    while (i < size && isspace(data[i]))
+      i++;
+    if (i < size) {
+      input.record_count++;
+      input.records_end = input.scan_pos = size;
+    }
+  }
+}
+
+bool PairedSequenceReader::LoadBatch(BatchSequenceReader &reader1,
+    BatchSequenceReader &reader2, size_t record_count)
+{
+  for (auto &input : inputs_) {
+    while (true) {
+      if (input.format == FORMAT_AUTO_DETECT && input.pos < input.buffer.size()) {
+        switch (input.buffer[input.pos]) {
+          case '@' : input.format = FORMAT_FASTQ; break;
+          case '>' : input.format = FORMAT_FASTA; break;
+          default:
+            errx(EX_DATAERR, "sequence reader - unrecognized file format");
+        }
+      }
+      if (input.format != FORMAT_AUTO_DETECT)
+        IndexRecords(input, record_count);
+      if (input.record_count >= record_count || input.eof)
+        break;
+      FillChunk(input);
+    }
+  }
+  // Both counts are capped at record_count, so they can only differ once
+  // one of the files has run out of records
+  if (inputs_[0].record_count != inputs_[1].record_count)
+    errx(EX_DATAERR, "paired reads files have unequal numbers of sequences");
+  if (inputs_[0].record_count == 0)
+    return false;
+
+  BatchSequenceReader *readers[2] = { &reader1, &reader2 };
+  for (int i = 0; i < 2; i++) {
+    auto &input = inputs_[i];
+    readers[i]->set_file_format(input.format);
+    readers[i]->LoadBuffer(input.buffer.data() + input.pos,
+                           input.records_end - input.pos);
+    input.pos = input.scan_pos = input.records_end;
+    input.line_count = input.record_count = 0;
+  }
+  return true;
 }
 
 bool BatchSequenceReader::ReadNextSequence(std::istream &is, Sequence &seq,
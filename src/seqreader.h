@@ -23,6 +23,11 @@ struct Sequence {
   std::string id;      // from first char. after @/> up to first whitespace
   std::string seq;
   std::string quals;   // only meaningful for FASTQ seqs
+  // Original text of the record in the reader's buffer, valid until the
+  // reader's next load; null if the record wasn't parsed from a buffer
+  const char *raw_data = nullptr;
+  size_t raw_size = 0;
+  size_t raw_header_size = 0;  // header line, w/o newline or trailing whitespace
 
   std::string &to_string();
 
@@ -39,18 +44,59 @@ class BatchSequenceReader {
 
   bool LoadBatch(std::istream &ifs, size_t record_count);
   bool LoadBlock(std::istream &ifs, size_t block_size);
+  // Loads complete records already in memory
+  void LoadBuffer(const char *data, size_t size);
   bool NextSequence(Sequence &seq);
   static bool ReadNextSequence(std::istream &is, Sequence &seq, 
     std::string &str_buffer_ptr, SequenceFormat format = FORMAT_AUTO_DETECT);
 
   SequenceFormat file_format() { return file_format_; }
+  // Allows one reader to be moved between several input streams
+  void set_file_format(SequenceFormat format) { file_format_ = format; }
 
   private:
-  std::stringstream ss_;
+  bool NextBufferLine(const char **line, size_t *line_len);
+  bool ParseNextSequence(Sequence &seq);
+
   std::string str_buffer_;  // used to prevent realloc upon every load/parse
   SequenceFormat file_format_;
-  char *block_buffer_;
-  size_t block_buffer_size_;
+  std::string buffer_;  // loaded records, parsed in place
+  size_t buffer_pos_;
+};
+
+// Reads mate files in large raw chunks and hands out batches with the same
+// number of records from each file, so readers never need per-line stream
+// operations.  Works with any istream, including decompression pipes.
+class PairedSequenceReader {
+  public:
+  PairedSequenceReader(std::istream &ifs1, std::istream &ifs2,
+      size_t chunk_size = DEFAULT_CHUNK_SIZE);
+  PairedSequenceReader(const PairedSequenceReader &rhs) = delete;
+  PairedSequenceReader& operator=(const PairedSequenceReader &rhs) = delete;
+
+  bool LoadBatch(BatchSequenceReader &reader1, BatchSequenceReader &reader2,
+      size_t record_count);
+
+  private:
+  static const size_t DEFAULT_CHUNK_SIZE = 4 * 1024 * 1024;
+
+  struct ChunkedInput {
+    std::istream *is;
+    std::string buffer;
+    size_t pos;             // start of first record not yet handed out
+    size_t scan_pos;        // where record indexing resumes
+    size_t line_count;      // lines seen since pos (FASTQ only)
+    size_t record_count;    // complete records seen since pos
+    size_t records_end;     // end of last complete record
+    bool eof;
+    SequenceFormat format;
+  };
+
+  bool FillChunk(ChunkedInput &input);
+  void IndexRecords(ChunkedInput &input, size_t max_records);
+
+  ChunkedInput inputs_[2];
+  size_t chunk_size_;
 };
 
 }
@@ -7,116 +7,394 @@
 #include "taxonomy.h"
 
 using std::string;
-using std::map;
-using std::set;
 using std::ifstream;
 using std::istringstream;
-using std::queue;
 using std::ofstream;
+using std::vector;
 
 namespace kraken2 {
 
-NCBITaxonomy::NCBITaxonomy(string nodes_filename, string names_filename) {
-  ifstream nodes_file(nodes_filename.c_str());
-  if (! nodes_file.good())
-    err(EX_NOINPUT, "error opening %s", nodes_filename.c_str());
-
-  ifstream names_file(names_filename.c_str());
-  if (! names_file.good())
-    err(EX_NOINPUT, "error opening %s", names_filename.c_str());
-
-  string line;
-  uint64_t node_id, parent_id;
-  string name, rank, junk;
-
-  const string delim = "\t|\t";
-  while (getline(nodes_file, line)) {
-    line.pop_back();  // discard trailing
-    line.pop_back();  //   "\t|"
-    size_t pos1, pos2;
-    pos1 = 0;
-    int field_ct = 0;
-    bool finished = false;
-    while (field_ct++ < 10 && ! finished) {  // tokenizing loop
-      pos2 = line.find(delim, pos1);
-      string token;
-      if (pos2 == string::npos) {
-        token = line.substr(pos1);
-        finished = true;
-      }
-      else {
-        token = line.substr(pos1, pos2 - pos1);
-        pos1 = pos2 + delim.size();
-      }
+// A .dmp field or line, as a range of characters
+typedef std::pair<const char *, const char *> DumpSpan;
+
+// Splits a .dmp file into chunks of whole lines, for parsing in parallel
+static vector<DumpSpan> SplitDumpFile(const char *data, size_t size) {
+  size_t chunk_size = std::max<size_t>(size / (omp_get_max_threads() * 4),
+                                       1 << 20);
+  vector<DumpSpan> chunks;
+  const char *begin = data, *end = data + size;
+  while (begin < end) {
+    const char *chunk_end = end;
+    if ((size_t) (end - begin) > chunk_size) {
+      auto lf_ptr = (const char *) memchr(begin + chunk_size, '\n',
+                                          end - begin - chunk_size);
+      if (lf_ptr != nullptr)
+        chunk_end = lf_ptr + 1;
+    }
+    chunks.push_back(DumpSpan(begin, chunk_end));
+    begin = chunk_end;
+  }
+  return chunks;
+}
 
-      switch (field_ct) {  // 1-based counting
-        case 1 :  // node ID
-          node_id = (uint64_t) stoul(token);
-          if (node_id == 0)
-            errx(EX_DATAERR, "attempt to create taxonomy w/ node ID == 0");
-          break;
-        case 2 : // parent ID
-          parent_id = (uint64_t) stoul(token);
-          break;
-        case 3 : // rank
-          rank = token;
-          finished = true;
-          break;
+// Splits the .dmp line starting at ptr into up to max_fields fields, which
+// are separated by "\t|\t" (the line ends with "\t|"), returning the number
+// of fields found and setting ptr to the start of the next line
+static size_t SplitDumpLine(const char *&ptr, const char *end,
+    DumpSpan *fields, size_t max_fields)
+{
+  auto line_end = (const char *) memchr(ptr, '\n', end - ptr);
+  if (line_end == nullptr)
+    line_end = end;
+  auto next_line = line_end < end ? line_end + 1 : end;
+  if (line_end - ptr >= 2 && line_end[-2] == '\t' && line_end[-1] == '|')
+    line_end -= 2;
+  size_t field_ct = 0;
+  while (field_ct < max_fields) {
+    auto field_end = ptr;
+    while (true) {
+      field_end = (const char *) memchr(field_end, '\t', line_end - field_end);
+      if (field_end == nullptr || line_end - field_end < 3) {
+        field_end = line_end;
+        break;
       }
-    }  // end tokenizing loop
-    if (node_id == 1)
-      parent_id = 0;
-    parent_map_[node_id] = parent_id;
-    child_map_[parent_id].insert(node_id);
-    rank_map_[node_id] = rank;
-    known_ranks_.insert(rank);
+      if (field_end[1] == '|' && field_end[2] == '\t')
+        break;
+      field_end++;
+    }
+    fields[field_ct++] = DumpSpan(ptr, field_end);
+    if (field_end == line_end)
+      break;
+    ptr = field_end + 3;
   }
+  ptr = next_line;
+  return field_ct;
+}
 
-  while (getline(names_file, line)) {
-    line.pop_back();  // discard trailing
-    line.pop_back();  //   "\t|"
-    size_t pos1, pos2;
-    pos1 = 0;
-    int field_ct = 0;
-    bool finished = false;
-    while (field_ct++ < 10 && ! finished) {  // tokenizing loop
-      pos2 = line.find(delim, pos1);
-      string token;
-      if (pos2 == string::npos) {
-        token = line.substr(pos1);
-        finished = true;
-      }
-      else {
-        token = line.substr(pos1, pos2 - pos1);
-        pos1 = pos2 + delim.size();
-      }
+static uint64_t ParseDumpID(const DumpSpan &field) {
+  uint64_t id = 0;
+  for (auto p = field.first; p < field.second && isdigit(*p); p++)
+    id = id * 10 + (*p - '0');
+  return id;
+}
+
+constexpr const char *NCBITaxonomy::SNAPSHOT_MAGIC;
+constexpr const char *NCBITaxonomy::SNAPSHOT_FILENAME;
 
-      switch (field_ct) {  // 1-based counting
-        case 1 :  // node ID
-          node_id = (uint64_t) stoul(token);
-          if (node_id == 0)
-            errx(EX_DATAERR, "attempt to create taxonomy w/ node ID == 0");
-          break;
-        case 2 : // name
-          name = token;
-          break;
-        case 4 : // type of name - determines whether or not to record in map
-          if (token == "scientific name")
-            name_map_[node_id] = name;
-          finished = true;
-          break;
+NCBITaxonomy::NCBITaxonomy(string nodes_filename, string names_filename)
+    : marked_ct_(0)
+{
+  ParseNodes(nodes_filename);
+  ParseNames(names_filename);
+  UseParsedArrays();
+  MarkRoot();
+}
+
+// Snapshot layout: the magic string, then as uint64_t the node count, the
+// child count, the size of the direct taxid index, and the lengths of the
+// name and rank data.  Then the node IDs, parent IDs, name offsets and
+// child offsets (uint64_t), rank indexes, child indexes and direct index
+// (uint32_t), the names and the NUL-terminated sorted ranks, each array
+// padded to a multiple of 8 bytes.
+NCBITaxonomy::NCBITaxonomy(const string &snapshot_filename)
+    : marked_ct_(0)
+{
+  snapshot_file_.OpenFile(snapshot_filename);
+  const char *ptr = snapshot_file_.fptr();
+  size_t filesize = snapshot_file_.filesize();
+  uint64_t header[5];
+  size_t header_size = strlen(SNAPSHOT_MAGIC) + sizeof(header);
+  if (filesize < header_size
+      || strncmp(ptr, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) != 0)
+    errx(EX_DATAERR, "malformed taxonomy snapshot %s",
+         snapshot_filename.c_str());
+  memcpy((char *) header, ptr + strlen(SNAPSHOT_MAGIC), sizeof(header));
+  node_count_ = header[0];
+  child_count_ = header[1];
+  index_by_id_size_ = header[2];
+  name_data_len_ = header[3];
+  size_t rank_data_len = header[4];
+  auto padded = [](size_t size) { return (size + 7) / 8 * 8; };
+  if (filesize != header_size + 8 * (4 * node_count_ + 1)
+      + padded(4 * node_count_) + padded(4 * child_count_)
+      + padded(4 * index_by_id_size_) + padded(name_data_len_)
+      + rank_data_len)
+    errx(EX_DATAERR, "malformed taxonomy snapshot %s",
+         snapshot_filename.c_str());
+  ptr += header_size;
+  node_ids_ = (const uint64_t *) ptr;
+  parent_ids_ = node_ids_ + node_count_;
+  name_offsets_ = parent_ids_ + node_count_;
+  child_offsets_ = name_offsets_ + node_count_;
+  ptr = (const char *) (child_offsets_ + node_count_ + 1);
+  rank_indexes_ = (const uint32_t *) ptr;
+  ptr += padded(4 * node_count_);
+  child_indexes_ = (const uint32_t *) ptr;
+  ptr += padded(4 * child_count_);
+  index_by_id_ = (const uint32_t *) ptr;
+  ptr += padded(4 * index_by_id_size_);
+  name_data_ = ptr;
+  ptr += padded(name_data_len_);
+  for (auto end = ptr + rank_data_len; ptr < end; ptr += strlen(ptr) + 1)
+    ranks_.push_back(ptr);
+  marked_.assign(node_count_, 0);
+  MarkRoot();
+}
+
+void NCBITaxonomy::WriteSnapshot(const char *filename) const {
+  FILE *fp = fopen(filename, "wb");
+  if (fp == nullptr)
+    err(EX_CANTCREAT, "unable to create %s", filename);
+  string rank_data;
+  for (auto &rank : ranks_)
+    rank_data.append(rank.c_str(), rank.size() + 1);
+  uint64_t header[5] = { node_count_, child_count_, index_by_id_size_,
+                         name_data_len_, rank_data.size() };
+  const char padding[8] = { 0 };
+  auto write_array = [&](const void *data, size_t size) {
+    if ((size > 0 && fwrite(data, 1, size, fp) != size)
+        || fwrite(padding, 1, (8 - size % 8) % 8, fp) != (8 - size % 8) % 8)
+      err(EX_IOERR, "unable to write %s", filename);
+  };
+  write_array(SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC));
+  write_array(header, sizeof(header));
+  write_array(node_ids_, 8 * node_count_);
+  write_array(parent_ids_, 8 * node_count_);
+  write_array(name_offsets_, 8 * node_count_);
+  write_array(child_offsets_, 8 * (node_count_ + 1));
+  write_array(rank_indexes_, 4 * node_count_);
+  write_array(child_indexes_, 4 * child_count_);
+  write_array(index_by_id_, 4 * index_by_id_size_);
+  write_array(name_data_, name_data_len_);
+  if (fwrite(rank_data.data(), 1, rank_data.size(), fp) != rank_data.size()
+      || fclose(fp) != 0)
+    err(EX_IOERR, "unable to write %s", filename);
+}
+
+void NCBITaxonomy::UseParsedArrays() {
+  node_count_ = parsed_.node_ids.size();
+  child_count_ = parsed_.child_indexes.size();
+  index_by_id_size_ = parsed_.index_by_id.size();
+  name_data_len_ = parsed_.name_data.size();
+  node_ids_ = parsed_.node_ids.data();
+  parent_ids_ = parsed_.parent_ids.data();
+  rank_indexes_ = parsed_.rank_indexes.data();
+  name_offsets_ = parsed_.name_offsets.data();
+  child_offsets_ = parsed_.child_offsets.data();
+  child_indexes_ = parsed_.child_indexes.data();
+  index_by_id_ = parsed_.index_by_id.data();
+  name_data_ = parsed_.name_data.data();
+}
+
+void NCBITaxonomy::MarkRoot() {
+  auto root_index = NodeIndex(1);
+  if (root_index < node_count()) {
+    marked_[root_index] = 1;
+    marked_ct_++;
+  }
+}
+
+// Chunks of the file are tokenized in parallel; where a taxid is listed
+// more than once, its last line is used.
+void NCBITaxonomy::ParseNodes(const string &filename) {
+  struct NodeRecord {
+    uint64_t id, parent_id;
+    uint32_t rank_index;
+  };
+  MMapFile nodes_file;
+  nodes_file.OpenFile(filename);
+  auto chunks = SplitDumpFile(nodes_file.fptr(), nodes_file.filesize());
+  vector<vector<NodeRecord>> chunk_records(chunks.size());
+  vector<vector<string>> chunk_ranks(chunks.size());
+
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < chunks.size(); i++) {
+    std::unordered_map<string, uint32_t> rank_indexes;
+    DumpSpan fields[3];
+    auto ptr = chunks[i].first;
+    while (ptr < chunks[i].second) {
+      if (SplitDumpLine(ptr, chunks[i].second, fields, 3) < 3)
+        continue;
+      NodeRecord record;
+      record.id = ParseDumpID(fields[0]);
+      if (record.id == 0)
+        errx(EX_DATAERR, "attempt to create taxonomy w/ node ID == 0");
+      record.parent_id = record.id == 1 ? 0 : ParseDumpID(fields[1]);
+      string rank(fields[2].first, fields[2].second);
+      auto it = rank_indexes.find(rank);
+      if (it == rank_indexes.end()) {
+        it = rank_indexes.emplace(rank, chunk_ranks[i].size()).first;
+        chunk_ranks[i].push_back(rank);
       }
-    }  // end tokenizing loop
+      record.rank_index = it->second;
+      chunk_records[i].push_back(record);
+    }
+  }
+
+  // Ranks are numbered in sorted order, as the converted taxonomy lists
+  // them that way
+  for (auto &ranks : chunk_ranks)
+    ranks_.insert(ranks_.end(), ranks.begin(), ranks.end());
+  std::sort(ranks_.begin(), ranks_.end());
+  ranks_.erase(std::unique(ranks_.begin(), ranks_.end()), ranks_.end());
+  vector<NodeRecord> records;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    vector<uint32_t> rank_map;
+    for (auto &rank : chunk_ranks[i])
+      rank_map.push_back(std::lower_bound(ranks_.begin(), ranks_.end(), rank)
+                         - ranks_.begin());
+    for (auto &record : chunk_records[i]) {
+      record.rank_index = rank_map[record.rank_index];
+      records.push_back(record);
+    }
+    vector<NodeRecord>().swap(chunk_records[i]);
+  }
+  // NCBI's file is already in taxid order
+  bool sorted = true;
+  for (size_t i = 1; i < records.size() && sorted; i++)
+    sorted = records[i - 1].id < records[i].id;
+  if (! sorted) {
+    std::stable_sort(records.begin(), records.end(),
+      [](const NodeRecord &a, const NodeRecord &b) { return a.id < b.id; });
+    size_t out = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+      if (i + 1 < records.size() && records[i + 1].id == records[i].id)
+        continue;
+      records[out++] = records[i];
+    }
+    records.resize(out);
+  }
+  if (records.size() >= UINT32_MAX)
+    errx(EX_DATAERR, "too many nodes in %s", filename.c_str());
+
+  size_t node_ct = records.size();
+  auto &parsed = parsed_;
+  parsed.node_ids.resize(node_ct);
+  parsed.parent_ids.resize(node_ct);
+  parsed.rank_indexes.resize(node_ct);
+  for (size_t i = 0; i < node_ct; i++) {
+    parsed.node_ids[i] = records[i].id;
+    parsed.parent_ids[i] = records[i].parent_id;
+    parsed.rank_indexes[i] = records[i].rank_index;
+  }
+  vector<NodeRecord>().swap(records);
+  // Taxids are looked up directly unless they're too sparse
+  if (node_ct > 0 && parsed.node_ids.back() < 4 * node_ct + 1024) {
+    parsed.index_by_id.assign(parsed.node_ids.back() + 1, UINT32_MAX);
+    for (size_t i = 0; i < node_ct; i++)
+      parsed.index_by_id[parsed.node_ids[i]] = i;
+  }
+  UseParsedArrays();
+
+  // Children are listed in taxid order, as nodes are
+  parsed.child_offsets.assign(node_ct + 1, 0);
+  vector<size_t> parent_indexes(node_ct);
+  for (size_t i = 0; i < node_ct; i++) {
+    parent_indexes[i] = NodeIndex(parsed.parent_ids[i]);
+    if (parent_indexes[i] < node_ct)
+      parsed.child_offsets[parent_indexes[i] + 1]++;
+  }
+  for (size_t i = 0; i < node_ct; i++)
+    parsed.child_offsets[i + 1] += parsed.child_offsets[i];
+  parsed.child_indexes.resize(parsed.child_offsets[node_ct]);
+  vector<uint64_t> next_child(parsed.child_offsets.begin(),
+                              parsed.child_offsets.end() - 1);
+  for (size_t i = 0; i < node_ct; i++)
+    if (parent_indexes[i] < node_ct)
+      parsed.child_indexes[next_child[parent_indexes[i]]++] = i;
+  marked_.assign(node_ct, 0);
+}
+
+// Only scientific names are kept; a node without one gets an empty name
+void NCBITaxonomy::ParseNames(const string &filename) {
+  MMapFile names_file;
+  names_file.OpenFile(filename);
+  auto chunks = SplitDumpFile(names_file.fptr(), names_file.filesize());
+  vector<vector<std::pair<size_t, DumpSpan>>> chunk_names(chunks.size());
+
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < chunks.size(); i++) {
+    DumpSpan fields[4];
+    auto ptr = chunks[i].first;
+    while (ptr < chunks[i].second) {
+      if (SplitDumpLine(ptr, chunks[i].second, fields, 4) < 4)
+        continue;
+      auto name_class = fields[3];
+      if (name_class.second - name_class.first != 15
+          || memcmp(name_class.first, "scientific name", 15) != 0)
+        continue;
+      auto id = ParseDumpID(fields[0]);
+      if (id == 0)
+        errx(EX_DATAERR, "attempt to create taxonomy w/ node ID == 0");
+      auto index = NodeIndex(id);
+      if (index < node_count())
+        chunk_names[i].emplace_back(index, fields[1]);
+    }
   }
 
-  marked_nodes_.insert(1);  // mark root node
+  // The last name listed for a node is used
+  vector<DumpSpan> names(node_count(), DumpSpan(nullptr, nullptr));
+  for (auto &chunk : chunk_names)
+    for (auto &name : chunk)
+      names[name.first] = name.second;
+  auto &name_data = parsed_.name_data;
+  name_data.assign(1, '\0');  // shared empty name
+  parsed_.name_offsets.assign(node_count(), 0);
+  for (size_t i = 0; i < node_count(); i++) {
+    if (names[i].first == names[i].second)
+      continue;
+    parsed_.name_offsets[i] = name_data.size();
+    name_data.append(names[i].first, names[i].second - names[i].first);
+    name_data.push_back('\0');
+  }
+}
+
+size_t NCBITaxonomy::NodeIndex(uint64_t taxid) const {
+  if (index_by_id_size_ > 0) {
+    if (taxid < index_by_id_size_ && index_by_id_[taxid] != UINT32_MAX)
+      return index_by_id_[taxid];
+    return node_count();
+  }
+  auto it = std::lower_bound(node_ids_, node_ids_ + node_count_, taxid);
+  if (it == node_ids_ + node_count_ || *it != taxid)
+    return node_count();
+  return it - node_ids_;
+}
+
+NCBITaxonomy *LoadNCBITaxonomy(const string &directory) {
+  string nodes_filename = directory + "/nodes.dmp";
+  string names_filename = directory + "/names.dmp";
+  string snapshot_filename = directory + "/"
+                             + NCBITaxonomy::SNAPSHOT_FILENAME;
+  bool use_snapshot = false;
+  struct stat snapshot_sb, sb;
+  if (stat(snapshot_filename.c_str(), &snapshot_sb) == 0) {
+    use_snapshot = true;
+    for (auto &filename : { nodes_filename, names_filename })
+      if (stat(filename.c_str(), &sb) == 0
+          && sb.st_mtime > snapshot_sb.st_mtime)
+        use_snapshot = false;
+  }
+  if (! use_snapshot)
+    return new NCBITaxonomy(nodes_filename, names_filename);
+  std::cerr << "Using taxonomy snapshot " << snapshot_filename << std::endl;
+  return new NCBITaxonomy(snapshot_filename);
 }
 
 // Mark the given taxonomy node and all its unmarked ancestors
 void NCBITaxonomy::MarkNode(uint64_t taxid) {
-  while (marked_nodes_.count(taxid) == 0) {
-    marked_nodes_.insert(taxid);
-    taxid = parent_map_[taxid];
+  while (true) {
+    auto index = NodeIndex(taxid);
+    if (index == node_count()) {
+      marked_unknown_ids_.insert(taxid);
+      marked_unknown_ids_.insert(0);
+      return;
+    }
+    if (marked_[index])
+      return;
+    marked_[index] = 1;
+    marked_ct_++;
+    taxid = parent_ids_[index];
   }
 }
 
@@ -124,53 +402,55 @@ void NCBITaxonomy::ConvertToKrakenTaxonomy(const char *filename) {
   Taxonomy taxo;
   TaxonomyNode zeroes_node = { 0, 0, 0, 0, 0, 0, 0 };
 
-  taxo.node_count_ = marked_nodes_.size() + 1;  // +1 because 0 is illegal value
-  taxo.nodes_ = new TaxonomyNode[taxo.node_count_];
-  taxo.nodes_[0] = zeroes_node;
-
-  string name_data;
-  string rank_data;
+  auto root_index = NodeIndex(1);
+  if (root_index == node_count())
+    errx(EX_DATAERR, "taxonomy has no root node (taxid 1)");
+  // +1 because 0 is illegal value
+  taxo.node_count_ = marked_ct_ + marked_unknown_ids_.size() + 1;
+  taxo.nodes_ = new TaxonomyNode[taxo.node_count_]();
 
   // Because so many of the node rank names are shared, we only store one copy
   // of each rank
-  map<string, uint64_t> rank_offsets;
-  for (string rank : known_ranks_) {
-    rank_offsets[rank] = rank_data.size();
+  string rank_data;
+  vector<uint64_t> rank_offsets;
+  for (auto &rank : ranks_) {
+    rank_offsets.push_back(rank_data.size());
     rank_data.append(rank.c_str(), rank.size() + 1);
   }
 
-  uint64_t internal_node_id = 0;
-  map<uint64_t, uint64_t> external_id_map;  // keys: ext. ID, values: int. ID
-  external_id_map[0] = 0;
-  external_id_map[1] = 1;  // 1 is root in both NCBI and Kraken taxonomies
+  string name_data;
+  vector<uint64_t> internal_ids(node_count(), 0);
 
   // Breadth-first search through NCBI taxonomy, assigning internal IDs
   // in sequential order as nodes are encountered via BFS.
-  queue<uint64_t> bfs_queue;
-  bfs_queue.push(1);
-  while (! bfs_queue.empty()) {
+  vector<uint32_t> bfs_queue;
+  bfs_queue.reserve(marked_ct_);
+  bfs_queue.push_back(root_index);
+  uint64_t internal_node_id = 0;
+  for (size_t head = 0; head < bfs_queue.size(); head++) {
     ++internal_node_id;
-    uint64_t external_node_id = bfs_queue.front();
-    bfs_queue.pop();
-    external_id_map[external_node_id] = internal_node_id;
+    auto index = bfs_queue[head];
+    internal_ids[index] = internal_node_id;
 
     TaxonomyNode node = zeroes_node;  // just to initialize node to zeros
-    node.parent_id = external_id_map[ parent_map_[external_node_id] ];
-    node.external_id = external_node_id;
-    node.rank_offset = rank_offsets[ rank_map_[external_node_id] ];
+    auto parent_index = NodeIndex(parent_ids_[index]);
+    if (parent_index < node_count())
+      node.parent_id = internal_ids[parent_index];
+    node.external_id = node_ids_[index];
+    node.rank_offset = rank_offsets[rank_indexes_[index]];
     node.name_offset = name_data.size();
-    node.first_child = internal_node_id + 1 + bfs_queue.size();
-    for (uint64_t child_node : child_map_[external_node_id]) {
+    node.first_child = internal_node_id + bfs_queue.size() - head;
+    for (auto i = child_offsets_[index]; i < child_offsets_[index + 1]; i++) {
       // Only add marked nodes to our internal tree
-      if (marked_nodes_.count(child_node) > 0) {
-        bfs_queue.push(child_node);
+      if (marked_[child_indexes_[i]]) {
+        bfs_queue.push_back(child_indexes_[i]);
         node.child_count++;
       }
     }
     taxo.nodes_[internal_node_id] = node;
 
-    string name = name_map_[external_node_id];
-    name_data.append(name.c_str(), name.size() + 1);
+    const char *name = name_data_ + name_offsets_[index];
+    name_data.append(name, strlen(name) + 1);
   }  // end BFS while loop
 
   taxo.rank_data_ = new char[ rank_data.size() ];
@@ -181,6 +461,7 @@ void NCBITaxonomy::ConvertToKrakenTaxonomy(const char *filename) {
   memcpy(taxo.name_data_, name_data.data(), name_data.size());
   taxo.name_data_len_ = name_data.size();
 
+  taxo.GenerateExternalToInternalIDMap();
   taxo.WriteToDisk(filename);
 }
 
@@ -193,6 +474,7 @@ Taxonomy::Taxonomy(const char *filename, bool memory_mapping) {
 }
 
 void Taxonomy::Init(const char *filename, bool memory_mapping) {
+  ClearIDMap();
   if (memory_mapping) {
     taxonomy_data_file_.OpenFile(filename);
     file_backed_ = true;
@@ -213,6 +495,15 @@ void Taxonomy::Init(const char *filename, bool memory_mapping) {
     name_data_ = ptr;
     ptr += name_data_len_;
     rank_data_ = ptr;
+    ptr += rank_data_len_;
+    // Files written before the ID map was saved end here
+    size_t offset = ptr - taxonomy_data_file_.fptr();
+    offset += (8 - offset % 8) % 8;
+    size_t filesize = taxonomy_data_file_.filesize();
+    ptr = taxonomy_data_file_.fptr() + offset;
+    if (offset + strlen(ID_MAP_MAGIC) <= filesize
+        && strncmp(ID_MAP_MAGIC, ptr, strlen(ID_MAP_MAGIC)) == 0)
+      LoadIDMap(ptr, filesize - offset, filename);
   }
   else {
     std::ifstream ifs(filename);
@@ -233,9 +524,126 @@ void Taxonomy::Init(const char *filename, bool memory_mapping) {
     ifs.read((char *) rank_data_, rank_data_len_);
     if (! ifs)
       errx(EX_DATAERR, "read exhausted taxonomy information in %s", filename);
+    size_t offset = strlen(FILE_MAGIC) + 3 * sizeof(uint64_t)
+                    + sizeof(*nodes_) * node_count_
+                    + name_data_len_ + rank_data_len_;
+    ifs.ignore((8 - offset % 8) % 8);
+    char id_map_magic[strlen(ID_MAP_MAGIC)];
+    ifs.read(id_map_magic, sizeof(id_map_magic));
+    if (ifs && memcmp(id_map_magic, ID_MAP_MAGIC, sizeof(id_map_magic)) == 0)
+      ReadIDMap(ifs, filename);
   }
 }
 
+void Taxonomy::ClearIDMap() {
+  id_map_arrays_ = IDMapArrays();
+  has_id_map_ = false;
+  id_index_size_ = sorted_id_ct_ = id_bucket_ct_ = 0;
+  id_bucket_shift_ = 0;
+  id_index_ = nullptr;
+  sorted_external_ids_ = nullptr;
+  sorted_internal_ids_ = nullptr;
+  id_bucket_starts_ = nullptr;
+}
+
+void Taxonomy::UseIDMapArrays() {
+  auto &arrays = id_map_arrays_;
+  has_id_map_ = true;
+  id_index_size_ = arrays.index.size();
+  sorted_id_ct_ = arrays.external_ids.size();
+  id_bucket_ct_ = arrays.bucket_starts.empty()
+                  ? 0 : arrays.bucket_starts.size() - 1;
+  id_index_ = arrays.index.data();
+  sorted_external_ids_ = arrays.external_ids.data();
+  sorted_internal_ids_ = arrays.internal_ids.data();
+  id_bucket_starts_ = arrays.bucket_starts.data();
+}
+
+// ID map layout, starting at a multiple of 8 bytes into the file: the
+// magic string, then as uint64_t the direct index size, sorted ID count,
+// bucket count and bucket shift.  Then the sorted external IDs (uint64_t),
+// their internal IDs, the bucket starts (bucket count + 1 values, if any
+// buckets) and the direct index (uint32_t), each padded to 8 bytes.
+void Taxonomy::LoadIDMap(const char *ptr, size_t size, const char *filename)
+{
+  uint64_t header[4];
+  size_t header_size = strlen(ID_MAP_MAGIC) + sizeof(header);
+  if (size < header_size)
+    errx(EX_DATAERR, "malformed taxonomy ID map in %s", filename);
+  memcpy((char *) header, ptr + strlen(ID_MAP_MAGIC), sizeof(header));
+  ptr += header_size;
+  auto padded = [](size_t size) { return (size + 7) / 8 * 8; };
+  id_index_size_ = header[0];
+  sorted_id_ct_ = header[1];
+  id_bucket_ct_ = header[2];
+  id_bucket_shift_ = header[3];
+  size_t bucket_start_ct = id_bucket_ct_ ? id_bucket_ct_ + 1 : 0;
+  if (id_bucket_shift_ >= 64 || size != header_size + 8 * sorted_id_ct_
+      + padded(4 * sorted_id_ct_) + padded(4 * bucket_start_ct)
+      + padded(4 * id_index_size_))
+    errx(EX_DATAERR, "malformed taxonomy ID map in %s", filename);
+  sorted_external_ids_ = (const uint64_t *) ptr;
+  ptr += 8 * sorted_id_ct_;
+  sorted_internal_ids_ = (const uint32_t *) ptr;
+  ptr += padded(4 * sorted_id_ct_);
+  id_bucket_starts_ = (const uint32_t *) ptr;
+  ptr += padded(4 * bucket_start_ct);
+  id_index_ = (const uint32_t *) ptr;
+  has_id_map_ = true;
+}
+
+void Taxonomy::ReadIDMap(std::istream &is, const char *filename) {
+  uint64_t header[4];
+  is.read((char *) header, sizeof(header));
+  if (! is || header[3] >= 64)
+    errx(EX_DATAERR, "malformed taxonomy ID map in %s", filename);
+  auto &arrays = id_map_arrays_;
+  arrays.external_ids.resize(header[1]);
+  arrays.internal_ids.resize(header[1]);
+  arrays.bucket_starts.resize(header[2] ? header[2] + 1 : 0);
+  arrays.index.resize(header[0]);
+  id_bucket_shift_ = header[3];
+  auto read_array = [&](void *data, size_t size) {
+    is.read((char *) data, size);
+    is.ignore((8 - size % 8) % 8);
+  };
+  read_array(arrays.external_ids.data(), 8 * arrays.external_ids.size());
+  read_array(arrays.internal_ids.data(), 4 * arrays.internal_ids.size());
+  read_array(arrays.bucket_starts.data(), 4 * arrays.bucket_starts.size());
+  read_array(arrays.index.data(), 4 * arrays.index.size());
+  if (! is)
+    errx(EX_DATAERR, "malformed taxonomy ID map in %s", filename);
+  UseIDMapArrays();
+}
+
+void Taxonomy::WriteIDMap(std::ostream &os) const {
+  const char padding[8] = { 0 };
+  auto write_array = [&](const void *data, size_t size) {
+    os.write((const char *) data, size);
+    os.write(padding, (8 - size % 8) % 8);
+  };
+  uint64_t header[4] = { id_index_size_, sorted_id_ct_, id_bucket_ct_,
+                         id_bucket_shift_ };
+  os.write(ID_MAP_MAGIC, strlen(ID_MAP_MAGIC));
+  write_array(header, sizeof(header));
+  write_array(sorted_external_ids_, 8 * sorted_id_ct_);
+  write_array(sorted_internal_ids_, 4 * sorted_id_ct_);
+  write_array(id_bucket_starts_, 4 * (id_bucket_ct_ ? id_bucket_ct_ + 1 : 0));
+  write_array(id_index_, 4 * id_index_size_);
+}
+
+uint64_t Taxonomy::FindSparseInternalID(uint64_t external_id) const {
+  uint64_t bucket = external_id >> id_bucket_shift_;
+  if (bucket >= id_bucket_ct_)
+    return 0;
+  auto begin = sorted_external_ids_ + id_bucket_starts_[bucket];
+  auto end = sorted_external_ids_ + id_bucket_starts_[bucket + 1];
+  auto it = std::lower_bound(begin, end, external_id);
+  if (it == end || *it != external_id)
+    return 0;
+  return sorted_internal_ids_[it - sorted_external_ids_];
+}
+
 Taxonomy::~Taxonomy() {
   // If file backed, deleting would be... bad.
   if (! file_backed_) {
@@ -245,6 +653,16 @@ Taxonomy::~Taxonomy() {
   }
 }
 
+size_t Taxonomy::memory_usage() const {
+  size_t usage = sizeof(*nodes_) * node_count_ + name_data_len_
+                 + rank_data_len_;
+  if (has_id_map_)
+    usage += sizeof(uint32_t) * id_index_size_
+             + (sizeof(uint64_t) + sizeof(uint32_t)) * sorted_id_ct_
+             + sizeof(uint32_t) * (id_bucket_ct_ + 1);
+  return usage;
+}
+
 // Logic here depends on higher nodes having smaller IDs
 // Idea: advance B tracker up tree, A is ancestor iff B tracker hits A
 bool Taxonomy::IsAAncestorOfB(uint64_t a, uint64_t b) const {
@@ -270,6 +688,11 @@ uint64_t Taxonomy::LowestCommonAncestor(uint64_t a, uint64_t b) const {
   return a;
 }
 
+LCACache::LCACache(const Taxonomy &taxonomy, int size_bits)
+    : taxonomy_(&taxonomy), entries_((size_t) 1 << size_bits, Entry{0, 0}),
+      shift_(64 - size_bits), lookup_ct_(0), hit_ct_(0)
+{ }
+
 // Dump binary data to file
 void Taxonomy::WriteToDisk(const char *filename) const {
   ofstream taxo_file(filename);
@@ -280,16 +703,60 @@ void Taxonomy::WriteToDisk(const char *filename) const {
   taxo_file.write((char *) nodes_, sizeof(*nodes_) * node_count_);
   taxo_file.write(name_data_, name_data_len_);
   taxo_file.write(rank_data_, rank_data_len_);
+  if (has_id_map_) {
+    size_t offset = strlen(FILE_MAGIC) + 3 * sizeof(uint64_t)
+                    + sizeof(*nodes_) * node_count_
+                    + name_data_len_ + rank_data_len_;
+    const char padding[8] = { 0 };
+    taxo_file.write(padding, (8 - offset % 8) % 8);
+    WriteIDMap(taxo_file);
+  }
   if (! taxo_file.good())
     errx(EX_OSERR, "error writing taxonomy to %s", filename);
   taxo_file.close();
 }
 
+// Where external IDs repeat, the last node's is used
 void Taxonomy::GenerateExternalToInternalIDMap() {
-  external_to_internal_id_map_[0] = 0;
-  for (size_t i = 1; i < node_count_; i++) {
-    external_to_internal_id_map_[nodes_[i].external_id] = i;
+  if (has_id_map_)
+    return;
+  if (node_count_ > UINT32_MAX)
+    errx(EX_SOFTWARE, "too many taxonomy nodes to map external IDs");
+  auto &arrays = id_map_arrays_;
+  uint64_t max_id = 0;
+  for (size_t i = 1; i < node_count_; i++)
+    max_id = std::max(max_id, nodes_[i].external_id);
+  // Same density test as NCBITaxonomy's
+  if (max_id < 4 * node_count_ + 1024) {
+    arrays.index.assign(max_id + 1, 0);
+    for (size_t i = 1; i < node_count_; i++)
+      arrays.index[nodes_[i].external_id] = i;
+    UseIDMapArrays();
+    return;
+  }
+
+  vector<std::pair<uint64_t, uint32_t>> ids;
+  ids.reserve(node_count_ - 1);
+  for (size_t i = 1; i < node_count_; i++)
+    ids.emplace_back(nodes_[i].external_id, i);
+  std::sort(ids.begin(), ids.end());
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (i + 1 < ids.size() && ids[i + 1].first == ids[i].first)
+      continue;
+    arrays.external_ids.push_back(ids[i].first);
+    arrays.internal_ids.push_back(ids[i].second);
   }
+  // About four IDs per bucket, were they evenly spread
+  uint64_t shift = 0;
+  while ((max_id >> shift) >= std::max<uint64_t>(ids.size() / 4, 1))
+    shift++;
+  id_bucket_shift_ = shift;
+  arrays.bucket_starts.assign((max_id >> shift) + 2, 0);
+  for (auto id : arrays.external_ids)
+    arrays.bucket_starts[(id >> shift) + 1]++;
+  for (size_t i = 1; i < arrays.bucket_starts.size(); i++)
+    arrays.bucket_starts[i] += arrays.bucket_starts[i - 1];
+  UseIDMapArrays();
 }
 
 }
@@ -23,29 +23,78 @@ struct TaxonomyNode {
   uint64_t godparent_id;  // Reserved for future use to enable faster traversal
 };
 
+// The NCBI taxonomy, parsed from its nodes.dmp and names.dmp files into
+// flat arrays: nodes are stored in taxid order, each node's index being its
+// position, with the names in one arena and the children as a CSR list.
+// The arrays can be saved to a snapshot file, which is memory mapped when
+// loaded, so that the dumps needn't be parsed for every build.
 class NCBITaxonomy {
   public:
   NCBITaxonomy(std::string nodes_filename, std::string names_filename);
+  explicit NCBITaxonomy(const std::string &snapshot_filename);
 
   void MarkNode(uint64_t taxid);
   void ConvertToKrakenTaxonomy(const char *filename);
+  void WriteSnapshot(const char *filename) const;
+  size_t node_count() const { return node_count_; }
+  bool HasNode(uint64_t taxid) const {
+    return NodeIndex(taxid) < node_count();
+  }
+
+  static constexpr const char *SNAPSHOT_MAGIC = "K2NCBITX";
+  // Name of the snapshot in a taxonomy directory
+  static constexpr const char *SNAPSHOT_FILENAME = "taxdump.k2s";
 
   private:
-  std::map<uint64_t, uint64_t> parent_map_;
-  std::map<uint64_t, std::string> name_map_;
-  std::map<uint64_t, std::string> rank_map_;
-  std::map<uint64_t, std::set<uint64_t> > child_map_;
-  std::set<uint64_t> marked_nodes_;
-  std::set<std::string> known_ranks_;
+  NCBITaxonomy(const NCBITaxonomy &rhs) = delete;
+  NCBITaxonomy& operator=(const NCBITaxonomy &rhs) = delete;
+
+  void ParseNodes(const std::string &filename);
+  void ParseNames(const std::string &filename);
+  void UseParsedArrays();
+  void MarkRoot();
+  size_t NodeIndex(uint64_t taxid) const;  // node_count() if not found
+
+  // Arrays parsed from the dumps; a loaded snapshot is used in place
+  struct ParsedArrays {
+    std::vector<uint64_t> node_ids, parent_ids, name_offsets, child_offsets;
+    std::vector<uint32_t> rank_indexes, child_indexes, index_by_id;
+    std::string name_data;
+  };
+  ParsedArrays parsed_;
+  MMapFile snapshot_file_;
+
+  size_t node_count_;
+  size_t child_count_;
+  size_t index_by_id_size_;
+  size_t name_data_len_;
+  const uint64_t *node_ids_;       // sorted
+  const uint64_t *parent_ids_;     // external IDs
+  const uint32_t *rank_indexes_;   // into ranks_
+  const uint64_t *name_offsets_;   // into name_data_
+  const uint64_t *child_offsets_;  // node i's children are
+  const uint32_t *child_indexes_;  //   [child_offsets_[i], [i + 1])
+  const uint32_t *index_by_id_;    // direct lookup, if IDs are dense
+  const char *name_data_;          // NUL-terminated names
+  std::vector<std::string> ranks_;  // sorted
+  std::vector<char> marked_;
+  size_t marked_ct_;
+  // Marked IDs with no node (and 0, their parent), which still take up
+  // space in the converted taxonomy
+  std::set<uint64_t> marked_unknown_ids_;
 };
 
+// Loads the NCBI taxonomy in a directory from its snapshot, if that's at
+// least as new as nodes.dmp and names.dmp, and from the dumps otherwise
+NCBITaxonomy *LoadNCBITaxonomy(const std::string &directory);
+
 class Taxonomy {
   public:
   Taxonomy(const std::string &filename, bool memory_mapping=false);
   Taxonomy(const char *filename, bool memory_mapping=false);
   Taxonomy() : file_backed_(false), nodes_(nullptr), node_count_(0),
       name_data_(nullptr), name_data_len_(0),
-      rank_data_(nullptr), rank_data_len_(0) { }
+      rank_data_(nullptr), rank_data_len_(0) { ClearIDMap(); }
   ~Taxonomy();
 
   inline const TaxonomyNode *nodes() const { return nodes_; }
@@ -57,18 +106,30 @@ class Taxonomy {
   uint64_t LowestCommonAncestor(uint64_t a, uint64_t b) const;
   void WriteToDisk(const char *filename) const;
   void MoveToMemory();
+  // Bytes held by the nodes, names, ranks and external ID map
+  size_t memory_usage() const;
 
+  // Not needed if the map was saved with the taxonomy; 0 is returned for
+  // unknown external IDs
   void GenerateExternalToInternalIDMap();
   uint64_t GetInternalID(uint64_t external_id) const {
-    if (external_to_internal_id_map_.count(external_id) == 0)
-      return 0;
-    return external_to_internal_id_map_.at(external_id);
+    if (id_index_size_ > 0)
+      return external_id < id_index_size_ ? id_index_[external_id] : 0;
+    return FindSparseInternalID(external_id);
   }
 
   private:
   void Init(const char *filename, bool memory_mapping);
+  void ClearIDMap();
+  void UseIDMapArrays();
+  void LoadIDMap(const char *ptr, size_t size, const char *filename);
+  void ReadIDMap(std::istream &is, const char *filename);
+  void WriteIDMap(std::ostream &os) const;
+  uint64_t FindSparseInternalID(uint64_t external_id) const;
 
   char const * const FILE_MAGIC = "K2TAXDAT";
+  // Starts the external to internal ID map, after the rank data
+  char const * const ID_MAP_MAGIC = "K2TAXIDS";
   MMapFile taxonomy_data_file_;
   bool file_backed_;
 
@@ -78,11 +139,72 @@ class Taxonomy {
   size_t name_data_len_;
   char *rank_data_;
   size_t rank_data_len_;
-  std::unordered_map<uint64_t, uint64_t> external_to_internal_id_map_;
+
+  // External to internal ID map: a direct index if the external IDs are
+  // dense, else the sorted external IDs, found via an index of buckets of
+  // 2^id_bucket_shift_ IDs.  Views of id_map_arrays_ or the mapped file.
+  struct IDMapArrays {
+    std::vector<uint32_t> index, internal_ids, bucket_starts;
+    std::vector<uint64_t> external_ids;
+  };
+  IDMapArrays id_map_arrays_;
+  bool has_id_map_;
+  size_t id_index_size_;
+  size_t sorted_id_ct_;
+  size_t id_bucket_ct_;
+  uint64_t id_bucket_shift_;
+  const uint32_t *id_index_;
+  const uint64_t *sorted_external_ids_;
+  const uint32_t *sorted_internal_ids_;
+  const uint32_t *id_bucket_starts_;  // id_bucket_ct_ + 1 values
 
   friend void NCBITaxonomy::ConvertToKrakenTaxonomy(const char *filename);
 };
 
+// Memoizes LCA queries for callers that repeat the same pairs of taxa, as
+// a build does when many strains of a species share minimizers.  Direct
+// mapped; not thread safe, so each thread should have its own.
+class LCACache {
+  public:
+  explicit LCACache(const Taxonomy &taxonomy, int size_bits = 14);
+
+  uint64_t LowestCommonAncestor(uint64_t a, uint64_t b) {
+    if (a == b || ! a || ! b)
+      return a ? a : b;
+    if (a > b)
+      std::swap(a, b);
+    // Internal IDs are node indices, so a pair fits in one key, and no
+    // pair has key 0 (the empty entry's)
+    uint64_t key = (a << 32) | b;
+    auto &entry = entries_[(key * 0x9e3779b97f4a7c15ull) >> shift_];
+    lookup_ct_++;
+    if (entry.key == key) {
+      hit_ct_++;
+      return entry.lca;
+    }
+    entry.key = key;
+    entry.lca = taxonomy_->LowestCommonAncestor(a, b);
+    return entry.lca;
+  }
+
+  uint64_t lookup_ct() const { return lookup_ct_; }
+  uint64_t hit_ct() const { return hit_ct_; }
+
+  private:
+  struct Entry {
+    uint64_t key;
+    uint64_t lca;
+  };
+  const Taxonomy *taxonomy_;
+  std::vector<Entry> entries_;
+  int shift_;
+  uint64_t lookup_ct_;
+  uint64_t hit_ct_;
+  // Keeps the counts, written on every lookup, off the cache lines of the
+  // next cache in a vector of per-thread caches
+  char padding_[64];
+};
+
 }
 
 #endif  // KRAKEN_TAXONOMY_H_